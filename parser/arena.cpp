@@ -0,0 +1,97 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/arena.h"
+#include <stdlib.h>
+#include <new>
+
+ExprArena::ExprArena(size_t blockSize)
+    : m_first(NULL)
+    , m_current(NULL)
+    , m_blockSize(blockSize)
+    , m_bytesUsed(0)
+{
+}
+
+ExprArena::~ExprArena()
+{
+    Block* block = m_first;
+    while (block) {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+ExprArena::Block* ExprArena::newBlock(size_t size)
+{
+    size_t headerSize = (sizeof(Block) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    Block* block = (Block*)malloc(headerSize + size);
+    if (!block)
+        throw std::bad_alloc();
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+char* ExprArena::blockData(Block* block)
+{
+    size_t headerSize = (sizeof(Block) + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+    return (char*)block + headerSize;
+}
+
+void* ExprArena::allocate(size_t size)
+{
+    size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+    if (!m_current || m_current->used + size > m_current->size) {
+        Block* block = newBlock(size > m_blockSize ? size : m_blockSize);
+        if (m_current)
+            m_current->next = block;
+        else
+            m_first = block;
+        m_current = block;
+    }
+
+    void* p = blockData(m_current) + m_current->used;
+    m_current->used += size;
+    m_bytesUsed += size;
+    return p;
+}
+
+void ExprArena::reset()
+{
+    if (!m_first)
+        return;
+
+    Block* block = m_first->next;
+    while (block) {
+        Block* next = block->next;
+        free(block);
+        block = next;
+    }
+
+    m_first->next = NULL;
+    m_first->used = 0;
+    m_current = m_first;
+    m_bytesUsed = 0;
+}
@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_ARENA_H
+#define DRUNKFLY_PARSER_ARENA_H
+
+#include "parser/common.h"
+
+// Owns syntax tree nodes of any number of compiled expressions. Nodes are laid out contiguously in the order
+// they were created and are all released at once by reset() or by the destructor. Expressions parsed into an
+// arena must not be freed individually.
+class ExprArena
+{
+public:
+    explicit ExprArena(size_t blockSize = 16384);
+    ~ExprArena();
+
+    size_t bytesUsed() const { return m_bytesUsed; }
+
+    void* allocate(size_t size);
+
+    // Releases all nodes; the first block is kept for reuse
+    void reset();
+
+private:
+    struct Block
+    {
+        Block* next;
+        size_t size;
+        size_t used;
+    };
+
+    enum { ALIGNMENT = 16 };
+
+    Block* m_first;
+    Block* m_current;
+    size_t m_blockSize;
+    size_t m_bytesUsed;
+
+    static Block* newBlock(size_t size);
+    static char* blockData(Block* block);
+
+    ExprArena(const ExprArena&);
+    ExprArena& operator=(const ExprArena&);
+};
+
+#endif
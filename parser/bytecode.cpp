@@ -0,0 +1,430 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/bytecode.h"
+
+namespace ParserLessOop
+{
+
+// An instruction is the ExprOp of the node it was compiled from, followed by the node's constants in the next words.
+// Operands are taken from the top of the stack, in the order they were pushed, and replaced by the result.
+// Control flow and a few helpers have opcodes of their own.
+enum
+{
+    BC_JUMP = OP_BITXORN + 1,   // target
+    BC_JUMPIFZERO,              // target; pops the condition
+    BC_ANDJUMP,                 // target; jumps keeping the value if it is 0, pops it otherwise
+    BC_ORJUMP,                  // target; jumps replacing the value with 1 if it is not 0, pops it otherwise
+    BC_TOBOOL,
+    BC_CHECKDIVISOR,            // throws if the value on top is 0
+    BC_RETURN,
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Compiler
+
+ExprBytecode::ExprBytecode()
+    : m_instructionCount(0)
+    , m_stackSize(0)
+    , m_depth(0)
+{
+}
+
+void ExprBytecode::compile(const Expr* expr)
+{
+    m_code.clear();
+    m_instructionCount = 0;
+    m_stackSize = 0;
+    m_depth = 0;
+
+    compileNode(expr);
+    emit(BC_RETURN, 0);
+}
+
+void ExprBytecode::emit(int op, int stackEffect)
+{
+    Word word;
+    word.magic = 0;
+    word.op = op;
+    m_code.push_back(word);
+    ++m_instructionCount;
+
+    m_depth += stackEffect;
+    if (m_depth > m_stackSize)
+        m_stackSize = m_depth;
+}
+
+ExprBytecode::Word& ExprBytecode::operand()
+{
+    Word word;
+    word.magic = 0;
+    m_code.push_back(word);
+    return m_code.back();
+}
+
+// Returns the position of the target, to be filled in by patchJump()
+size_t ExprBytecode::emitJump(int op, int stackEffect)
+{
+    emit(op, stackEffect);
+    operand();
+    return m_code.size() - 1;
+}
+
+// Points the jump at the next instruction to be emitted
+void ExprBytecode::patchJump(size_t at)
+{
+    m_code[at].index = m_code.size();
+}
+
+void ExprBytecode::compileNode(const Expr* expr)
+{
+    switch (expr->op) {
+        case OP_NUMBER:
+            emit(OP_NUMBER, 1);
+            operand().value = expr->number;
+            return;
+
+        case OP_CALLBACKVALUE:
+            emit(OP_CALLBACKVALUE, 1);
+            operand().readValue = expr->valuePtr.readValue;
+            return;
+
+        case OP_USERCALLBACKVALUE:
+            emit(OP_USERCALLBACKVALUE, 1);
+            operand().readUserValue = expr->valuePtr.readUserValue;
+            operand().user = expr->valuePtr.user;
+            return;
+
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE:
+            emit(expr->op, 1);
+            operand().ptr = expr->valuePtr.ptr;
+            return;
+
+        case OP_DOLLAR:
+            emit(OP_DOLLAR, 1);
+            return;
+
+        case OP_FUNC0:
+            emit(OP_FUNC0, 1);
+            operand().cb0 = expr->cb0;
+            return;
+
+        case OP_FUNC1:
+        case OP_FUNC2:
+        case OP_FUNC3:
+        case OP_USERFUNC0:
+        case OP_USERFUNC1:
+        case OP_USERFUNC2:
+        case OP_USERFUNC3: {
+            int count = exprOperandCount(expr->op);
+            if (count > 0)
+                compileNode(expr->op1);
+            if (count > 1)
+                compileNode(expr->op2);
+            if (count > 2)
+                compileNode(expr->op3);
+            emit(expr->op, 1 - count);
+            operand().cb0 = expr->cb0;      // the whole callback union
+            if (expr->op >= OP_USERFUNC0)
+                operand().user = expr->user;
+            return;
+        }
+
+        case OP_FUNCN:
+            for (size_t i = 0; i < expr->argCount; i++)
+                compileNode(expr->args[i]);
+            emit(OP_FUNCN, 1 - (int)expr->argCount);
+            operand().cbN = expr->cbN;
+            operand().user = expr->user;
+            operand().index = expr->argCount;
+            return;
+
+        case OP_COND: {
+            compileNode(expr->op1);
+            size_t toElse = emitJump(BC_JUMPIFZERO, -1);
+            size_t depth = m_depth;
+            compileNode(expr->op2);
+            size_t toEnd = emitJump(BC_JUMP, 0);
+            patchJump(toElse);
+            m_depth = depth;
+            compileNode(expr->op3);
+            patchJump(toEnd);
+            return;
+        }
+
+        case OP_LOGICAND:
+        case OP_LOGICOR: {
+            compileNode(expr->op1);
+            size_t toEnd = emitJump(expr->op == OP_LOGICAND ? BC_ANDJUMP : BC_ORJUMP, -1);
+            compileNode(expr->op2);
+            emit(BC_TOBOOL, 0);
+            patchJump(toEnd);
+            return;
+        }
+
+        case OP_MEMBYTE:
+        case OP_MEMWORD:
+        case OP_MEMDWORD:
+        case OP_LOGICNOT:
+        case OP_BITNOT:
+        case OP_NEGATE:
+            compileNode(expr->op1);
+            emit(expr->op, 0);
+            return;
+
+        case OP_DIVIDE:
+        case OP_REMAINDER:
+            // The tree walker checks the divisor before it evaluates the dividend, so the divisor goes first
+            compileNode(expr->op2);
+            if (expr->op2->op != OP_NUMBER || expr->op2->number == 0)
+                emit(BC_CHECKDIVISOR, 0);
+            compileNode(expr->op1);
+            emit(expr->op, -1);
+            return;
+
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC:
+            compileNode(expr->op1);
+            emit(expr->op, 0);
+            operand().value = expr->number;
+            operand().value = expr->shift;
+            if (expr->op == OP_DIVMAGIC || expr->op == OP_REMMAGIC)
+                operand().magic = expr->magic;
+            return;
+
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN:
+            for (size_t i = 0; i < expr->argCount; i++)
+                compileNode(expr->args[i]);
+            emit(expr->op, 1 - (int)expr->argCount);
+            operand().index = expr->argCount;
+            operand().value = expr->number;
+            return;
+
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_EQUAL:
+        case OP_NOTEQUAL:
+        case OP_LESS:
+        case OP_LESSEQUAL:
+        case OP_GREATER:
+        case OP_GREATEREQUAL:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_PLUS:
+        case OP_MINUS:
+        case OP_MULTIPLY:
+            compileNode(expr->op1);
+            compileNode(expr->op2);
+            emit(expr->op, -1);
+            return;
+    }
+
+    throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Interpreter
+
+#define BINARY(op) sp[-2] = sp[-2] op sp[-1]; --sp; break
+
+ExprValue ExprBytecode::evaluate(ExprEvaluator& eval) const
+{
+    enum { LOCAL_STACK_SIZE = 64 };
+    if (m_stackSize <= LOCAL_STACK_SIZE) {
+        ExprValue stack[LOCAL_STACK_SIZE];
+        return run(stack, eval);
+    }
+    std::vector<ExprValue> stack(m_stackSize);
+    return run(&stack[0], eval);
+}
+
+// sp points to a stack of at least m_stackSize values
+ExprValue ExprBytecode::run(ExprValue* sp, ExprEvaluator& eval) const
+{
+    const Word* code = &m_code[0];
+    const Word* pc = code;
+    for (;;) {
+        switch ((pc++)->op) {
+            case OP_NUMBER: *sp++ = pc[0].value; pc += 1; break;
+            case OP_CALLBACKVALUE: *sp++ = pc[0].readValue(); pc += 1; break;
+            case OP_USERCALLBACKVALUE: *sp++ = pc[0].readUserValue(pc[1].user); pc += 2; break;
+            case OP_BYTEVALUE: *sp++ = *(const uint8_t*)pc[0].ptr; pc += 1; break;
+            case OP_WORDVALUE: *sp++ = *(const uint16_t*)pc[0].ptr; pc += 1; break;
+            case OP_U24VALUE: *sp++ = *(const uint16_t*)pc[0].ptr | (*((const uint8_t*)pc[0].ptr + 2) << 16); pc += 1; break;
+            case OP_DWORDVALUE: *sp++ = *(const uint32_t*)pc[0].ptr; pc += 1; break;
+            case OP_DOLLAR: *sp++ = eval.pc(); break;
+            case OP_FUNC0: *sp++ = pc[0].cb0(); pc += 1; break;
+            case OP_FUNC1: sp[-1] = pc[0].cb1(sp[-1]); pc += 1; break;
+            case OP_FUNC2: sp[-2] = pc[0].cb2(sp[-2], sp[-1]); sp -= 1; pc += 1; break;
+            case OP_FUNC3: sp[-3] = pc[0].cb3(sp[-3], sp[-2], sp[-1]); sp -= 2; pc += 1; break;
+            case OP_USERFUNC0: *sp++ = pc[0].ucb0(pc[1].user); pc += 2; break;
+            case OP_USERFUNC1: sp[-1] = pc[0].ucb1(sp[-1], pc[1].user); pc += 2; break;
+            case OP_USERFUNC2: sp[-2] = pc[0].ucb2(sp[-2], sp[-1], pc[1].user); sp -= 1; pc += 2; break;
+            case OP_USERFUNC3: sp[-3] = pc[0].ucb3(sp[-3], sp[-2], sp[-1], pc[1].user); sp -= 2; pc += 2; break;
+            case OP_FUNCN: {
+                size_t count = pc[2].index;
+                sp -= count;
+                *sp = pc[0].cbN(sp, count, pc[1].user);
+                ++sp;
+                pc += 3;
+                break;
+            }
+            case OP_MEMBYTE: sp[-1] = eval.memByte(sp[-1]); break;
+            case OP_MEMWORD: sp[-1] = eval.memWord(sp[-1]); break;
+            case OP_MEMDWORD: sp[-1] = eval.memDword(sp[-1]); break;
+            case OP_LOGICNOT: sp[-1] = !sp[-1]; break;
+            case OP_BITOR: BINARY(|);
+            case OP_BITAND: BINARY(&);
+            case OP_BITXOR: BINARY(^);
+            case OP_BITNOT: sp[-1] = ~sp[-1]; break;
+            case OP_EQUAL: BINARY(==);
+            case OP_NOTEQUAL: BINARY(!=);
+            case OP_LESS: BINARY(<);
+            case OP_LESSEQUAL: BINARY(<=);
+            case OP_GREATER: BINARY(>);
+            case OP_GREATEREQUAL: BINARY(>=);
+            case OP_SHL: sp[-2] = (ExprValue)((ExprUValue)sp[-2] << sp[-1]); --sp; break;
+            case OP_SHR: BINARY(>>);
+            case OP_PLUS: BINARY(+);
+            case OP_MINUS: BINARY(-);
+            case OP_NEGATE: sp[-1] = -sp[-1]; break;
+            case OP_MULTIPLY: BINARY(*);
+            case OP_DIVIDE: sp[-2] = sp[-1] / sp[-2]; --sp; break;     // divisor was pushed first
+            case OP_REMAINDER: sp[-2] = sp[-1] % sp[-2]; --sp; break;
+            case OP_DIVPOW2: {
+                int v = sp[-1];
+                sp[-1] = (v + ((v >> 31) & (pc[0].value - 1))) >> pc[1].value;
+                pc += 2;
+                break;
+            }
+            case OP_REMPOW2: {
+                int v = sp[-1];
+                sp[-1] = v - ((v + ((v >> 31) & (pc[0].value - 1))) & -pc[0].value);
+                pc += 2;
+                break;
+            }
+            case OP_DIVMAGIC: {
+                int v = sp[-1];
+                uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+                int q = (int)((a * pc[2].magic) >> pc[1].value);
+                sp[-1] = (v < 0 ? -q : q);
+                pc += 3;
+                break;
+            }
+            case OP_REMMAGIC: {
+                int v = sp[-1];
+                uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+                int r = (int)(a - ((a * pc[2].magic) >> pc[1].value) * (uint64_t)pc[0].value);
+                sp[-1] = (v < 0 ? -r : r);
+                pc += 3;
+                break;
+            }
+            case OP_SUMN: {
+                size_t count = pc[0].index;
+                uint32_t sum = (uint32_t)pc[1].value;
+                sp -= count;
+                for (size_t i = 0; i < count; i++)
+                    sum += (uint32_t)sp[i];
+                *sp++ = (ExprValue)sum;
+                pc += 2;
+                break;
+            }
+            case OP_PRODUCTN: {
+                size_t count = pc[0].index;
+                uint32_t product = (uint32_t)pc[1].value;
+                sp -= count;
+                for (size_t i = 0; i < count; i++)
+                    product *= (uint32_t)sp[i];
+                *sp++ = (ExprValue)product;
+                pc += 2;
+                break;
+            }
+            case OP_BITANDN: {
+                size_t count = pc[0].index;
+                ExprValue value = pc[1].value;
+                sp -= count;
+                for (size_t i = 0; i < count; i++)
+                    value &= sp[i];
+                *sp++ = value;
+                pc += 2;
+                break;
+            }
+            case OP_BITORN: {
+                size_t count = pc[0].index;
+                ExprValue value = pc[1].value;
+                sp -= count;
+                for (size_t i = 0; i < count; i++)
+                    value |= sp[i];
+                *sp++ = value;
+                pc += 2;
+                break;
+            }
+            case OP_BITXORN: {
+                size_t count = pc[0].index;
+                ExprValue value = pc[1].value;
+                sp -= count;
+                for (size_t i = 0; i < count; i++)
+                    value ^= sp[i];
+                *sp++ = value;
+                pc += 2;
+                break;
+            }
+            case BC_JUMP: pc = code + pc[0].index; break;
+            case BC_JUMPIFZERO: pc = (*--sp == 0 ? code + pc[0].index : pc + 1); break;
+            case BC_ANDJUMP:
+                if (sp[-1] == 0)
+                    pc = code + pc[0].index;
+                else {
+                    --sp;
+                    pc += 1;
+                }
+                break;
+            case BC_ORJUMP:
+                if (sp[-1] != 0) {
+                    sp[-1] = 1;
+                    pc = code + pc[0].index;
+                } else {
+                    --sp;
+                    pc += 1;
+                }
+                break;
+            case BC_TOBOOL: sp[-1] = (sp[-1] != 0); break;
+            case BC_CHECKDIVISOR:
+                if (sp[-1] == 0)
+                    throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero.");
+                break;
+            case BC_RETURN: return sp[-1];
+            default: throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
+        }
+    }
+}
+
+} // namespace
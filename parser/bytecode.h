@@ -0,0 +1,88 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_BYTECODE_H
+#define DRUNKFLY_PARSER_BYTECODE_H
+
+#include "parser/parser_lessoop.h"
+#include <vector>
+
+namespace ParserLessOop
+{
+
+// Expression compiled into a flat program for a stack machine. Each instruction is an opcode word followed by its
+// operands (constants, pointers, callbacks, jump targets) in the next words, so evaluation walks one array from
+// start to end without recursion. Results, including division by zero errors, are the same as those of
+// exprEvaluate() on the tree, but callbacks may be called in a different order. evaluate() may be called from
+// several threads.
+class ExprBytecode
+{
+public:
+    ExprBytecode();
+
+    // Replaces the program; the tree is not referenced afterwards and may be freed
+    void compile(const Expr* expr);
+
+    // Must not be called before compile()
+    ExprValue evaluate(ExprEvaluator& eval) const;
+
+    size_t instructionCount() const { return m_instructionCount; }
+    size_t codeSize() const { return m_code.size(); }   // in words
+    size_t stackSize() const { return m_stackSize; }    // in values
+
+    union Word
+    {
+        int op;
+        ExprValue value;
+        size_t index;
+        const void* ptr;
+        void* user;
+        ExprValue (*readValue)(void);
+        ExprValue (*readUserValue)(void* user);
+        ExprCallback0 cb0;
+        ExprCallback1 cb1;
+        ExprCallback2 cb2;
+        ExprCallback3 cb3;
+        ExprUserCallback0 ucb0;
+        ExprUserCallback1 ucb1;
+        ExprUserCallback2 ucb2;
+        ExprUserCallback3 ucb3;
+        ExprCallbackN cbN;
+        uint64_t magic;
+    };
+
+private:
+    std::vector<Word> m_code;
+    size_t m_instructionCount;
+    size_t m_stackSize;
+    size_t m_depth;     // while compiling
+
+    void emit(int op, int stackEffect);
+    Word& operand();
+    size_t emitJump(int op, int stackEffect);
+    void patchJump(size_t at);
+    void compileNode(const Expr* expr);
+    ExprValue run(ExprValue* sp, ExprEvaluator& eval) const;
+};
+
+} // namespace
+
+#endif
@@ -22,12 +22,207 @@ SOFTWARE.
 #include "parser/common.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
-ExprError::ExprError(const char* message, ...)
+ExprError::ExprError(const char* format, ...)
+    : m_status(EXPR_ERROR)
+    , m_position(EXPR_NO_POSITION)
+    , m_format("")
+    , m_numArgs(0)
+    , m_textLength(0)
+    , m_message(NULL)
 {
     va_list args;
 
-    va_start(args, message);
-    vsnprintf(m_message, sizeof(m_message), message, args);
+    va_start(args, format);
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (length >= 0) {
+        char* message = (char*)malloc((size_t)length + 1);
+        if (message) {
+            vsnprintf(message, (size_t)length + 1, format, args);
+            m_message.store(message, std::memory_order_relaxed);
+            m_format = NULL;
+        }
+    }
     va_end(args);
 }
+
+ExprError::ExprError(ExprStatus status, const char* format, ...)
+    : m_status(status)
+    , m_position(EXPR_NO_POSITION)
+    , m_message(NULL)
+{
+    va_list args;
+
+    va_start(args, format);
+    capture(format, args);
+    va_end(args);
+}
+
+ExprError::ExprError(ExprStatus status, size_t position, const char* format, ...)
+    : m_status(status)
+    , m_position(position)
+    , m_message(NULL)
+{
+    va_list args;
+
+    va_start(args, format);
+    capture(format, args);
+    va_end(args);
+}
+
+ExprError::ExprError(const ExprError& other)
+    : m_message(NULL)
+{
+    *this = other;
+}
+
+void ExprError::freeMessage()
+{
+    free(m_message.exchange(NULL, std::memory_order_relaxed));
+}
+
+ExprError& ExprError::operator=(const ExprError& other)
+{
+    if (this != &other) {
+        freeMessage();
+        m_status = other.m_status;
+        m_position = other.m_position;
+        m_format = other.m_format;
+        m_numArgs = other.m_numArgs;
+        m_textLength = other.m_textLength;
+        memcpy(m_args, other.m_args, sizeof(m_args));
+        memcpy(m_text, other.m_text, (size_t)m_textLength);
+        if (!m_format) {
+            const char* otherMessage = other.m_message.load(std::memory_order_acquire);
+            size_t size = strlen(otherMessage) + 1;
+            char* message = (char*)malloc(size);
+            if (message) {
+                memcpy(message, otherMessage, size);
+                m_message.store(message, std::memory_order_relaxed);
+            } else
+                m_format = "";
+        }
+    }
+    return *this;
+}
+
+// Strings are copied because they usually point into the input; integers are stored as is. For strings the
+// argument slot holds the number of bytes copied into m_text.
+void ExprError::capture(const char* format, va_list args)
+{
+    m_format = format;
+    m_numArgs = 0;
+    m_textLength = 0;
+
+    for (const char* p = format; *p; p++) {
+        if (*p != '%')
+            continue;
+        ++p;
+        if (*p == '%')
+            continue;
+
+        const char* str = NULL;
+        size_t length = 0;
+        int value = 0;
+        if (p[0] == '.' && p[1] == '*' && p[2] == 's') {
+            p += 2;
+            length = (size_t)va_arg(args, int);
+            str = va_arg(args, const char*);
+        } else if (*p == 's') {
+            str = va_arg(args, const char*);
+            length = strlen(str);
+        } else if (*p != 0)
+            value = va_arg(args, int);
+        else
+            break;
+
+        if (m_numArgs >= MAX_ARGS)
+            break;
+
+        if (str) {
+            size_t space = (size_t)(MAX_TEXT - m_textLength);
+            if (length > space)
+                length = space;
+            memcpy(m_text + m_textLength, str, length);
+            m_textLength += (int)length;
+            value = (int)length;
+        }
+
+        m_args[m_numArgs++] = value;
+    }
+}
+
+const char* ExprError::message() const
+{
+    char* message = m_message.load(std::memory_order_acquire);
+    if (message)
+        return message;
+
+    size_t size = strlen(m_format) + (size_t)m_textLength + (size_t)m_numArgs * 12 + 1;
+    message = (char*)malloc(size);
+    if (!message)
+        return m_format;
+
+    char* out = message;
+    const char* text = m_text;
+    int arg = 0;
+    for (const char* p = m_format; *p; p++) {
+        if (*p != '%') {
+            *out++ = *p;
+            continue;
+        }
+        ++p;
+        if (*p == '%') {
+            *out++ = '%';
+            continue;
+        }
+        if (*p == 0 || arg >= m_numArgs)
+            break;
+
+        int value = m_args[arg++];
+        if (p[0] == '.' && p[1] == '*' && p[2] == 's') {
+            p += 2;
+            memcpy(out, text, (size_t)value);
+            text += value;
+            out += value;
+        } else if (*p == 's') {
+            memcpy(out, text, (size_t)value);
+            text += value;
+            out += value;
+        } else if (*p == 'c')
+            *out++ = (char)value;
+        else if (*p == 'u')
+            out += sprintf(out, "%u", (unsigned)value);
+        else if (*p == 'x')
+            out += sprintf(out, "%x", (unsigned)value);
+        else if (*p == 'X')
+            out += sprintf(out, "%X", (unsigned)value);
+        else
+            out += sprintf(out, "%d", value);
+    }
+    *out = 0;
+
+    // Another thread may have formatted the message meanwhile; its copy is kept, as it may already be in use
+    char* expected = NULL;
+    if (!m_message.compare_exchange_strong(expected, message, std::memory_order_acq_rel)) {
+        free(message);
+        return expected;
+    }
+    return message;
+}
+
+uint32_t exprHashName(const char* name, size_t length)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
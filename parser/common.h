@@ -24,31 +24,124 @@ SOFTWARE.
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <atomic>
 
 typedef int ExprValue;
 typedef unsigned int ExprUValue;
 
+enum { EXPR_MAX_IDENT_LENGTH = 128 };
+
+enum ExprStatus
+{
+    EXPR_OK,
+    EXPR_ERROR,                         // thrown through the legacy constructor
+    EXPR_SYNTAX_ERROR,
+    EXPR_INVALID_CHARACTER,
+    EXPR_INVALID_NUMBER,
+    EXPR_IDENTIFIER_TOO_LONG,
+    EXPR_UNKNOWN_IDENTIFIER,
+    EXPR_UNKNOWN_FUNCTION,
+    EXPR_UNKNOWN_DATA_TYPE,
+    EXPR_INVALID_ARGUMENT_COUNT,
+    EXPR_DIVISION_BY_ZERO,
+    EXPR_INTERNAL_ERROR,
+};
+
+#define EXPR_NO_POSITION ((size_t)-1)
+
 class ExprError
 {
 public:
-    ExprError(const char* message, ...);
-    const char* message() const { return m_message; }
+    ExprError() : m_status(EXPR_OK), m_position(EXPR_NO_POSITION), m_format(""), m_numArgs(0), m_textLength(0), m_message(NULL) {}
+    // Takes any printf format and formats the message right away, so the format may be a temporary buffer
+    ExprError(const char* format, ...);
+    // Arguments are captured and the message is only formatted when it is requested. The format string must be a
+    // literal; supported conversions are %c, %d, %i, %u, %x, %X, %s, %.*s and %%, with at most four arguments.
+    ExprError(ExprStatus status, const char* format, ...);
+    ExprError(ExprStatus status, size_t position, const char* format, ...);
+    ExprError(const ExprError& other);
+    ~ExprError() { freeMessage(); }
+
+    ExprError& operator=(const ExprError& other);
+
+    ExprStatus status() const { return m_status; }
+
+    // Offset of the offending token from the start of the input, EXPR_NO_POSITION if unknown
+    size_t position() const { return m_position; }
+    void setPosition(size_t position) { m_position = position; }
+
+    // May be called from several threads at once, the message is formatted by whichever thread comes first
+    const char* message() const;
 
 private:
-    char m_message[2048];
+    enum { MAX_ARGS = 4, MAX_TEXT = EXPR_MAX_IDENT_LENGTH + 32 };
+
+    ExprStatus m_status;
+    size_t m_position;
+    const char* m_format;   // NULL if m_message was formatted by the constructor
+    int m_args[MAX_ARGS];
+    int m_numArgs;
+    int m_textLength;
+    char m_text[MAX_TEXT];
+    mutable std::atomic<char*> m_message;
+
+    void capture(const char* format, va_list args);
+    void freeMessage();
 };
 
+// Exactly one of readValue, readUserValue, ptr and isConstant must be set
 struct ExprValuePtr
 {
     ExprValue (*readValue)(void);
     const void* ptr;
     size_t sizeInBytes;
+    ExprValue (*readUserValue)(void* user);
+    void* user;         // passed to readUserValue
+    bool isConstant;    // value never changes (labels, EQU); it is inlined into the tree as a number
+    ExprValue value;
+};
+
+#define EXPR_NO_SYMBOL 0xffffffffu
+
+struct ExprSymbol
+{
+    const char* name;   // not NUL-terminated
+    size_t length;
+    uint32_t id;        // stable for the lifetime of ExprSymbolPool, EXPR_NO_SYMBOL if not interned
+    uint32_t hash;      // see exprHashName()
 };
 
-enum { EXPR_MAX_FUNC_ARGS = 3 };
+uint32_t exprHashName(const char* name, size_t length);
+
+enum { EXPR_MAX_FUNC_ARGS = 3, EXPR_MAX_VARIADIC_ARGS = 32 };
 typedef ExprValue (*ExprCallback0)(void);
 typedef ExprValue (*ExprCallback1)(ExprValue v1);
 typedef ExprValue (*ExprCallback2)(ExprValue v1, ExprValue v2);
 typedef ExprValue (*ExprCallback3)(ExprValue v1, ExprValue v2, ExprValue v3);
+// Same, with a context pointer given by the resolver, e.g. the emulator instance
+typedef ExprValue (*ExprUserCallback0)(void* user);
+typedef ExprValue (*ExprUserCallback1)(ExprValue v1, void* user);
+typedef ExprValue (*ExprUserCallback2)(ExprValue v1, ExprValue v2, void* user);
+typedef ExprValue (*ExprUserCallback3)(ExprValue v1, ExprValue v2, ExprValue v3, void* user);
+// Arguments are evaluated into an array on the stack, so a call does not allocate
+typedef ExprValue (*ExprCallbackN)(const ExprValue* args, size_t count, void* user);
+
+// Callback for every number of arguments a function accepts, NULL for the others. A call with up to
+// EXPR_MAX_FUNC_ARGS arguments uses the fixed-arity callback when there is one (cbX before ucbX), anything else
+// goes to cbN.
+struct ExprFunction
+{
+    ExprCallback0 cb0;
+    ExprCallback1 cb1;
+    ExprCallback2 cb2;
+    ExprCallback3 cb3;
+    ExprUserCallback0 ucb0;
+    ExprUserCallback1 ucb1;
+    ExprUserCallback2 ucb2;
+    ExprUserCallback3 ucb3;
+    ExprCallbackN cbN;  // up to EXPR_MAX_VARIADIC_ARGS arguments
+    void* user;         // passed to ucb0 ... ucb3 and cbN
+};
 
 #endif
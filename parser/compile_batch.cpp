@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/compile_batch.h"
+#include "parser/lexer.h"
+#include "parser/symbol_pool.h"
+#include <string.h>
+#include <vector>
+
+template <typename RESULT> struct BatchContext
+{
+    const char* const* inputs;
+    ExprResolver* resolver;
+    ExprResolver* const* resolvers;
+    RESULT* results;
+};
+
+template <typename RESULT> static ExprResolver& batchResolver(BatchContext<RESULT>* c, size_t worker)
+{
+    return (c->resolvers ? *c->resolvers[worker] : *c->resolver);
+}
+
+template <typename RESULT, RESULT (*TRYPARSE)(const char*, size_t, ExprResolver&), void (*FREE)(RESULT&)>
+static size_t runBatch(const char* const* inputs, size_t n, ExprResolver* resolver,
+    ExprResolver* const* resolvers, ExprWorkerPool& pool, RESULT* results)
+{
+    struct Task
+    {
+        static void run(void* context, size_t worker, size_t index)
+        {
+            BatchContext<RESULT>* c = (BatchContext<RESULT>*)context;
+            const char* input = c->inputs[index];
+            c->results[index] = TRYPARSE(input, strlen(input), batchResolver(c, worker));
+        }
+    };
+
+    for (size_t i = 0; i < n; i++)
+        results[i].expr = NULL;
+
+    BatchContext<RESULT> c;
+    c.inputs = inputs;
+    c.resolver = resolver;
+    c.resolvers = resolvers;
+    c.results = results;
+
+    try {
+        pool.run(n, Task::run, &c);
+    } catch (...) {
+        for (size_t i = 0; i < n; i++)
+            FREE(results[i]);
+        throw;
+    }
+
+    size_t failed = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!results[i].expr)
+            ++failed;
+    }
+    return failed;
+}
+
+// Serves names from the results of resolveMany(); read only, so it can be used by many threads at once
+class ResolvedNames : public ExprResolver
+{
+public:
+    explicit ResolvedNames(ExprResolver& resolver) : m_resolver(resolver) {}
+
+    void collect(const char* const* inputs, size_t n);
+    void resolve();
+
+    uint32_t generation() const { return m_resolver.generation(); }
+
+    bool resolveVariable(const ExprSymbol& symbol, ExprValuePtr& result)
+    {
+        const ExprNameResult* resolved = find(symbol, m_variables);
+        if (!resolved)
+            return false;
+        result = resolved->variable;
+        return resolved->found;
+    }
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        const ExprNameResult* resolved = find(symbol, m_functions);
+        if (!resolved)
+            return false;
+        result = resolved->function;
+        return resolved->found;
+    }
+
+private:
+    enum { NONE = 0xffffffffu };
+
+    ExprResolver& m_resolver;
+    ExprSymbolPool m_pool;
+    std::vector<uint32_t> m_variables;      // index of result by symbol ID
+    std::vector<uint32_t> m_functions;
+    std::vector<ExprNameRequest> m_names;
+    std::vector<ExprNameResult> m_results;
+
+    const ExprNameResult* find(const ExprSymbol& symbol, const std::vector<uint32_t>& index) const
+    {
+        uint32_t id = m_pool.find(symbol.name, symbol.length, symbol.hash);
+        if (id == EXPR_NO_SYMBOL || index[id] == NONE)
+            return NULL;
+        return &m_results[index[id]];
+    }
+};
+
+void ResolvedNames::collect(const char* const* inputs, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        // Stops at a lexer error, parsing will report it
+        ExprTokenReader reader;
+        ExprError error;
+        if (!exprInitTokenReader(&reader, inputs[i], strlen(inputs[i]), &m_pool, &error))
+            continue;
+
+        for (;;) {
+            if (reader.cur.id == TOK_END)
+                break;
+            if (reader.cur.id == TOK_IDENT && reader.next.id != TOK_AT) {
+                std::vector<uint32_t>& index = (reader.next.id == TOK_LPAREN ? m_functions : m_variables);
+                if (index.size() < m_pool.count()) {
+                    m_variables.resize(m_pool.count(), NONE);
+                    m_functions.resize(m_pool.count(), NONE);
+                }
+                if (index[reader.cur.symbol] == NONE) {
+                    index[reader.cur.symbol] = (uint32_t)m_names.size();
+                    ExprNameRequest name;
+                    name.symbol.id = reader.cur.symbol;
+                    name.function = (&index == &m_functions);
+                    m_names.push_back(name);
+                }
+            }
+            if (!exprReadToken(&reader, &error))
+                break;
+        }
+    }
+}
+
+void ResolvedNames::resolve()
+{
+    // Names stay where they are once nothing else is interned
+    for (size_t i = 0; i < m_names.size(); i++)
+        m_names[i].symbol = m_pool.symbol(m_names[i].symbol.id);
+
+    ExprNameResult empty;
+    memset(&empty, 0, sizeof(empty));
+    m_results.assign(m_names.size(), empty);
+    if (!m_names.empty())
+        m_resolver.resolveMany(&m_names[0], m_names.size(), &m_results[0]);
+}
+
+template <typename RESULT, RESULT (*TRYPARSE)(const char*, size_t, ExprResolver&), void (*FREE)(RESULT&)>
+static size_t compileResolved(const char* const* inputs, size_t n, ExprResolver& resolver,
+    RESULT* results, ExprWorkerPool* pool)
+{
+    ResolvedNames names(resolver);
+    names.collect(inputs, n);
+    names.resolve();
+
+    if (pool)
+        return runBatch<RESULT, TRYPARSE, FREE>(inputs, n, &names, NULL, *pool, results);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < n; i++) {
+        results[i] = TRYPARSE(inputs[i], strlen(inputs[i]), names);
+        if (!results[i].expr)
+            ++failed;
+    }
+    return failed;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace ParserOop
+{
+
+static ParseResult tryParse(const char* input, size_t length, ExprResolver& resolver)
+{
+    return Expr::tryParse(input, length, resolver);
+}
+
+static void freeResult(ParseResult& result)
+{
+    delete result.expr;
+    result.expr = NULL;
+}
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprWorkerPool& pool, ParseResult* results)
+{
+    return runBatch<ParseResult, tryParse, freeResult>(inputs, n, &resolver, NULL, pool, results);
+}
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver* const* resolvers,
+    ExprWorkerPool& pool, ParseResult* results)
+{
+    return runBatch<ParseResult, tryParse, freeResult>(inputs, n, NULL, resolvers, pool, results);
+}
+
+size_t compileResolved(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ParseResult* results, ExprWorkerPool* pool)
+{
+    return ::compileResolved<ParseResult, tryParse, freeResult>(inputs, n, resolver, results, pool);
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace ParserLessOop
+{
+
+static ExprParseResult tryParse(const char* input, size_t length, ExprResolver& resolver)
+{
+    return exprTryParse(input, length, resolver);
+}
+
+static void freeResult(ExprParseResult& result)
+{
+    exprFree(result.expr);
+    result.expr = NULL;
+}
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprWorkerPool& pool, ExprParseResult* results)
+{
+    return runBatch<ExprParseResult, tryParse, freeResult>(inputs, n, &resolver, NULL, pool, results);
+}
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver* const* resolvers,
+    ExprWorkerPool& pool, ExprParseResult* results)
+{
+    return runBatch<ExprParseResult, tryParse, freeResult>(inputs, n, NULL, resolvers, pool, results);
+}
+
+size_t compileResolved(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprParseResult* results, ExprWorkerPool* pool)
+{
+    return ::compileResolved<ExprParseResult, tryParse, freeResult>(inputs, n, resolver, results, pool);
+}
+
+} // namespace
@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_COMPILE_BATCH_H
+#define DRUNKFLY_PARSER_COMPILE_BATCH_H
+
+#include "parser/parser_oop.h"
+#include "parser/parser_lessoop.h"
+#include "parser/worker_pool.h"
+
+// Compile independent NUL-terminated expressions in parallel on a worker pool. results[i] receives the outcome
+// of inputs[i] exactly as tryParse() would report it; the return value is the number of failed inputs.
+//
+// With a single resolver, it is called from all pool threads at the same time and must be safe for that: lookups
+// in tables that are not modified during the batch are, anything that caches or counts needs its own locking.
+// Alternatively pass an array of pool.threadCount() resolvers; each is then only used by one thread at a time.
+// An exception thrown by a resolver stops the batch and is rethrown after all threads have stopped; expressions
+// compiled up to that point are freed and every result has a NULL expression.
+//
+// compileResolved() compiles in two phases: it first lexes all inputs, collecting every distinct name, and resolves
+// them with a single ExprResolver::resolveMany() call; it then parses, taking names from those results. The
+// resolver is only called from the calling thread, so it needs no locking even when a pool is given for parsing.
+
+namespace ParserOop
+{
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprWorkerPool& pool, ParseResult* results);
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver* const* resolvers,
+    ExprWorkerPool& pool, ParseResult* results);
+size_t compileResolved(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ParseResult* results, ExprWorkerPool* pool = NULL);
+
+} // namespace
+
+namespace ParserLessOop
+{
+
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprWorkerPool& pool, ExprParseResult* results);
+size_t compileBatch(const char* const* inputs, size_t n, ExprResolver* const* resolvers,
+    ExprWorkerPool& pool, ExprParseResult* results);
+size_t compileResolved(const char* const* inputs, size_t n, ExprResolver& resolver,
+    ExprParseResult* results, ExprWorkerPool* pool = NULL);
+
+} // namespace
+
+#endif
@@ -0,0 +1,202 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/expr_cache.h"
+#include <string.h>
+
+ExprCacheBase::ExprCacheBase(size_t capacity, size_t shardCount, CompileFunc compile, FreeFunc free)
+    : m_compile(compile)
+    , m_free(free)
+    , m_hits(0)
+    , m_misses(0)
+    , m_evictions(0)
+{
+    if (capacity < 1)
+        capacity = 1;
+    if (shardCount < 1)
+        shardCount = 1;
+    if (shardCount > capacity)
+        shardCount = capacity;
+
+    m_shards = new Shard[shardCount];
+    m_shardCount = shardCount;
+    m_shardCapacity = (capacity + shardCount - 1) / shardCount;
+    m_capacity = m_shardCapacity * shardCount;
+}
+
+ExprCacheBase::~ExprCacheBase()
+{
+    delete[] m_shards;
+}
+
+size_t ExprCacheBase::size() const
+{
+    size_t size = 0;
+    for (size_t i = 0; i < m_shardCount; i++) {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        size += m_shards[i].index.size();
+    }
+    return size;
+}
+
+void ExprCacheBase::clear()
+{
+    for (size_t i = 0; i < m_shardCount; i++) {
+        std::lock_guard<std::mutex> lock(m_shards[i].mutex);
+        m_shards[i].index.clear();
+        m_shards[i].entries.clear();
+    }
+}
+
+// Characters that are always a token on their own, so whitespace next to them can be dropped
+static bool isSingleCharToken(char ch)
+{
+    return ch != 0 && strchr("()[],?:+-*/%^~@", ch) != NULL;
+}
+
+// Key is the resolver generation followed by the input with all whitespace removed, except for a single space
+// between characters that could otherwise merge into one token. This never changes how the input is tokenized.
+static void makeKey(std::string& key, const char* input, size_t length, uint32_t generation)
+{
+    key.reserve(sizeof(generation) + length);
+    key.assign((const char*)&generation, sizeof(generation));
+
+    bool space = false;
+    for (size_t i = 0; i < length; i++) {
+        char ch = input[i];
+        if (ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+            space = true;
+            continue;
+        }
+        if (space && key.size() > sizeof(generation)
+                && !isSingleCharToken(key[key.size() - 1]) && !isSingleCharToken(ch))
+            key += ' ';
+        space = false;
+        key += ch;
+    }
+}
+
+std::shared_ptr<const void> ExprCacheBase::lookup(const char* input, size_t length, ExprResolver& resolver)
+{
+    std::string key;
+    makeKey(key, input, length, resolver.generation());
+
+    Shard* shard = &m_shards[std::hash<std::string>()(key) % m_shardCount];
+
+    {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        std::unordered_map<std::string, EntryList::iterator>::iterator it = shard->index.find(key);
+        if (it != shard->index.end()) {
+            shard->entries.splice(shard->entries.begin(), shard->entries, it->second);
+            m_hits.fetch_add(1, std::memory_order_relaxed);
+            return it->second->expr;
+        }
+    }
+
+    // Compile without holding the lock; if another thread compiled the same text meanwhile, its result wins
+    m_misses.fetch_add(1, std::memory_order_relaxed);
+    std::shared_ptr<const void> expr(m_compile(input, length, resolver), m_free);
+
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    std::unordered_map<std::string, EntryList::iterator>::iterator it = shard->index.find(key);
+    if (it != shard->index.end()) {
+        shard->entries.splice(shard->entries.begin(), shard->entries, it->second);
+        return it->second->expr;
+    }
+
+    if (shard->index.size() >= m_shardCapacity) {
+        shard->index.erase(shard->entries.back().key);
+        shard->entries.pop_back();
+        m_evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    Entry entry;
+    entry.key = key;
+    entry.expr = expr;
+    shard->entries.push_front(entry);
+    shard->index[key] = shard->entries.begin();
+
+    return expr;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace ParserOop
+{
+
+static const void* compileExpr(const char* input, size_t length, ExprResolver& resolver)
+{
+    return Expr::parse(input, length, resolver);
+}
+
+static void freeExpr(const void* expr)
+{
+    delete (const Expr*)expr;
+}
+
+ExprCache::ExprCache(size_t capacity, size_t shardCount)
+    : ExprCacheBase(capacity, shardCount, compileExpr, freeExpr)
+{
+}
+
+std::shared_ptr<const Expr> ExprCache::compile(const char* input, ExprResolver& resolver)
+{
+    return compile(input, strlen(input), resolver);
+}
+
+std::shared_ptr<const Expr> ExprCache::compile(const char* input, size_t length, ExprResolver& resolver)
+{
+    return std::static_pointer_cast<const Expr>(lookup(input, length, resolver));
+}
+
+} // namespace
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+namespace ParserLessOop
+{
+
+static const void* compileExpr(const char* input, size_t length, ExprResolver& resolver)
+{
+    return exprParse(input, length, resolver);
+}
+
+static void freeExpr(const void* expr)
+{
+    exprFree((Expr*)expr);
+}
+
+ExprCache::ExprCache(size_t capacity, size_t shardCount)
+    : ExprCacheBase(capacity, shardCount, compileExpr, freeExpr)
+{
+}
+
+std::shared_ptr<const Expr> ExprCache::compile(const char* input, ExprResolver& resolver)
+{
+    return compile(input, strlen(input), resolver);
+}
+
+std::shared_ptr<const Expr> ExprCache::compile(const char* input, size_t length, ExprResolver& resolver)
+{
+    return std::static_pointer_cast<const Expr>(lookup(input, length, resolver));
+}
+
+} // namespace
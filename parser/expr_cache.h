@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_EXPR_CACHE_H
+#define DRUNKFLY_PARSER_EXPR_CACHE_H
+
+#include "parser/parser_oop.h"
+#include "parser/parser_lessoop.h"
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// Bounded LRU cache of compiled expressions, safe to use from multiple threads. Entries are keyed by the source
+// text with insignificant whitespace removed and by ExprResolver::generation(), so one cache should only be used
+// with resolvers that agree on what a given generation resolves to. Compiled expressions are shared and must not be
+// modified; an evicted expression is freed when its last user releases it. Failed compilations are not cached.
+class ExprCacheBase
+{
+public:
+    size_t capacity() const { return m_capacity; }
+    size_t size() const;
+
+    uint64_t hits() const { return m_hits.load(std::memory_order_relaxed); }
+    uint64_t misses() const { return m_misses.load(std::memory_order_relaxed); }
+    uint64_t evictions() const { return m_evictions.load(std::memory_order_relaxed); }
+
+    void clear();
+
+protected:
+    typedef const void* (*CompileFunc)(const char* input, size_t length, ExprResolver& resolver);
+    typedef void (*FreeFunc)(const void* expr);
+
+    ExprCacheBase(size_t capacity, size_t shardCount, CompileFunc compile, FreeFunc free);
+    ~ExprCacheBase();
+
+    std::shared_ptr<const void> lookup(const char* input, size_t length, ExprResolver& resolver);
+
+private:
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<const void> expr;
+    };
+
+    typedef std::list<Entry> EntryList;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        EntryList entries;      // most recently used first
+        std::unordered_map<std::string, EntryList::iterator> index;
+    };
+
+    Shard* m_shards;
+    size_t m_shardCount;
+    size_t m_shardCapacity;
+    size_t m_capacity;
+    CompileFunc m_compile;
+    FreeFunc m_free;
+    std::atomic<uint64_t> m_hits;
+    std::atomic<uint64_t> m_misses;
+    std::atomic<uint64_t> m_evictions;
+
+    ExprCacheBase(const ExprCacheBase&);
+    ExprCacheBase& operator=(const ExprCacheBase&);
+};
+
+namespace ParserOop
+{
+
+class ExprCache : public ExprCacheBase
+{
+public:
+    // Capacity is split evenly between shards, each shard evicts its least recently used entry on its own
+    explicit ExprCache(size_t capacity = 1024, size_t shardCount = 8);
+
+    std::shared_ptr<const Expr> compile(const char* input, ExprResolver& resolver);
+    std::shared_ptr<const Expr> compile(const char* input, size_t length, ExprResolver& resolver);
+};
+
+} // namespace
+
+namespace ParserLessOop
+{
+
+class ExprCache : public ExprCacheBase
+{
+public:
+    // Capacity is split evenly between shards, each shard evicts its least recently used entry on its own
+    explicit ExprCache(size_t capacity = 1024, size_t shardCount = 8);
+
+    std::shared_ptr<const Expr> compile(const char* input, ExprResolver& resolver);
+    std::shared_ptr<const Expr> compile(const char* input, size_t length, ExprResolver& resolver);
+};
+
+} // namespace
+
+#endif
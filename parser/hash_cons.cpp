@@ -0,0 +1,224 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/hash_cons.h"
+#include <string.h>
+
+namespace ParserLessOop
+{
+
+static bool isFunc(ExprOp op)
+{
+    return (op >= OP_FUNC0 && op <= OP_FUNC3) || (op >= OP_USERFUNC0 && op <= OP_USERFUNC3) || op == OP_FUNCN;
+}
+
+static uint32_t mix(uint32_t hash, uint64_t value)
+{
+    hash = (hash ^ (uint32_t)value) * 16777619u;
+    hash = (hash ^ (uint32_t)(value >> 32)) * 16777619u;
+    return hash;
+}
+
+// Only the fields used by the node's operation take part; children are already shared, so they are compared
+// by pointer.
+static uint32_t hashNode(const Expr* expr)
+{
+    uint32_t hash = mix(2166136261u, (uint64_t)expr->op);
+    switch (expr->op) {
+        case OP_NUMBER: return mix(hash, (uint64_t)(uint32_t)expr->number);
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC: hash = mix(hash, (uint64_t)(uint32_t)expr->number); break;
+        case OP_CALLBACKVALUE: return mix(hash, (uint64_t)(uintptr_t)expr->valuePtr.readValue);
+        case OP_USERCALLBACKVALUE:
+            hash = mix(hash, (uint64_t)(uintptr_t)expr->valuePtr.readUserValue);
+            return mix(hash, (uint64_t)(uintptr_t)expr->valuePtr.user);
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE: return mix(hash, (uint64_t)(uintptr_t)expr->valuePtr.ptr);
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN:
+            hash = mix(hash, (uint64_t)(uint32_t)expr->number);
+            for (size_t i = 0; i < expr->argCount; i++)
+                hash = mix(hash, (uint64_t)(uintptr_t)expr->args[i]);
+            return hash;
+        default: break;
+    }
+
+    int count = exprOperandCount(expr->op);
+    if (count > 0)
+        hash = mix(hash, (uint64_t)(uintptr_t)expr->op1);
+    if (count > 1)
+        hash = mix(hash, (uint64_t)(uintptr_t)expr->op2);
+    if (count > 2)
+        hash = mix(hash, (uint64_t)(uintptr_t)expr->op3);
+    return hash;
+}
+
+static bool sameNode(const Expr* a, const Expr* b)
+{
+    if (a->op != b->op)
+        return false;
+
+    switch (a->op) {
+        case OP_NUMBER: return a->number == b->number;
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC: if (a->number != b->number) return false; break;
+        case OP_CALLBACKVALUE: return a->valuePtr.readValue == b->valuePtr.readValue;
+        case OP_USERCALLBACKVALUE:
+            return a->valuePtr.readUserValue == b->valuePtr.readUserValue && a->valuePtr.user == b->valuePtr.user;
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE: return a->valuePtr.ptr == b->valuePtr.ptr;
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN:
+            if (a->number != b->number || a->argCount != b->argCount)
+                return false;
+            for (size_t i = 0; i < a->argCount; i++) {
+                if (a->args[i] != b->args[i])
+                    return false;
+            }
+            return true;
+        default: break;
+    }
+
+    int count = exprOperandCount(a->op);
+    return (count < 1 || a->op1 == b->op1) && (count < 2 || a->op2 == b->op2) && (count < 3 || a->op3 == b->op3);
+}
+
+ExprHashCons::ExprHashCons()
+    : m_table(NULL)
+    , m_tableSize(0)
+    , m_sharedCount(0)
+    , m_nodeCountBefore(0)
+    , m_nodeCountAfter(0)
+{
+}
+
+ExprHashCons::~ExprHashCons()
+{
+    delete[] m_table;
+}
+
+const Expr* ExprHashCons::add(Expr* expr)
+{
+    bool pure;
+    const Expr* result = intern(expr, &pure);
+    exprFree(expr);
+    return result;
+}
+
+const Expr* ExprHashCons::newNode(const Expr* expr)
+{
+    Expr* node = (Expr*)m_arena.allocate(sizeof(Expr));
+    memcpy(node, expr, sizeof(Expr));
+    ++m_nodeCountAfter;
+    return node;
+}
+
+const Expr* ExprHashCons::intern(const Expr* expr, bool* pure)
+{
+    ++m_nodeCountBefore;
+
+    // Children first, so that this node can be compared shallowly
+    Expr node;
+    memset(&node, 0, sizeof(node));
+    node.op = expr->op;
+    node.number = expr->number;
+    node.valuePtr = expr->valuePtr;
+    node.magic = expr->magic;   // the widest member, so this copies the callbacks as well
+    node.user = expr->user;
+    node.argCount = expr->argCount;
+
+    bool childPure[3] = { true, true, true };
+    int count = exprOperandCount(expr->op);
+    if (count > 0)
+        node.op1 = (Expr*)intern(expr->op1, &childPure[0]);
+    if (count > 1)
+        node.op2 = (Expr*)intern(expr->op2, &childPure[1]);
+    if (count > 2)
+        node.op3 = (Expr*)intern(expr->op3, &childPure[2]);
+    bool argsPure = true;
+    if (exprHasArgs(expr->op) && expr->argCount > 0) {
+        node.args = (Expr**)m_arena.allocate(expr->argCount * sizeof(Expr*));
+        node.argCount = expr->argCount;
+        for (size_t i = 0; i < expr->argCount; i++) {
+            bool argPure;
+            node.args[i] = (Expr*)intern(expr->args[i], &argPure);
+            argsPure = argsPure && argPure;
+        }
+    }
+
+    *pure = !isFunc(expr->op) && childPure[0] && childPure[1] && childPure[2] && argsPure;
+    if (!*pure)
+        return newNode(&node);
+
+    // Keep load factor below 1/2
+    if ((m_sharedCount + 1) * 2 > m_tableSize)
+        rehash(m_tableSize > 0 ? m_tableSize * 2 : 1024);
+
+    uint32_t hash = hashNode(&node);
+    size_t mask = m_tableSize - 1;
+    size_t slot = hash & mask;
+    while (m_table[slot].node) {
+        if (m_table[slot].hash == hash && sameNode(m_table[slot].node, &node))
+            return m_table[slot].node;
+        slot = (slot + 1) & mask;
+    }
+
+    m_table[slot].hash = hash;
+    m_table[slot].node = newNode(&node);
+    ++m_sharedCount;
+    return m_table[slot].node;
+}
+
+void ExprHashCons::rehash(size_t tableSize)
+{
+    Slot* table = new Slot[tableSize];
+    memset(table, 0, tableSize * sizeof(Slot));
+
+    size_t mask = tableSize - 1;
+    for (size_t i = 0; i < m_tableSize; i++) {
+        if (!m_table[i].node)
+            continue;
+        size_t slot = m_table[i].hash & mask;
+        while (table[slot].node)
+            slot = (slot + 1) & mask;
+        table[slot] = m_table[i];
+    }
+
+    delete[] m_table;
+    m_table = table;
+    m_tableSize = tableSize;
+}
+
+} // namespace
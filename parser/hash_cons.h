@@ -0,0 +1,72 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_HASH_CONS_H
+#define DRUNKFLY_PARSER_HASH_CONS_H
+
+#include "parser/parser_lessoop.h"
+#include "parser/arena.h"
+
+namespace ParserLessOop
+{
+
+// Stores many expressions as one DAG: structurally identical side-effect-free subtrees are kept only once and
+// shared. Function calls are never shared, but their arguments can be. All nodes live in an arena owned by this
+// object, so the returned expressions stay valid until it is destroyed and must not be passed to exprFree().
+// Not thread safe.
+class ExprHashCons
+{
+public:
+    ExprHashCons();
+    ~ExprHashCons();
+
+    // Takes ownership of the expression (it is freed) and returns the shared equivalent
+    const Expr* add(Expr* expr);
+
+    // Number of nodes in all expressions passed to add(), and number of nodes actually stored
+    size_t nodeCountBefore() const { return m_nodeCountBefore; }
+    size_t nodeCountAfter() const { return m_nodeCountAfter; }
+
+private:
+    struct Slot
+    {
+        uint32_t hash;
+        const Expr* node;   // NULL if slot is empty
+    };
+
+    ExprArena m_arena;
+    Slot* m_table;
+    size_t m_tableSize;
+    size_t m_sharedCount;
+    size_t m_nodeCountBefore;
+    size_t m_nodeCountAfter;
+
+    const Expr* intern(const Expr* expr, bool* pure);
+    const Expr* newNode(const Expr* expr);
+    void rehash(size_t tableSize);
+
+    ExprHashCons(const ExprHashCons&);
+    ExprHashCons& operator=(const ExprHashCons&);
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,356 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/incremental.h"
+#include <algorithm>
+
+namespace ParserLessOop
+{
+
+// Resolved names are remembered, so that re-parsing only calls the real resolver for names not seen before
+class ExprIncremental::Resolver : public ExprResolver
+{
+public:
+    Resolver(ExprIncremental* owner, ExprResolver& resolver) : m_owner(owner), m_resolver(resolver) {}
+
+    uint32_t generation() const { return m_resolver.generation(); }
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        std::string name(symbol.name, symbol.length);
+        std::unordered_map<std::string, Function>::iterator it = m_owner->m_functions.find(name);
+        if (it == m_owner->m_functions.end()) {
+            Function function;
+            function.callbacks = result;
+            function.found = m_resolver.resolveFunction(symbol, function.callbacks);
+            it = m_owner->m_functions.insert(std::make_pair(name, function)).first;
+        }
+        result = it->second.callbacks;
+        return it->second.found;
+    }
+
+    bool resolveVariable(const ExprSymbol& symbol, ExprValuePtr& result)
+    {
+        std::string name(symbol.name, symbol.length);
+        std::unordered_map<std::string, Variable>::iterator it = m_owner->m_variables.find(name);
+        if (it == m_owner->m_variables.end()) {
+            Variable variable;
+            variable.ptr = result;
+            variable.found = m_resolver.resolveVariable(symbol, variable.ptr);
+            it = m_owner->m_variables.insert(std::make_pair(name, variable)).first;
+        }
+        result = it->second.ptr;
+        return it->second.found;
+    }
+
+private:
+    ExprIncremental* m_owner;
+    ExprResolver& m_resolver;
+};
+
+// Names that are typed character by character leave many prefixes behind
+static const size_t MAX_REMEMBERED_NAMES = 4096;
+
+static bool sameToken(const ExprStreamToken& a, const ExprStreamToken& b)
+{
+    return a.id == b.id && a.offset == b.offset && a.length == b.length && a.number == b.number;
+}
+
+static bool tokenEndsBefore(const ExprStreamToken& token, size_t offset)
+{
+    return token.offset + token.length < offset;
+}
+
+static bool tokenStartsBefore(const ExprStreamToken& token, size_t offset)
+{
+    return token.offset < offset;
+}
+
+static Expr** findSlot(Expr** slot, const Expr* expr)
+{
+    if (*slot == expr)
+        return slot;
+
+    int count = exprOperandCount((*slot)->op);
+    Expr** result = NULL;
+    if (count > 0)
+        result = findSlot(&(*slot)->op1, expr);
+    if (!result && count > 1)
+        result = findSlot(&(*slot)->op2, expr);
+    if (!result && count > 2)
+        result = findSlot(&(*slot)->op3, expr);
+    if (exprHasArgs((*slot)->op)) {
+        for (size_t i = 0; !result && i < (*slot)->argCount; i++)
+            result = findSlot(&(*slot)->args[i], expr);
+    }
+    return result;
+}
+
+ExprIncremental::ExprIncremental()
+    : m_generation(0)
+    , m_lexedTokens(0)
+    , m_parsedTokens(0)
+{
+    m_result.expr = NULL;
+}
+
+ExprIncremental::~ExprIncremental()
+{
+    exprFree(m_result.expr);
+}
+
+const ExprParseResult& ExprIncremental::parse(const char* input, size_t length, ExprResolver& resolver)
+{
+    m_source.assign(input, length);
+    return parseAll(resolver);
+}
+
+const ExprParseResult& ExprIncremental::edit(size_t offset, size_t deletedLength,
+    const char* inserted, size_t insertedLength, ExprResolver& resolver)
+{
+    if (offset > m_source.length())
+        offset = m_source.length();
+    if (deletedLength > m_source.length() - offset)
+        deletedLength = m_source.length() - offset;
+    m_source.replace(offset, deletedLength, inserted, insertedLength);
+
+    // Leaves of the current tree were resolved under the old generation
+    if (!m_result.expr || m_tokens.empty() || resolver.generation() != m_generation)
+        return parseAll(resolver);
+
+    try {
+        if (!reparse(offset, deletedLength, insertedLength, resolver))
+            return parseAll(resolver);
+    } catch (...) {
+        ExprParseResult result;
+        result.expr = NULL;
+        result.error = ExprError(EXPR_ERROR, "resolver failed.");
+        replaceResult(result);
+        m_tokens.clear();
+        m_groups.clear();
+        throw;
+    }
+
+    return m_result;
+}
+
+const ExprParseResult& ExprIncremental::parseAll(ExprResolver& resolver)
+{
+    if (resolver.generation() != m_generation || m_functions.size() + m_variables.size() > MAX_REMEMBERED_NAMES) {
+        m_functions.clear();
+        m_variables.clear();
+        m_generation = resolver.generation();
+    }
+
+    m_tokens.clear();
+    m_groups.clear();
+    m_lexedTokens = 0;
+    m_parsedTokens = 0;
+
+    const char* input = m_source.c_str();
+    const char* end = input + m_source.length();
+    const char* p = input;
+    for (;;) {
+        ExprStreamToken token;
+        ExprError error;
+        p = exprScanToken(input, p, end, &token, &error);
+        if (!p)
+            break;
+        m_tokens.push_back(token);
+        ++m_lexedTokens;
+        if (token.id == TOK_END)
+            break;
+    }
+
+    Resolver cachingResolver(this, resolver);
+    ExprParseResult result;
+    try {
+        if (!p) {
+            // Parse the source again so that the error is reported exactly as exprTryParse() does
+            m_tokens.clear();
+            result = exprTryParse(input, m_source.length(), cachingResolver);
+        } else {
+            m_parsedTokens = m_tokens.size();
+            result = exprTryParse(input, &m_tokens[0], cachingResolver, &m_groups);
+        }
+    } catch (...) {
+        result.expr = NULL;
+        result.error = ExprError(EXPR_ERROR, "resolver failed.");
+        replaceResult(result);
+        m_tokens.clear();
+        m_groups.clear();
+        throw;
+    }
+
+    if (result.expr) {
+        ExprGroup group = { EXPR_NO_POSITION, m_tokens.back().offset, result.expr };
+        m_groups.push_back(group);
+    } else
+        m_groups.clear();
+
+    replaceResult(result);
+    return m_result;
+}
+
+bool ExprIncremental::reparse(size_t offset, size_t deletedLength, size_t insertedLength, ExprResolver& resolver)
+{
+    m_lexedTokens = 0;
+    m_parsedTokens = 0;
+
+    const char* input = m_source.c_str();
+    const char* end = input + m_source.length();
+    size_t oldEnd = offset + deletedLength;
+    size_t newEnd = offset + insertedLength;
+
+    // Re-lex from the first token that touches the edit until a token starts where an old one did after it;
+    // from there on, tokens are the same as before, just moved.
+    size_t first = std::lower_bound(m_tokens.begin(), m_tokens.end() - 1, offset, tokenEndsBefore) - m_tokens.begin();
+    size_t last = first;
+    const char* p = input + std::min(m_tokens[first].offset, offset);
+    std::vector<ExprStreamToken> lexed;
+    for (;;) {
+        ExprStreamToken token;
+        ExprError error;
+        p = exprScanToken(input, p, end, &token, &error);
+        if (!p)
+            return false;
+        ++m_lexedTokens;
+
+        if (token.offset >= newEnd) {
+            size_t oldOffset = token.offset - insertedLength + deletedLength;
+            while (m_tokens[last].offset < oldOffset && m_tokens[last].id != TOK_END)
+                ++last;
+            if (m_tokens[last].offset == oldOffset && oldOffset >= oldEnd)
+                break;
+        }
+
+        lexed.push_back(token);
+        if (token.id == TOK_END) {
+            last = m_tokens.size();
+            break;
+        }
+    }
+
+    // Tokens before the edit often come out the same; an identifier that overlaps the edit has new text
+    size_t skip = 0;
+    while (skip < lexed.size() && first < last && sameToken(lexed[skip], m_tokens[first])
+            && (lexed[skip].id != TOK_IDENT || lexed[skip].offset + lexed[skip].length <= offset)) {
+        ++skip;
+        ++first;
+    }
+
+    // Splice new tokens in
+    size_t shiftFrom = (last < m_tokens.size() ? m_tokens[last].offset : m_source.length() + 1);
+    std::vector<ExprStreamToken> tokens;
+    tokens.reserve(first + (lexed.size() - skip) + (m_tokens.size() - std::min(last, m_tokens.size())));
+    tokens.insert(tokens.end(), m_tokens.begin(), m_tokens.begin() + first);
+    tokens.insert(tokens.end(), lexed.begin() + skip, lexed.end());
+    for (size_t i = last; i < m_tokens.size(); i++) {
+        tokens.push_back(m_tokens[i]);
+        tokens.back().offset = tokens.back().offset - deletedLength + insertedLength;
+    }
+
+    if (first == last && skip == lexed.size()) {
+        // Only whitespace has changed
+        for (size_t i = 0; i < m_groups.size(); i++) {
+            if (m_groups[i].open != EXPR_NO_POSITION && m_groups[i].open >= shiftFrom)
+                m_groups[i].open = m_groups[i].open - deletedLength + insertedLength;
+            if (m_groups[i].close >= shiftFrom)
+                m_groups[i].close = m_groups[i].close - deletedLength + insertedLength;
+        }
+        m_tokens.swap(tokens);
+        return true;
+    }
+
+    // Smallest group whose delimiters are outside of the damaged tokens; the last one is the whole expression
+    size_t damageStart = m_tokens[std::min(first, m_tokens.size() - 1)].offset;
+    size_t group = m_groups.size() - 1;
+    if (last < m_tokens.size()) {
+        size_t damageEnd = m_tokens[last].offset;
+        for (size_t i = 0; i < m_groups.size() - 1; i++) {
+            const ExprGroup& g = m_groups[i];
+            if (g.open < damageStart && g.close >= damageEnd
+                    && (group == m_groups.size() - 1 || g.open > m_groups[group].open))
+                group = i;
+        }
+    }
+
+    // Re-parse tokens between the group delimiters, with an end token in place of the closing one
+    ExprGroup old = m_groups[group];
+    bool root = (old.open == EXPR_NO_POSITION);
+    size_t close = (root ? tokens.back().offset : old.close - deletedLength + insertedLength);
+    size_t from = (root ? 0 : std::upper_bound(tokens.begin(), tokens.end(), old.open,
+        [](size_t offset, const ExprStreamToken& token) { return offset < token.offset; }) - tokens.begin());
+    size_t to = std::lower_bound(tokens.begin(), tokens.end(), close, tokenStartsBefore) - tokens.begin();
+
+    std::vector<ExprStreamToken> slice(tokens.begin() + from, tokens.begin() + to);
+    ExprStreamToken endToken;
+    endToken.id = TOK_END;
+    endToken.number = 0;
+    endToken.symbol = EXPR_NO_SYMBOL;
+    endToken.hash = 0;
+    endToken.offset = close;
+    endToken.length = 0;
+    slice.push_back(endToken);
+    m_parsedTokens = slice.size();
+
+    std::vector<ExprGroup> groups;
+    Resolver cachingResolver(this, resolver);
+    ExprParseResult result = exprTryParse(input, &slice[0], cachingResolver, &groups);
+    if (!result.expr)
+        return false;
+
+    // Put the new subtree in place of the old one
+    if (root)
+        m_result.expr = result.expr;
+    else
+        *findSlot(&m_result.expr, old.expr) = result.expr;
+    exprFree(old.expr);
+
+    // Groups around the damage stay, possibly with moved delimiters; those inside the re-parsed one are replaced
+    size_t count = 0;
+    for (size_t i = 0; i < m_groups.size(); i++) {
+        ExprGroup g = m_groups[i];
+        if (i != m_groups.size() - 1 && (root || (g.open >= old.open && g.close <= old.close && i != group)))
+            continue;
+        if (g.expr == old.expr)
+            g.expr = result.expr;
+        if (g.open != EXPR_NO_POSITION && g.open >= shiftFrom)
+            g.open = g.open - deletedLength + insertedLength;
+        if (g.close >= shiftFrom || i == m_groups.size() - 1)
+            g.close = g.close - deletedLength + insertedLength;
+        m_groups[count++] = g;
+    }
+    m_groups.resize(count);
+    m_groups.insert(m_groups.end() - 1, groups.begin(), groups.end());
+
+    m_tokens.swap(tokens);
+    return true;
+}
+
+void ExprIncremental::replaceResult(const ExprParseResult& result)
+{
+    if (m_result.expr != result.expr)
+        exprFree(m_result.expr);
+    m_result = result;
+}
+
+} // namespace
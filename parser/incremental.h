@@ -0,0 +1,106 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_INCREMENTAL_H
+#define DRUNKFLY_PARSER_INCREMENTAL_H
+
+#include "parser/parser_lessoop.h"
+#include "parser/lexer.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ParserLessOop
+{
+
+// Subexpression that is parsed on its own between two delimiter tokens: contents of parentheses, a memory
+// address in brackets or a function argument. Offsets are those of the delimiters; open is EXPR_NO_POSITION and
+// close is the end of input for the whole expression.
+struct ExprGroup
+{
+    size_t open;
+    size_t close;
+    Expr* expr;
+};
+
+// Parses pre-lexed tokens terminated by TOK_END and appends every group it parses to the vector
+ExprParseResult exprTryParse(const char* input, const ExprStreamToken* tokens, ExprResolver& resolver,
+    std::vector<ExprGroup>* groups);
+
+// Expression that is edited in place, e.g. a watch expression being typed. An edit re-lexes only the tokens it
+// touches and re-parses only the smallest group around them; the rest of the tree is kept. Names are resolved
+// once and remembered until the resolver generation changes. Whenever that is not possible (the edit breaks the
+// group apart, fails to parse or the previous parse failed), the whole source is parsed again, so the result is
+// always the same as parsing the new source from scratch.
+class ExprIncremental
+{
+public:
+    ExprIncremental();
+    ~ExprIncremental();
+
+    // Result is owned by this object and valid until the next call
+    const ExprParseResult& parse(const char* input, size_t length, ExprResolver& resolver);
+    const ExprParseResult& edit(size_t offset, size_t deletedLength, const char* inserted, size_t insertedLength,
+        ExprResolver& resolver);
+
+    const ExprParseResult& result() const { return m_result; }
+    const std::string& source() const { return m_source; }
+
+    // Work done by the last parse() or edit()
+    size_t lexedTokens() const { return m_lexedTokens; }
+    size_t parsedTokens() const { return m_parsedTokens; }
+
+private:
+    class Resolver;
+
+    struct Function
+    {
+        bool found;
+        ExprFunction callbacks;
+    };
+
+    struct Variable
+    {
+        bool found;
+        ExprValuePtr ptr;
+    };
+
+    std::string m_source;
+    std::vector<ExprStreamToken> m_tokens;  // empty if the source has a lexer error
+    std::vector<ExprGroup> m_groups;
+    ExprParseResult m_result;
+    std::unordered_map<std::string, Function> m_functions;
+    std::unordered_map<std::string, Variable> m_variables;
+    uint32_t m_generation;
+    size_t m_lexedTokens;
+    size_t m_parsedTokens;
+
+    const ExprParseResult& parseAll(ExprResolver& resolver);
+    bool reparse(size_t offset, size_t deletedLength, size_t insertedLength, ExprResolver& resolver);
+    void replaceResult(const ExprParseResult& result);
+
+    ExprIncremental(const ExprIncremental&);
+    ExprIncremental& operator=(const ExprIncremental&);
+};
+
+} // namespace
+
+#endif
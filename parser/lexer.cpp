@@ -20,91 +20,466 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "parser/lexer.h"
+#include "parser/symbol_pool.h"
 #include <string.h>
 
-static bool isDigit(char ch)
+#if !defined(EXPR_NO_SIMD) && defined(__AVX2__)
+#define EXPR_LEXER_AVX2 1
+#endif
+#if !defined(EXPR_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define EXPR_LEXER_SSE2 1
+#endif
+
+#if defined(EXPR_LEXER_AVX2)
+#include <immintrin.h>
+#elif defined(EXPR_LEXER_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER) && (defined(EXPR_LEXER_AVX2) || defined(EXPR_LEXER_SSE2))
+#include <intrin.h>
+#endif
+
+enum
 {
-    switch (ch) {
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-            return true;
-    }
-    return false;
+    CH_SPACE = 0x01,
+    CH_DIGIT = 0x02,
+    CH_BINDIGIT = 0x04,
+    CH_OCTDIGIT = 0x08,
+    CH_HEXDIGIT = 0x10,
+    CH_LETTER = 0x20,
+    CH_IDENT = 0x40,
+};
+
+#define SP CH_SPACE
+#define B1 (CH_DIGIT | CH_BINDIGIT | CH_OCTDIGIT | CH_HEXDIGIT | CH_IDENT)
+#define O7 (CH_DIGIT | CH_OCTDIGIT | CH_HEXDIGIT | CH_IDENT)
+#define D9 (CH_DIGIT | CH_HEXDIGIT | CH_IDENT)
+#define HX (CH_HEXDIGIT | CH_LETTER | CH_IDENT)
+#define LT (CH_LETTER | CH_IDENT)
+#define ID CH_IDENT
+
+static const unsigned char charClass[256] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0, SP, SP,  0,  0, SP,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+    SP,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, ID,  0,
+    B1, B1, O7, O7, O7, O7, O7, O7, D9, D9,  0,  0,  0,  0,  0,  0,
+     0, HX, HX, HX, HX, HX, HX, LT, LT, LT, LT, LT, LT, LT, LT, LT,
+    LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, LT,  0,  0,  0,  0, ID,
+     0, HX, HX, HX, HX, HX, HX, LT, LT, LT, LT, LT, LT, LT, LT, LT,
+    LT, LT, LT, LT, LT, LT, LT, LT, LT, LT, LT,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+};
+
+#undef SP
+#undef B1
+#undef O7
+#undef D9
+#undef HX
+#undef LT
+#undef ID
+
+static bool isClass(char ch, int mask)
+{
+    return (charClass[(unsigned char)ch] & mask) != 0;
 }
 
-static bool isBinDigit(char ch)
+static bool isDigit(char ch) { return isClass(ch, CH_DIGIT); }
+static bool isBinDigit(char ch) { return isClass(ch, CH_BINDIGIT); }
+static bool isOctDigit(char ch) { return isClass(ch, CH_OCTDIGIT); }
+static bool isHexDigit(char ch) { return isClass(ch, CH_HEXDIGIT); }
+static bool isLetter(char ch) { return isClass(ch, CH_LETTER); }
+
+#if defined(EXPR_LEXER_AVX2) || defined(EXPR_LEXER_SSE2)
+static unsigned countTrailingZeros(unsigned value)
 {
-    switch (ch) {
-        case '0': case '1':
-            return true;
+  #ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (unsigned)index;
+  #else
+    return (unsigned)__builtin_ctz(value);
+  #endif
+}
+#endif
+
+#ifdef EXPR_LEXER_SSE2
+// Unsigned "lo <= ch <= hi" for every byte: bias the range down to start at -128 and use a signed compare
+static __m128i inRange16(__m128i v, char lo, char hi)
+{
+    __m128i biased = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - (unsigned char)lo)));
+    return _mm_cmplt_epi8(biased, _mm_set1_epi8((char)(-128 + (hi - lo) + 1)));
+}
+
+static unsigned identMask16(const char* p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i letter = inRange16(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+    __m128i digit = inRange16(v, '0', '9');
+    __m128i underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+    __m128i dot = _mm_cmpeq_epi8(v, _mm_set1_epi8('.'));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(letter, digit), _mm_or_si128(underscore, dot)));
+}
+
+static unsigned spaceMask16(const char* p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i space = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+    __m128i newline = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+    return (unsigned)_mm_movemask_epi8(_mm_or_si128(space, newline));
+}
+#endif
+
+#ifdef EXPR_LEXER_AVX2
+static __m256i inRange32(__m256i v, char lo, char hi)
+{
+    __m256i biased = _mm256_add_epi8(v, _mm256_set1_epi8((char)(0x80 - (unsigned char)lo)));
+    return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (hi - lo) + 1)), biased);
+}
+
+static unsigned identMask32(const char* p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i letter = inRange32(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+    __m256i digit = inRange32(v, '0', '9');
+    __m256i underscore = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'));
+    __m256i dot = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('.'));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(letter, digit), _mm256_or_si256(underscore, dot)));
+}
+
+static unsigned spaceMask32(const char* p)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i space = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+    __m256i newline = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    return (unsigned)_mm256_movemask_epi8(_mm256_or_si256(space, newline));
+}
+#endif
+
+// Returns pointer to the first character in [p, end) that does not belong to the class.
+// Vector loads are only done when a whole vector fits before the end, so we never read past the input.
+static const char* skipClass(const char* p, const char* end, int cls)
+{
+  #ifdef EXPR_LEXER_AVX2
+    while (end - p >= 32) {
+        unsigned mask = (cls == CH_SPACE ? spaceMask32(p) : identMask32(p));
+        if (mask != 0xffffffffu)
+            return p + countTrailingZeros(~mask);
+        p += 32;
     }
-    return false;
+  #endif
+
+  #ifdef EXPR_LEXER_SSE2
+    while (end - p >= 16) {
+        unsigned mask = (cls == CH_SPACE ? spaceMask16(p) : identMask16(p));
+        if (mask != 0xffffu)
+            return p + countTrailingZeros(~mask & 0xffffu);
+        p += 16;
+    }
+  #endif
+
+    while (p < end && isClass(*p, cls))
+        ++p;
+
+    return p;
+}
+
+static int hexValue(char ch)
+{
+    return (ch & 0x0f) + (isClass(ch, CH_LETTER) ? 9 : 0);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Numbers
+///
+/// Long literals are decoded eight digits at a time: the digits are loaded into a 64-bit word (first digit in
+/// the lowest byte), validated with byte-parallel arithmetic and then merged pairwise in three multiplications.
+/// Whatever is left (or a chunk containing a non-digit) goes through the scalar loop.
+
+enum Radix
+{
+    RADIX_BIN,
+    RADIX_OCT,
+    RADIX_DEC,
+    RADIX_HEX,
+};
+
+#define ONES UINT64_C(0x0101010101010101)
+
+static uint64_t load64(const char* p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+  #if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+  #endif
+    return word;
+}
+
+// Bit 7 of every byte is set if that byte is >= n. All bytes must be < 0x80.
+static uint64_t bytesGreaterEqual(uint64_t word, unsigned n)
+{
+    return (word + (0x80 - n) * ONES) & (0x80 * ONES);
 }
 
-static bool isOctDigit(char ch)
+// Merges eight digit values (one per byte, most significant first) into a single number.
+static uint32_t mergeDigits(uint64_t v, uint64_t base)
 {
-    switch (ch) {
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7':
+    v = ((v * ((base << 8) | 1)) >> 8) & UINT64_C(0x00ff00ff00ff00ff);
+    v = ((v * (((base * base) << 16) | 1)) >> 16) & UINT64_C(0x0000ffff0000ffff);
+    return (uint32_t)((v * (((base * base * base * base) << 32) | 1)) >> 32);
+}
+
+static bool decodeEightDigits(const char* p, Radix radix, uint32_t* value)
+{
+    uint64_t word = load64(p);
+    if ((word & (0x80 * ONES)) != 0)
+        return false;
+
+    switch (radix) {
+        case RADIX_BIN:
+            if ((word & (0xfe * ONES)) != 0x30 * ONES)
+                return false;
+            *value = mergeDigits(word & (0x01 * ONES), 2);
+            return true;
+
+        case RADIX_OCT:
+            if ((word & (0xf8 * ONES)) != 0x30 * ONES)
+                return false;
+            *value = mergeDigits(word & (0x07 * ONES), 8);
             return true;
+
+        case RADIX_DEC:
+            if ((bytesGreaterEqual(word, '0') & ~bytesGreaterEqual(word, '9' + 1)) != 0x80 * ONES)
+                return false;
+            *value = mergeDigits(word & (0x0f * ONES), 10);
+            return true;
+
+        case RADIX_HEX: {
+            uint64_t digit = bytesGreaterEqual(word, '0') & ~bytesGreaterEqual(word, '9' + 1);
+            uint64_t lower = word | (0x20 * ONES);
+            uint64_t letter = bytesGreaterEqual(lower, 'a') & ~bytesGreaterEqual(lower, 'f' + 1);
+            if ((digit | letter) != 0x80 * ONES)
+                return false;
+            *value = mergeDigits((word & (0x0f * ONES)) + (letter >> 7) * 9, 16);
+            return true;
+        }
     }
+
     return false;
 }
 
-static bool isHexDigit(char ch)
+#undef ONES
+
+// Caller ensures that the first character is a valid digit. Values wrap around silently, as they always did.
+static const char* scanDigits(const char* p, const char* end, Radix radix, ExprValue* result)
 {
-    switch (ch) {
-        case '0': case '1': case '2': case '3': case '4':
-        case '5': case '6': case '7': case '8': case '9':
-        case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
-        case 'A': case 'B': case 'C': case 'D': case 'E': case 'F':
-            return true;
+    static const int digitClass[] = { CH_BINDIGIT, CH_OCTDIGIT, CH_DIGIT, CH_HEXDIGIT };
+    static const uint64_t base[] = { 2, 8, 10, 16 };
+    static const uint64_t scale[] = { 0x100, 0x1000000, 100000000, UINT64_C(0x100000000) };
+
+    ExprUValue value = 0;
+
+    uint32_t chunk;
+    while (end - p >= 8 && decodeEightDigits(p, radix, &chunk)) {
+        value = (ExprUValue)(value * scale[radix] + chunk);
+        p += 8;
     }
-    return false;
+
+    while (p < end && isClass(*p, digitClass[radix]))
+        value = (ExprUValue)(value * base[radix] + hexValue(*p++));
+
+    *result = (ExprValue)value;
+    return p;
+}
+
+static const char* setToken(ExprStreamToken* token, ExprTokenID id, const char* start, const char* next, ExprValue number = 0)
+{
+    token->id = id;
+    token->number = number;
+    token->symbol = EXPR_NO_SYMBOL;
+    token->hash = 0;
+    token->length = (size_t)(next - start);
+    return next;
+}
+
+static char at(const char* p, const char* end)
+{
+    return (p < end ? *p : 0);
 }
 
-static bool isLetter(char ch)
+// Kept out of line so that error reporting does not bloat scanToken()
+#if defined(__GNUC__)
+__attribute__((noinline, cold))
+#endif
+static const char* lexerError(ExprError* error, ExprStatus status, const ExprStreamToken* token,
+    const char* message, char ch = 0)
 {
-    switch (ch) {
+    *error = ExprError(status, token->offset, message, ch);
+    return NULL;
+}
+
+// Returns pointer past the token, or NULL with the error stored if the input is malformed
+static const char* scanToken(const char* input, const char* p, const char* end, ExprStreamToken* token,
+    ExprSymbolPool* symbols, ExprError* error)
+{
+    // Most tokens are separated by at most one space, so don't bother with vectors until we see a second one
+    if (p < end && isClass(*p, CH_SPACE)) {
+        ++p;
+        if (p < end && isClass(*p, CH_SPACE))
+            p = skipClass(p + 1, end, CH_SPACE);
+    }
+
+    const char* start = p;
+    token->offset = (size_t)(p - input);
+
+    switch (at(p, end)) {
+        case 0:
+            if (p < end)
+                return lexerError(error, EXPR_INVALID_CHARACTER, token, "unexpected character '\\0'.");
+            return setToken(token, TOK_END, start, p);
+
+        case ',': return setToken(token, TOK_COMMA, start, p + 1);
+        case '@': return setToken(token, TOK_AT, start, p + 1);
+        case '(': return setToken(token, TOK_LPAREN, start, p + 1);
+        case ')': return setToken(token, TOK_RPAREN, start, p + 1);
+        case '[': return setToken(token, TOK_LBRACKET, start, p + 1);
+        case ']': return setToken(token, TOK_RBRACKET, start, p + 1);
+        case '?': return setToken(token, TOK_QUESTION, start, p + 1);
+        case ':': return setToken(token, TOK_COLON, start, p + 1);
+        case '+': return setToken(token, TOK_PLUS, start, p + 1);
+        case '-': return setToken(token, TOK_MINUS, start, p + 1);
+        case '*': return setToken(token, TOK_ASTERISK, start, p + 1);
+        case '/': return setToken(token, TOK_SLASH, start, p + 1);
+        case '%': return setToken(token, TOK_PERCENT, start, p + 1);
+        case '^': return setToken(token, TOK_CARET, start, p + 1);
+        case '~': return setToken(token, TOK_TILDE, start, p + 1);
+
+        case '&':
+            if (at(p + 1, end) == '&')
+                return setToken(token, TOK_DOUBLE_AMPERSAND, start, p + 2);
+            return setToken(token, TOK_AMPERSAND, start, p + 1);
+
+        case '|':
+            if (at(p + 1, end) == '|')
+                return setToken(token, TOK_DOUBLE_VBAR, start, p + 2);
+            return setToken(token, TOK_VBAR, start, p + 1);
+
+        case '=':
+            if (at(p + 1, end) == '=')
+                return setToken(token, TOK_DOUBLE_EQUAL, start, p + 2);
+            return setToken(token, TOK_EQUAL, start, p + 1);
+
+        case '!':
+            if (at(p + 1, end) == '=')
+                return setToken(token, TOK_NOT_EQUAL, start, p + 2);
+            return setToken(token, TOK_EXCLAMATION, start, p + 1);
+
+        case '<':
+            if (at(p + 1, end) == '=')
+                return setToken(token, TOK_LESS_EQUAL, start, p + 2);
+            if (at(p + 1, end) == '<')
+                return setToken(token, TOK_SHL, start, p + 2);
+            return setToken(token, TOK_LESS, start, p + 1);
+
+        case '>':
+            if (at(p + 1, end) == '=')
+                return setToken(token, TOK_GREATER_EQUAL, start, p + 2);
+            if (at(p + 1, end) == '>')
+                return setToken(token, TOK_SHR, start, p + 2);
+            return setToken(token, TOK_GREATER, start, p + 1);
+
+        case '$':
+            ++p;
+            if (isHexDigit(at(p, end)))
+                goto parseHex;
+            return setToken(token, TOK_DOLLAR, start, p);
+
+        case '#':
+            ++p;
+            if (isHexDigit(at(p, end)))
+                goto parseHex;
+            return setToken(token, TOK_HASH, start, p);
+
+        case '0':
+            if (at(p + 1, end) == 'x' || at(p + 1, end) == 'X') {
+                p += 2;
+                if (!isHexDigit(at(p, end)))
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in hexadecimal number.");
+              parseHex:
+                ExprValue value;
+                p = scanDigits(p, end, RADIX_HEX, &value);
+                if (isDigit(at(p, end)) || isLetter(at(p, end)) || at(p, end) == '_' || at(p, end) == '.')
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in hexadecimal number.");
+                return setToken(token, TOK_NUMBER, start, p, value);
+            }
+            if (at(p + 1, end) == 'b' || at(p + 1, end) == 'B') {
+                p += 2;
+                if (!isBinDigit(at(p, end)))
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in binary number.");
+                ExprValue value;
+                p = scanDigits(p, end, RADIX_BIN, &value);
+                if (isDigit(at(p, end)) || isLetter(at(p, end)) || at(p, end) == '_' || at(p, end) == '.')
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in binary number.");
+                return setToken(token, TOK_NUMBER, start, p, value);
+            }
+            if (at(p + 1, end) == 'o' || at(p + 1, end) == 'O') {
+                p += 2;
+                if (!isOctDigit(at(p, end)))
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in octal number.");
+                ExprValue value;
+                p = scanDigits(p, end, RADIX_OCT, &value);
+                if (isDigit(at(p, end)) || isLetter(at(p, end)) || at(p, end) == '_' || at(p, end) == '.')
+                    return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in octal number.");
+                return setToken(token, TOK_NUMBER, start, p, value);
+            }
+            if (isDigit(at(p + 1, end)))
+                return lexerError(error, EXPR_INVALID_NUMBER, token, "numbers starting with '0' are not supported, use '0o' prefix for octal numbers.");
+            // pass-through
+        case '1': case '2': case '3': case '4':
+        case '5': case '6': case '7': case '8': case '9': {
+            ExprValue value;
+            p = scanDigits(p, end, RADIX_DEC, &value);
+            if (isLetter(at(p, end)) || at(p, end) == '_' || at(p, end) == '.')
+                return lexerError(error, EXPR_INVALID_NUMBER, token, "syntax error in number.");
+            return setToken(token, TOK_NUMBER, start, p, value);
+        }
+
         case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
         case 'k': case 'l': case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't':
         case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
         case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H': case 'I': case 'J':
         case 'K': case 'L': case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T':
         case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
-            return true;
-    }
-    return false;
-}
-
-static bool isIdent(char ch)
-{
-    return isLetter(ch) || isDigit(ch) || ch == '_' || ch == '.';
-}
+        case '_': case '.': {
+            p = skipClass(p + 1, end, CH_IDENT);
+            if (at(p, end) == '\'')
+                ++p;
+            if (p - start > EXPR_MAX_IDENT_LENGTH)
+                return lexerError(error, EXPR_IDENTIFIER_TOO_LONG, token, "identifier too long.");
+            setToken(token, TOK_IDENT, start, p);
+            if (symbols) {
+                token->hash = exprHashName(start, token->length);
+                token->symbol = symbols->intern(start, token->length, token->hash);
+            }
+            return p;
+        }
 
-static int hexValue(char ch)
-{
-    switch (ch) {
-        case '0': return 0;
-        case '1': return 1;
-        case '2': return 2;
-        case '3': return 3;
-        case '4': return 4;
-        case '5': return 5;
-        case '6': return 6;
-        case '7': return 7;
-        case '8': return 8;
-        case '9': return 9;
-        case 'a': case 'A': return 10;
-        case 'b': case 'B': return 11;
-        case 'c': case 'C': return 12;
-        case 'd': case 'D': return 13;
-        case 'e': case 'E': return 14;
-        case 'f': case 'F': return 15;
+        default:
+            return lexerError(error, EXPR_INVALID_CHARACTER, token, "unexpected character '%c'.", at(p, end));
     }
-    throw ExprError("internal error.");
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Linked list
+
 static void emitToken(ExprTokenList* list, ExprTokenID id, ExprValue number = 0, const char* text = NULL)
 {
     ExprToken* token = new ExprToken;
@@ -121,263 +496,37 @@ static void emitToken(ExprTokenList* list, ExprTokenID id, ExprValue number = 0,
 }
 
 ExprTokenList exprLexer(const char* input)
+{
+    return exprLexer(input, strlen(input));
+}
+
+ExprTokenList exprLexer(const char* input, size_t length)
 {
     ExprTokenList list;
     list.first = NULL;
     list.last = NULL;
 
+    const char* p = input;
+    const char* end = input + length;
+    ExprError error;
     for (;;) {
-        switch (*input) {
-            case 0:
-                emitToken(&list, TOK_END);
-                return list;
-
-            case ' ':
-            case '\t':
-            case '\r':
-            case '\n':
-                ++input;
-                continue;
-
-            case ',':
-                ++input;
-                emitToken(&list, TOK_COMMA);
-                continue;
-
-            case '@':
-                ++input;
-                emitToken(&list, TOK_AT);
-                continue;
-
-            case '(':
-                ++input;
-                emitToken(&list, TOK_LPAREN);
-                continue;
-
-            case ')':
-                ++input;
-                emitToken(&list, TOK_RPAREN);
-                continue;
-
-            case '[':
-                ++input;
-                emitToken(&list, TOK_LBRACKET);
-                continue;
-
-            case ']':
-                ++input;
-                emitToken(&list, TOK_RBRACKET);
-                continue;
-
-            case '?':
-                ++input;
-                emitToken(&list, TOK_QUESTION);
-                continue;
-
-            case ':':
-                ++input;
-                emitToken(&list, TOK_COLON);
-                continue;
-
-            case '+':
-                ++input;
-                emitToken(&list, TOK_PLUS);
-                continue;
-
-            case '-':
-                ++input;
-                emitToken(&list, TOK_MINUS);
-                continue;
-
-            case '*':
-                ++input;
-                emitToken(&list, TOK_ASTERISK);
-                continue;
-
-            case '/':
-                ++input;
-                emitToken(&list, TOK_SLASH);
-                continue;
-
-            case '%':
-                ++input;
-                emitToken(&list, TOK_PERCENT);
-                continue;
-
-            case '^':
-                ++input;
-                emitToken(&list, TOK_CARET);
-                continue;
-
-            case '~':
-                ++input;
-                emitToken(&list, TOK_TILDE);
-                continue;
-
-            case '&':
-                ++input;
-                if (*input == '&') {
-                    ++input;
-                    emitToken(&list, TOK_DOUBLE_AMPERSAND);
-                } else
-                    emitToken(&list, TOK_AMPERSAND);
-                continue;
-
-            case '|':
-                ++input;
-                if (*input == '|') {
-                    ++input;
-                    emitToken(&list, TOK_DOUBLE_VBAR);
-                } else
-                    emitToken(&list, TOK_VBAR);
-                continue;
-
-            case '=':
-                ++input;
-                if (*input == '=') {
-                    ++input;
-                    emitToken(&list, TOK_DOUBLE_EQUAL);
-                } else
-                    emitToken(&list, TOK_EQUAL);
-                continue;
-
-            case '!':
-                ++input;
-                if (*input == '=') {
-                    ++input;
-                    emitToken(&list, TOK_NOT_EQUAL);
-                } else
-                    emitToken(&list, TOK_EXCLAMATION);
-                continue;
-
-            case '<':
-                ++input;
-                if (*input == '=') {
-                    ++input;
-                    emitToken(&list, TOK_LESS_EQUAL);
-                } else if (*input == '<') {
-                    ++input;
-                    emitToken(&list, TOK_SHL);
-                } else
-                    emitToken(&list, TOK_LESS);
-                continue;
-
-            case '>':
-                ++input;
-                if (*input == '=') {
-                    ++input;
-                    emitToken(&list, TOK_GREATER_EQUAL);
-                } else if (*input == '>') {
-                    ++input;
-                    emitToken(&list, TOK_SHR);
-                } else
-                    emitToken(&list, TOK_GREATER);
-                continue;
-
-            case '$':
-                ++input;
-                if (isHexDigit(*input))
-                    goto parseHex;
-                emitToken(&list, TOK_DOLLAR);
-                continue;
-
-            case '#':
-                ++input;
-                if (isHexDigit(*input))
-                    goto parseHex;
-                emitToken(&list, TOK_HASH);
-                continue;
-
-            case '0':
-                if (input[1] == 'x' || input[1] == 'X') {
-                    input += 2;
-                    if (!isHexDigit(*input))
-                        throw ExprError("syntax error in hexadecimal number.");
-                  parseHex:
-                    ExprValue value = 0;
-                    do {
-                        value = value << 4;
-                        value += hexValue(*input++);
-                    } while (isHexDigit(*input));
-                    if (isDigit(*input) || isLetter(*input) || *input == '_' || *input == '.')
-                        throw ExprError("syntax error in hexadecimal number.");
-                    emitToken(&list, TOK_NUMBER, value);
-                    continue;
-                }
-                if (input[1] == 'b' || input[1] == 'B') {
-                    input += 2;
-                    if (!isBinDigit(*input))
-                        throw ExprError("syntax error in binary number.");
-                    ExprValue value = 0;
-                    do {
-                        value = value << 1;
-                        value += hexValue(*input++);
-                    } while (isBinDigit(*input));
-                    if (isDigit(*input) || isLetter(*input) || *input == '_' || *input == '.')
-                        throw ExprError("syntax error in binary number.");
-                    emitToken(&list, TOK_NUMBER, value);
-                    continue;
-                }
-                if (input[1] == 'o' || input[1] == 'O') {
-                    input += 2;
-                    if (!isOctDigit(*input))
-                        throw ExprError("syntax error in octal number.");
-                    ExprValue value = 0;
-                    do {
-                        value = value << 3;
-                        value += hexValue(*input++);
-                    } while (isOctDigit(*input));
-                    if (isDigit(*input) || isLetter(*input) || *input == '_' || *input == '.')
-                        throw ExprError("syntax error in octal number.");
-                    emitToken(&list, TOK_NUMBER, value);
-                    continue;
-                }
-                if (isDigit(input[1]))
-                    throw ExprError("numbers starting with '0' are not supported, use '0o' prefix for octal numbers.");
-                // pass-through
-            case '1': case '2': case '3': case '4':
-            case '5': case '6': case '7': case '8': case '9': {
-                ExprValue value = 0;
-                do {
-                    value = value * 10;
-                    value += *input++ - '0';
-                } while (isDigit(*input));
-                if (isLetter(*input) || *input == '_' || *input == '.')
-                    throw ExprError("syntax error in number.");
-                emitToken(&list, TOK_NUMBER, value);
-                continue;
-            }
-
-            case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case 'g': case 'h': case 'i': case 'j':
-            case 'k': case 'l': case 'm': case 'n': case 'o': case 'p': case 'q': case 'r': case 's': case 't':
-            case 'u': case 'v': case 'w': case 'x': case 'y': case 'z':
-            case 'A': case 'B': case 'C': case 'D': case 'E': case 'F': case 'G': case 'H': case 'I': case 'J':
-            case 'K': case 'L': case 'M': case 'N': case 'O': case 'P': case 'Q': case 'R': case 'S': case 'T':
-            case 'U': case 'V': case 'W': case 'X': case 'Y': case 'Z':
-            case '_': case '.': {
-                char buf[128];
-                size_t i = 0;
-                buf[i++] = *input++;
-                while (isIdent(*input)) {
-                    if (i >= sizeof(buf))
-                        throw ExprError("identifier too long.");
-                    buf[i++] = *input++;
-                }
-                if (*input == '\'') {
-                    if (i >= sizeof(buf))
-                        throw ExprError("identifier too long.");
-                    buf[i++] = *input++;
-                }
-                char* ident = new char[i+1];
-                memcpy(ident, buf, i);
-                ident[i] = 0;
-                emitToken(&list, TOK_IDENT, 0, ident);
-                continue;
-            }
+        ExprStreamToken token;
+        p = scanToken(input, p, end, &token, NULL, &error);
+        if (!p) {
+            exprFreeTokens(&list);
+            throw error;
+        }
 
-            default:
-                throw ExprError("unexpected character '%c'.", *input);
+        char* ident = NULL;
+        if (token.id == TOK_IDENT) {
+            ident = new char[token.length + 1];
+            memcpy(ident, input + token.offset, token.length);
+            ident[token.length] = 0;
         }
+
+        emitToken(&list, (ExprTokenID)token.id, token.number, ident);
+        if (token.id == TOK_END)
+            return list;
     }
 }
 
@@ -391,3 +540,219 @@ void exprFreeTokens(ExprTokenList* list)
         delete t;
     }
 }
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Contiguous stream
+
+void exprInitTokenStream(ExprTokenStream* stream)
+{
+    stream->input = NULL;
+    stream->tokens = NULL;
+    stream->count = 0;
+    stream->capacity = 0;
+}
+
+static void reserveTokens(ExprTokenStream* stream, size_t capacity)
+{
+    if (capacity <= stream->capacity)
+        return;
+
+    ExprStreamToken* tokens = new ExprStreamToken[capacity];
+    if (stream->count > 0)
+        memcpy(tokens, stream->tokens, stream->count * sizeof(ExprStreamToken));
+
+    delete[] stream->tokens;
+    stream->tokens = tokens;
+    stream->capacity = capacity;
+}
+
+void exprLexerStream(ExprTokenStream* stream, const char* input)
+{
+    exprLexerStream(stream, input, strlen(input));
+}
+
+void exprLexerStream(ExprTokenStream* stream, const char* input, size_t length, ExprSymbolPool* symbols)
+{
+    stream->input = input;
+    stream->count = 0;
+
+    // Most expressions have less than one token per four characters, so this is usually the only allocation
+    reserveTokens(stream, length / 4 + 8);
+
+    const char* p = input;
+    const char* end = input + length;
+    ExprError error;
+    for (;;) {
+        if (stream->count == stream->capacity)
+            reserveTokens(stream, stream->capacity * 2);
+
+        ExprStreamToken* token = &stream->tokens[stream->count++];
+        p = scanToken(input, p, end, token, symbols, &error);
+        if (!p)
+            throw error;
+        if (token->id == TOK_END)
+            return;
+    }
+}
+
+void exprFreeTokenStream(ExprTokenStream* stream)
+{
+    delete[] stream->tokens;
+    exprInitTokenStream(stream);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Batch
+
+void exprInitTokenBatch(ExprTokenBatch* batch)
+{
+    exprInitTokenStream(&batch->stream);
+    batch->entries = NULL;
+    batch->count = 0;
+    batch->capacity = 0;
+}
+
+static ExprBatchEntry* addBatchEntry(ExprTokenBatch* batch)
+{
+    if (batch->count == batch->capacity) {
+        size_t capacity = (batch->capacity > 0 ? batch->capacity * 2 : 64);
+        ExprBatchEntry* entries = new ExprBatchEntry[capacity];
+        if (batch->count > 0)
+            memcpy(entries, batch->entries, batch->count * sizeof(ExprBatchEntry));
+        delete[] batch->entries;
+        batch->entries = entries;
+        batch->capacity = capacity;
+    }
+    return &batch->entries[batch->count++];
+}
+
+static void lexBatchEntry(ExprTokenStream* stream, ExprBatchEntry* entry, ExprSymbolPool* symbols)
+{
+    const char* input = stream->input;
+    const char* p = input + entry->offset;
+    const char* end = p + entry->length;
+
+    ExprError error;
+    for (;;) {
+        if (stream->count == stream->capacity)
+            reserveTokens(stream, stream->capacity * 2);
+
+        ExprStreamToken* token = &stream->tokens[stream->count++];
+        p = scanToken(input, p, end, token, symbols, &error);
+        if (!p)
+            break;
+        if (token->id == TOK_END)
+            return;
+    }
+
+    // Bad expression should not spoil the whole batch
+    stream->count = entry->firstToken;
+    ExprStreamToken* token = &stream->tokens[stream->count++];
+    token->id = TOK_END;
+    token->number = 0;
+    token->symbol = EXPR_NO_SYMBOL;
+    token->hash = 0;
+    token->offset = entry->offset;
+    token->length = 0;
+    entry->lexerError = true;
+}
+
+void exprLexerBatch(ExprTokenBatch* batch, const char* input, size_t length, char separator, ExprSymbolPool* symbols)
+{
+    ExprTokenStream* stream = &batch->stream;
+    stream->input = input;
+    stream->count = 0;
+    batch->count = 0;
+
+    reserveTokens(stream, length / 4 + 8);
+
+    const char* p = input;
+    const char* end = input + length;
+    while (p < end) {
+        const char* next = (const char*)memchr(p, separator, (size_t)(end - p));
+        if (!next)
+            next = end;
+
+        ExprBatchEntry* entry = addBatchEntry(batch);
+        entry->offset = (size_t)(p - input);
+        entry->length = (size_t)(next - p);
+        entry->firstToken = stream->count;
+        entry->lexerError = false;
+        lexBatchEntry(stream, entry, symbols);
+
+        if (next == end)
+            break;
+        p = next + 1;
+    }
+}
+
+void exprFreeTokenBatch(ExprTokenBatch* batch)
+{
+    exprFreeTokenStream(&batch->stream);
+    delete[] batch->entries;
+    exprInitTokenBatch(batch);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Pull reader
+
+bool exprInitTokenReader(ExprTokenReader* reader, const char* input, size_t length, ExprSymbolPool* symbols,
+    ExprError* error)
+{
+    reader->input = input;
+    reader->tokens = NULL;
+    reader->symbols = symbols;
+    reader->end = input + length;
+    reader->p = scanToken(input, input, reader->end, &reader->cur, symbols, error);
+    if (!reader->p)
+        return false;
+    reader->next = reader->cur;
+    if (reader->cur.id != TOK_END) {
+        reader->p = scanToken(input, reader->p, reader->end, &reader->next, symbols, error);
+        if (!reader->p)
+            return false;
+    }
+    return true;
+}
+
+void exprInitTokenReader(ExprTokenReader* reader, const ExprTokenBatch* batch, size_t index)
+{
+    const ExprBatchEntry* entry = &batch->entries[index];
+    exprInitTokenReader(reader, batch->stream.input, &batch->stream.tokens[entry->firstToken]);
+    reader->p = reader->input + entry->offset + entry->length;
+    reader->end = reader->p;
+}
+
+void exprInitTokenReader(ExprTokenReader* reader, const char* input, const ExprStreamToken* tokens)
+{
+    reader->input = input;
+    reader->p = NULL;
+    reader->end = NULL;
+    reader->tokens = tokens;
+    reader->symbols = NULL;
+    reader->cur = reader->tokens[0];
+    reader->next = reader->cur;
+    if (reader->cur.id != TOK_END)
+        reader->next = *++reader->tokens;
+}
+
+bool exprReadToken(ExprTokenReader* reader, ExprError* error)
+{
+    reader->cur = reader->next;
+    if (reader->next.id != TOK_END) {
+        if (reader->tokens)
+            reader->next = *++reader->tokens;
+        else {
+            reader->p = scanToken(reader->input, reader->p, reader->end, &reader->next, reader->symbols, error);
+            if (!reader->p)
+                return false;
+        }
+    }
+    return true;
+}
+
+const char* exprScanToken(const char* input, const char* p, const char* end, ExprStreamToken* token,
+    ExprError* error)
+{
+    return scanToken(input, p, end, token, NULL, error);
+}
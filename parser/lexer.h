@@ -24,6 +24,8 @@ SOFTWARE.
 
 #include "parser/common.h"
 
+class ExprSymbolPool;
+
 enum ExprTokenID
 {
     TOK_END,
@@ -76,7 +78,84 @@ struct ExprTokenList
     ExprToken* last;
 };
 
+struct ExprStreamToken
+{
+    int id;
+    ExprValue number;
+    uint32_t symbol;    // for TOK_IDENT lexed with a symbol pool, EXPR_NO_SYMBOL otherwise
+    uint32_t hash;      // valid when symbol is
+    size_t offset;      // for TOK_IDENT this is the identifier itself, not NUL-terminated
+    size_t length;
+};
+
+struct ExprTokenStream
+{
+    const char* input;
+    ExprStreamToken* tokens;
+    size_t count;
+    size_t capacity;
+};
+
+// Length-delimited variants do not require input to be NUL-terminated and never read past input + length.
+
+struct ExprBatchEntry
+{
+    size_t offset;      // of the expression source in batch input
+    size_t length;
+    size_t firstToken;
+    bool lexerError;    // tokens contain just TOK_END; parse the source again to get the error
+};
+
+// Tokens of every expression in a buffer, each expression terminated by TOK_END. Token offsets are
+// relative to the start of the whole buffer.
+struct ExprTokenBatch
+{
+    ExprTokenStream stream;
+    ExprBatchEntry* entries;
+    size_t count;
+    size_t capacity;
+};
+
+// Reads tokens on demand, keeping one token of lookahead. Nothing is allocated.
+struct ExprTokenReader
+{
+    const char* input;
+    const char* p;
+    const char* end;
+    const ExprStreamToken* tokens;      // pre-lexed tokens, or NULL to scan input
+    ExprSymbolPool* symbols;
+    ExprStreamToken cur;
+    ExprStreamToken next;
+};
+
 ExprTokenList exprLexer(const char* input);
+ExprTokenList exprLexer(const char* input, size_t length);
 void exprFreeTokens(ExprTokenList* list);
 
+// Token stream keeps its buffer between calls, so reusing one stream for many inputs does not allocate at all.
+void exprInitTokenStream(ExprTokenStream* stream);
+void exprLexerStream(ExprTokenStream* stream, const char* input);
+void exprLexerStream(ExprTokenStream* stream, const char* input, size_t length, ExprSymbolPool* symbols = NULL);
+void exprFreeTokenStream(ExprTokenStream* stream);
+
+// Expressions are separated by the given character; an empty tail after the last separator is ignored.
+void exprInitTokenBatch(ExprTokenBatch* batch);
+void exprLexerBatch(ExprTokenBatch* batch, const char* input, size_t length, char separator = '\n',
+    ExprSymbolPool* symbols = NULL);
+void exprFreeTokenBatch(ExprTokenBatch* batch);
+
+// When symbol pool is given, identifiers are interned into it as they are lexed. Reader does not throw: on a lexer
+// error the functions return false and store the error.
+bool exprInitTokenReader(ExprTokenReader* reader, const char* input, size_t length, ExprSymbolPool* symbols,
+    ExprError* error);
+void exprInitTokenReader(ExprTokenReader* reader, const ExprTokenBatch* batch, size_t index);
+// Reads pre-lexed tokens terminated by TOK_END; token offsets are relative to input
+void exprInitTokenReader(ExprTokenReader* reader, const char* input, const ExprStreamToken* tokens);
+bool exprReadToken(ExprTokenReader* reader, ExprError* error);
+
+// Scans the token that starts at p, skipping whitespace before it. Returns position after the token, or NULL on a
+// lexer error. Token offset is relative to input.
+const char* exprScanToken(const char* input, const char* p, const char* end, ExprStreamToken* token,
+    ExprError* error);
+
 #endif
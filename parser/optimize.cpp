@@ -0,0 +1,634 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/optimize.h"
+#include "parser/arena.h"
+#include <limits.h>
+
+namespace ParserLessOop
+{
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Helpers
+
+static bool isNumber(const Expr* expr)
+{
+    return expr->op == OP_NUMBER;
+}
+
+static void release(Expr* expr, ExprArena* arena)
+{
+    if (!arena)
+        exprFree(expr);
+}
+
+static void setNumber(Expr* expr, ExprValue value)
+{
+    expr->op = OP_NUMBER;
+    expr->number = value;
+}
+
+// Moves the child into its parent's place; the parent's other operands must have been released already
+static void replaceWithChild(Expr* expr, Expr* child, ExprArena* arena)
+{
+    *expr = *child;
+    if (!arena)
+        delete child;
+}
+
+// Turns "x && c" or "c || x" into "x != 0", reusing the constant node as the zero
+static void setNotZero(Expr* expr, Expr* operand, Expr* constant)
+{
+    setNumber(constant, 0);
+    expr->op = OP_NOTEQUAL;
+    expr->op1 = operand;
+    expr->op2 = constant;
+}
+
+// True if the subtree can be dropped without changing behaviour: it calls no functions, value readers or memory
+// accessors, and cannot throw
+static bool canDiscard(const Expr* expr)
+{
+    switch (expr->op) {
+        case OP_CALLBACKVALUE:
+        case OP_USERCALLBACKVALUE:
+        case OP_MEMBYTE:
+        case OP_MEMWORD:
+        case OP_MEMDWORD:
+        case OP_FUNC0:
+        case OP_FUNC1:
+        case OP_FUNC2:
+        case OP_FUNC3:
+        case OP_USERFUNC0:
+        case OP_USERFUNC1:
+        case OP_USERFUNC2:
+        case OP_USERFUNC3:
+        case OP_FUNCN:
+        case OP_DIVIDE:
+        case OP_REMAINDER:
+            return false;
+        default:
+            break;
+    }
+
+    if (exprHasArgs(expr->op)) {
+        for (size_t i = 0; i < expr->argCount; i++) {
+            if (!canDiscard(expr->args[i]))
+                return false;
+        }
+        return true;
+    }
+
+    int count = exprOperandCount(expr->op);
+    return (count < 1 || canDiscard(expr->op1)) && (count < 2 || canDiscard(expr->op2))
+        && (count < 3 || canDiscard(expr->op3));
+}
+
+// Operators that only compute a value from op1 and op2: everything from OP_LOGICOR on, except the n-ary chains
+static bool isArithmetic(ExprOp op)
+{
+    return op >= OP_LOGICOR && !exprHasArgs(op);
+}
+
+typedef void (*Pass)(Expr* expr, ExprArena* arena);
+
+// Applies the pass to every node, children before their parent
+static void postOrder(Expr* expr, ExprArena* arena, Pass pass)
+{
+    if (exprHasArgs(expr->op)) {
+        for (size_t i = 0; i < expr->argCount; i++)
+            postOrder(expr->args[i], arena, pass);
+    } else {
+        int count = exprOperandCount(expr->op);
+        if (count > 0)
+            postOrder(expr->op1, arena, pass);
+        if (count > 1)
+            postOrder(expr->op2, arena, pass);
+        if (count > 2)
+            postOrder(expr->op3, arena, pass);
+    }
+    pass(expr, arena);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Constant folding
+
+static void foldLogic(Expr* expr, ExprArena* arena)
+{
+    bool isAnd = (expr->op == OP_LOGICAND);
+    // Value that decides the result on its own: 0 for &&, anything else for ||
+    if (isNumber(expr->op1)) {
+        if ((expr->op1->number != 0) != isAnd) {
+            release(expr->op1, arena);
+            release(expr->op2, arena);
+            setNumber(expr, isAnd ? 0 : 1);
+        } else
+            setNotZero(expr, expr->op2, expr->op1);
+    } else if (isNumber(expr->op2)) {
+        if ((expr->op2->number != 0) == isAnd)
+            setNotZero(expr, expr->op1, expr->op2);
+        else if (canDiscard(expr->op1)) {
+            release(expr->op1, arena);
+            release(expr->op2, arena);
+            setNumber(expr, isAnd ? 0 : 1);
+        }
+    }
+}
+
+// Expects the operands to be folded already
+static void foldNode(Expr* expr, ExprArena* arena)
+{
+    switch (expr->op) {
+        case OP_COND:
+            if (isNumber(expr->op1)) {
+                bool condition = (expr->op1->number != 0);
+                release(expr->op1, arena);
+                release(condition ? expr->op3 : expr->op2, arena);
+                replaceWithChild(expr, condition ? expr->op2 : expr->op3, arena);
+            }
+            return;
+
+        case OP_LOGICAND:
+        case OP_LOGICOR:
+            if (!isNumber(expr->op1) || !isNumber(expr->op2)) {
+                foldLogic(expr, arena);
+                return;
+            }
+            break;
+
+        case OP_DIVIDE:
+        case OP_REMAINDER:
+            // Left for the evaluator to report or trap on
+            if (isNumber(expr->op2) && (expr->op2->number == 0
+                    || (expr->op2->number == -1 && isNumber(expr->op1) && expr->op1->number == INT_MIN)))
+                return;
+            break;
+
+        default:
+            if (!isArithmetic(expr->op))
+                return;
+            break;
+    }
+
+    int count = exprOperandCount(expr->op);
+    if (!isNumber(expr->op1) || (count > 1 && !isNumber(expr->op2)))
+        return;
+
+    ExprEvaluator e(0);
+    ExprValue value = exprEvaluate(expr, e);
+    release(expr->op1, arena);
+    if (count > 1)
+        release(expr->op2, arena);
+    setNumber(expr, value);
+}
+
+void exprFold(Expr* expr, ExprArena* arena)
+{
+    postOrder(expr, arena, foldNode);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Algebraic simplification
+
+static bool isValue(const Expr* expr, ExprValue value)
+{
+    return expr->op == OP_NUMBER && expr->number == value;
+}
+
+// k if value is 2^k for k in 1 ... 30, -1 otherwise
+static int exactLog2(ExprValue value)
+{
+    if (value < 2 || (value & (value - 1)) != 0)
+        return -1;
+    int k = 0;
+    while ((1 << k) != value)
+        ++k;
+    return k;
+}
+
+// True if both subtrees always evaluate to the same value
+static bool sameTree(const Expr* a, const Expr* b)
+{
+    if (a->op != b->op || !canDiscard(a))
+        return false;
+
+    switch (a->op) {
+        case OP_NUMBER: return a->number == b->number;
+        case OP_CALLBACKVALUE: return a->valuePtr.readValue == b->valuePtr.readValue;
+        case OP_USERCALLBACKVALUE:
+            return a->valuePtr.readUserValue == b->valuePtr.readUserValue && a->valuePtr.user == b->valuePtr.user;
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE: return a->valuePtr.ptr == b->valuePtr.ptr;
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC: if (a->number != b->number) return false; break;
+        default: break;
+    }
+
+    if (exprHasArgs(a->op)) {
+        if (a->number != b->number || a->argCount != b->argCount)
+            return false;
+        for (size_t i = 0; i < a->argCount; i++) {
+            if (!sameTree(a->args[i], b->args[i]))
+                return false;
+        }
+        return true;
+    }
+    int count = exprOperandCount(a->op);
+    return (count < 1 || sameTree(a->op1, b->op1)) && (count < 2 || sameTree(a->op2, b->op2))
+        && (count < 3 || sameTree(a->op3, b->op3));
+}
+
+static bool isCommutative(ExprOp op)
+{
+    switch (op) {
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_EQUAL:
+        case OP_NOTEQUAL:
+        case OP_PLUS:
+        case OP_MULTIPLY:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Comparison with the opposite result, or the same op if there is none
+static ExprOp inverseComparison(ExprOp op)
+{
+    switch (op) {
+        case OP_EQUAL: return OP_NOTEQUAL;
+        case OP_NOTEQUAL: return OP_EQUAL;
+        case OP_LESS: return OP_GREATEREQUAL;
+        case OP_LESSEQUAL: return OP_GREATER;
+        case OP_GREATER: return OP_LESSEQUAL;
+        case OP_GREATEREQUAL: return OP_LESS;
+        default: return op;
+    }
+}
+
+// "x op c" becomes x
+static void keepLeft(Expr* expr, ExprArena* arena)
+{
+    release(expr->op2, arena);
+    replaceWithChild(expr, expr->op1, arena);
+}
+
+// Both operands are dropped, so they must be discardable
+static void replaceWithNumber(Expr* expr, ExprValue value, ExprArena* arena)
+{
+    release(expr->op1, arena);
+    release(expr->op2, arena);
+    setNumber(expr, value);
+}
+
+// "x op c" becomes "op x"
+static void setUnary(Expr* expr, ExprOp op, ExprArena* arena)
+{
+    release(expr->op2, arena);
+    expr->op = op;
+}
+
+// "x / c" or "x % c" becomes a division by the absolute value of c, negated for a negative divisor
+static void reduceDivision(Expr* expr, ExprArena* arena)
+{
+    Expr* constant = expr->op2;
+    ExprValue divisor = constant->number;
+    ExprValue absolute = (divisor < 0 ? -divisor : divisor);
+    bool negate = (expr->op == OP_DIVIDE && divisor < 0);
+    bool divide = (expr->op == OP_DIVIDE);
+
+    // Reuse the constant node as the division, so that nothing is allocated
+    Expr* division = (negate ? constant : expr);
+    division->op1 = expr->op1;
+    division->number = absolute;
+    int k = exactLog2(absolute);
+    if (k >= 0) {
+        division->op = (divide ? OP_DIVPOW2 : OP_REMPOW2);
+        division->shift = k;
+    } else {
+        // floor(a / d) == floor(a * m / 2^(32 + l)) for all 0 <= a <= 2^31, with l = ceil(log2(d)) and
+        // m = floor(2^(32 + l) / d) + 1 < 2^33, so that the product fits in 64 bits
+        int l = 0;
+        while (((uint64_t)1 << l) < (uint64_t)absolute)
+            ++l;
+        division->op = (divide ? OP_DIVMAGIC : OP_REMMAGIC);
+        division->shift = 32 + l;
+        division->magic = (((uint64_t)1 << (32 + l)) / (uint64_t)absolute) + 1;
+    }
+
+    if (negate) {
+        expr->op = OP_NEGATE;
+        expr->op1 = division;
+    } else
+        release(constant, arena);
+    expr->op2 = NULL;
+}
+
+static void simplifyNode(Expr* expr, ExprArena* arena)
+{
+    foldNode(expr, arena);
+    if (expr->op == OP_NUMBER)
+        return;
+
+    // Constant goes to the right, so that the rules below only have to look there
+    if (isCommutative(expr->op) && isNumber(expr->op1)) {
+        Expr* constant = expr->op1;
+        expr->op1 = expr->op2;
+        expr->op2 = constant;
+    }
+
+    int count = exprOperandCount(expr->op);
+    bool same = (count == 2 && isArithmetic(expr->op) && sameTree(expr->op1, expr->op2));
+
+    switch (expr->op) {
+        case OP_PLUS:
+        case OP_BITOR:
+        case OP_BITXOR:
+        case OP_SHL:
+        case OP_SHR:
+            if (isValue(expr->op2, 0))
+                keepLeft(expr, arena);
+            else if (expr->op == OP_BITOR && isValue(expr->op2, -1) && canDiscard(expr->op1))
+                replaceWithNumber(expr, -1, arena);
+            else if (expr->op == OP_BITXOR && isValue(expr->op2, -1))
+                setUnary(expr, OP_BITNOT, arena);
+            else if (expr->op == OP_BITOR && same)
+                keepLeft(expr, arena);
+            else if (expr->op == OP_BITXOR && same)
+                replaceWithNumber(expr, 0, arena);
+            return;
+
+        case OP_MINUS:
+            if (isValue(expr->op2, 0))
+                keepLeft(expr, arena);
+            else if (isValue(expr->op1, 0)) {
+                release(expr->op1, arena);
+                expr->op = OP_NEGATE;
+                expr->op1 = expr->op2;
+            } else if (same)
+                replaceWithNumber(expr, 0, arena);
+            return;
+
+        case OP_BITAND:
+            if (isValue(expr->op2, -1) || same)
+                keepLeft(expr, arena);
+            else if (isValue(expr->op2, 0) && canDiscard(expr->op1))
+                replaceWithNumber(expr, 0, arena);
+            return;
+
+        case OP_MULTIPLY:
+            if (isValue(expr->op2, 1))
+                keepLeft(expr, arena);
+            else if (isValue(expr->op2, -1))
+                setUnary(expr, OP_NEGATE, arena);
+            else if (isValue(expr->op2, 0) && canDiscard(expr->op1))
+                replaceWithNumber(expr, 0, arena);
+            else if (isNumber(expr->op2) && exactLog2(expr->op2->number) >= 0) {
+                expr->op = OP_SHL;
+                expr->op2->number = exactLog2(expr->op2->number);
+            }
+            return;
+
+        case OP_DIVIDE:
+        case OP_REMAINDER:
+            // Division by 0 and -1 (which traps for INT_MIN) is left to the evaluator
+            if (!isNumber(expr->op2) || expr->op2->number == 0 || expr->op2->number == -1
+                    || expr->op2->number == INT_MIN)
+                return;
+            if (expr->op2->number == 1) {
+                if (expr->op == OP_DIVIDE)
+                    keepLeft(expr, arena);
+                else if (canDiscard(expr->op1))
+                    replaceWithNumber(expr, 0, arena);
+                return;
+            }
+            reduceDivision(expr, arena);
+            return;
+
+        case OP_EQUAL:
+        case OP_LESSEQUAL:
+        case OP_GREATEREQUAL:
+            if (same)
+                replaceWithNumber(expr, 1, arena);
+            return;
+
+        case OP_NOTEQUAL:
+        case OP_LESS:
+        case OP_GREATER:
+            if (same)
+                replaceWithNumber(expr, 0, arena);
+            return;
+
+        case OP_NEGATE:
+        case OP_BITNOT:
+            // --x, ~~x
+            if (expr->op1->op == expr->op) {
+                Expr* inner = expr->op1;
+                replaceWithChild(expr, inner->op1, arena);
+                if (!arena)
+                    delete inner;
+            }
+            return;
+
+        case OP_LOGICNOT:
+            if (expr->op1->op == OP_LOGICNOT) {
+                // !!x becomes x != 0, the inner node becomes the zero
+                Expr* inner = expr->op1;
+                setNotZero(expr, inner->op1, inner);
+            } else if (inverseComparison(expr->op1->op) != expr->op1->op) {
+                Expr* comparison = expr->op1;
+                replaceWithChild(expr, comparison, arena);
+                expr->op = inverseComparison(expr->op);
+            }
+            return;
+
+        default:
+            return;
+    }
+}
+
+void exprSimplify(Expr* expr, ExprArena* arena)
+{
+    postOrder(expr, arena, simplifyNode);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Flattening
+
+// N-ary form of the chain the node belongs to, or OP_NUMBER if none. "x - c" is part of a sum.
+static ExprOp chainOp(const Expr* expr)
+{
+    switch (expr->op) {
+        case OP_PLUS: case OP_SUMN: return OP_SUMN;
+        case OP_MINUS: return (isNumber(expr->op2) ? OP_SUMN : OP_NUMBER);
+        case OP_MULTIPLY: case OP_PRODUCTN: return OP_PRODUCTN;
+        case OP_BITAND: case OP_BITANDN: return OP_BITANDN;
+        case OP_BITOR: case OP_BITORN: return OP_BITORN;
+        case OP_BITXOR: case OP_BITXORN: return OP_BITXORN;
+        default: return OP_NUMBER;
+    }
+}
+
+static ExprValue identity(ExprOp op)
+{
+    switch (op) {
+        case OP_PRODUCTN: return 1;
+        case OP_BITANDN: return -1;
+        default: return 0;
+    }
+}
+
+static ExprValue combine(ExprOp op, ExprValue a, ExprValue b)
+{
+    switch (op) {
+        case OP_SUMN: return (ExprValue)((uint32_t)a + (uint32_t)b);
+        case OP_PRODUCTN: return (ExprValue)((uint32_t)a * (uint32_t)b);
+        case OP_BITANDN: return a & b;
+        case OP_BITORN: return a | b;
+        default: return a ^ b;
+    }
+}
+
+// Binary operator to use when a single operand is left
+static ExprOp binaryOp(ExprOp op)
+{
+    switch (op) {
+        case OP_SUMN: return OP_PLUS;
+        case OP_PRODUCTN: return OP_MULTIPLY;
+        case OP_BITANDN: return OP_BITAND;
+        case OP_BITORN: return OP_BITOR;
+        default: return OP_BITXOR;
+    }
+}
+
+struct Chain
+{
+    ExprOp op;
+    ExprValue constant;
+    Expr** args;        // NULL while counting
+    size_t argCount;
+    ExprArena* arena;
+};
+
+// Walks the operands of a chain in evaluation order. Called twice: first to count the operands, then to move them
+// into the array and release the nodes that were merged.
+static void collect(Chain* chain, Expr* expr, bool isRoot)
+{
+    bool merge = (isRoot || chainOp(expr) == chain->op);
+    if (merge && expr->op == chain->op) {
+        if (chain->args)
+            chain->constant = combine(chain->op, chain->constant, expr->number);
+        for (size_t i = 0; i < expr->argCount; i++)
+            collect(chain, expr->args[i], false);
+        if (chain->args && !chain->arena) {
+            delete[] expr->args;
+            delete expr;
+        }
+    } else if (merge) {
+        collect(chain, expr->op1, false);
+        if (expr->op == OP_MINUS) {
+            if (chain->args)
+                chain->constant = combine(chain->op, chain->constant, (ExprValue)(0u - (uint32_t)expr->op2->number));
+        } else
+            collect(chain, expr->op2, false);
+        if (chain->args && !isRoot) {
+            if (expr->op == OP_MINUS)
+                release(expr->op2, chain->arena);
+            if (!chain->arena)
+                delete expr;
+        }
+    } else if (isNumber(expr)) {
+        if (chain->args) {
+            chain->constant = combine(chain->op, chain->constant, expr->number);
+            release(expr, chain->arena);
+        }
+    } else {
+        if (chain->args)
+            chain->args[chain->argCount] = expr;
+        ++chain->argCount;
+    }
+}
+
+// Expects the operands to be flattened already, so that nested chains are n-ary nodes or short binary ones
+static void flattenNode(Expr* expr, ExprArena* arena)
+{
+    ExprOp op = chainOp(expr);
+    if (op == OP_NUMBER || exprHasArgs(expr->op))
+        return;
+    if (chainOp(expr->op1) != op && (expr->op == OP_MINUS || chainOp(expr->op2) != op))
+        return;
+
+    Chain chain;
+    chain.op = op;
+    chain.constant = identity(op);
+    chain.args = NULL;
+    chain.argCount = 0;
+    chain.arena = arena;
+    collect(&chain, expr, true);
+    if (chain.argCount == 0)
+        return;     // only constants; left to exprFold()
+
+    size_t count = chain.argCount;
+    Expr* root = expr;
+    Expr** args = (arena ? (Expr**)arena->allocate(count * sizeof(Expr*)) : new Expr*[count]);
+    chain.args = args;
+    chain.argCount = 0;
+    collect(&chain, root, true);
+
+    if (root->op == OP_MINUS)
+        release(root->op2, arena);
+    if (count > 1) {
+        expr->op = op;
+        expr->number = chain.constant;
+        expr->args = args;
+        expr->argCount = count;
+        expr->op1 = NULL;
+        expr->op2 = NULL;
+        return;
+    }
+
+    // A single operand is left: "x op c", or just x if c does nothing
+    Expr* operand = args[0];
+    if (!arena)
+        delete[] args;
+    if (chain.constant == identity(op)) {
+        replaceWithChild(expr, operand, arena);
+        return;
+    }
+    Expr* constant = (arena ? (Expr*)arena->allocate(sizeof(Expr)) : new Expr);
+    setNumber(constant, chain.constant);
+    expr->op = binaryOp(op);
+    expr->op1 = operand;
+    expr->op2 = constant;
+}
+
+void exprFlatten(Expr* expr, ExprArena* arena)
+{
+    postOrder(expr, arena, flattenNode);
+}
+
+} // namespace
@@ -0,0 +1,50 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_OPTIMIZE_H
+#define DRUNKFLY_PARSER_OPTIMIZE_H
+
+#include "parser/parser_lessoop.h"
+
+namespace ParserLessOop
+{
+
+// Optimization passes rewrite the tree in place; the root node stays the same. Pass the arena the tree was parsed
+// into, if any: nodes that are dropped are then left to the arena instead of being freed. Do not use these on
+// trees owned by ExprIncremental or ExprHashCons. Evaluation results, including division by zero errors, do not
+// change, and subtrees that call functions, value readers or memory accessors are never dropped.
+
+// Replaces every subtree with only literal leaves by its value. Conditionals with a constant condition are replaced
+// by the taken branch, && and || with a constant side are short-circuited.
+void exprFold(Expr* expr, ExprArena* arena = NULL);
+
+// Folds constants like exprFold() and applies algebraic identities (x + 0, x * 1, --x, !!x, x - x, ...). Multiplication
+// and division by constants are reduced to shifts, masks and multiplication by a precomputed reciprocal.
+void exprSimplify(Expr* expr, ExprArena* arena = NULL);
+
+// Turns chains of +, *, &, | and ^ into single n-ary nodes that evaluate their operands in a loop, merging all
+// constants of a chain into one. "x - c" in a sum is treated as adding -c. Best run after exprSimplify(), which does
+// not look into n-ary nodes.
+void exprFlatten(Expr* expr, ExprArena* arena = NULL);
+
+} // namespace
+
+#endif
@@ -20,9 +20,12 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 #include "parser/parser_lessoop.h"
+#include "parser/incremental.h"
 #include "parser/lexer.h"
+#include "parser/arena.h"
 #include <stdio.h>
 #include <string.h>
+#include <exception>
 #include <stdarg.h>
 
 namespace ParserLessOop
@@ -37,6 +40,7 @@ ExprValue exprEvaluate(const Expr* expr, ExprEvaluator& eval)
     switch (expr->op) {
         case OP_NUMBER: return expr->number;
         case OP_CALLBACKVALUE: return expr->valuePtr.readValue();
+        case OP_USERCALLBACKVALUE: return expr->valuePtr.readUserValue(expr->valuePtr.user);
         case OP_BYTEVALUE: return *(uint8_t*)expr->valuePtr.ptr;
         case OP_WORDVALUE: return *(uint16_t*)expr->valuePtr.ptr;
         case OP_U24VALUE: return *(uint16_t*)expr->valuePtr.ptr | (*((uint8_t*)expr->valuePtr.ptr + 2) << 16);
@@ -45,6 +49,16 @@ ExprValue exprEvaluate(const Expr* expr, ExprEvaluator& eval)
         case OP_FUNC1: return expr->cb1(EVAL(expr->op1));
         case OP_FUNC2: return expr->cb2(EVAL(expr->op1), EVAL(expr->op2));
         case OP_FUNC3: return expr->cb3(EVAL(expr->op1), EVAL(expr->op2), EVAL(expr->op3));
+        case OP_USERFUNC0: return expr->ucb0(expr->user);
+        case OP_USERFUNC1: return expr->ucb1(EVAL(expr->op1), expr->user);
+        case OP_USERFUNC2: return expr->ucb2(EVAL(expr->op1), EVAL(expr->op2), expr->user);
+        case OP_USERFUNC3: return expr->ucb3(EVAL(expr->op1), EVAL(expr->op2), EVAL(expr->op3), expr->user);
+        case OP_FUNCN: {
+            ExprValue args[EXPR_MAX_VARIADIC_ARGS];
+            for (size_t i = 0; i < expr->argCount; i++)
+                args[i] = EVAL(expr->args[i]);
+            return expr->cbN(args, expr->argCount, expr->user);
+        }
         case OP_MEMBYTE: return eval.memByte(EVAL(expr->op1));
         case OP_MEMWORD: return eval.memWord(EVAL(expr->op1));
         case OP_MEMDWORD: return eval.memDword(EVAL(expr->op1));
@@ -63,15 +77,59 @@ ExprValue exprEvaluate(const Expr* expr, ExprEvaluator& eval)
         case OP_LESSEQUAL: return EVAL(expr->op1) <= EVAL(expr->op2);
         case OP_GREATER: return EVAL(expr->op1) > EVAL(expr->op2);
         case OP_GREATEREQUAL: return EVAL(expr->op1) >= EVAL(expr->op2);
-        case OP_SHL: return EVAL(expr->op1) << EVAL(expr->op2);
+        case OP_SHL: return (ExprValue)((ExprUValue)EVAL(expr->op1) << EVAL(expr->op2));
         case OP_SHR: return EVAL(expr->op1) >> EVAL(expr->op2);
         case OP_PLUS: return EVAL(expr->op1) + EVAL(expr->op2);
         case OP_MINUS: return EVAL(expr->op1) - EVAL(expr->op2);
         case OP_NEGATE: return -EVAL(expr->op1);
         case OP_MULTIPLY: return EVAL(expr->op1) * EVAL(expr->op2);
-        case OP_DIVIDE: { int d = EVAL(expr->op2); if (d == 0) throw ExprError("division by zero."); return EVAL(expr->op1) / d; }
-        case OP_REMAINDER: { int d = EVAL(expr->op2); if (d == 0) throw ExprError("division by zero."); return EVAL(expr->op1) % d; }
-        default: throw ExprError("internal error.");
+        case OP_DIVIDE: { int d = EVAL(expr->op2); if (d == 0) throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero."); return EVAL(expr->op1) / d; }
+        case OP_REMAINDER: { int d = EVAL(expr->op2); if (d == 0) throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero."); return EVAL(expr->op1) % d; }
+        case OP_DIVPOW2: { int v = EVAL(expr->op1); return (v + ((v >> 31) & (expr->number - 1))) >> expr->shift; }
+        case OP_REMPOW2: { int v = EVAL(expr->op1); return v - ((v + ((v >> 31) & (expr->number - 1))) & -expr->number); }
+        case OP_DIVMAGIC: {
+            int v = EVAL(expr->op1);
+            uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+            int q = (int)((a * expr->magic) >> expr->shift);
+            return (v < 0 ? -q : q);
+        }
+        case OP_REMMAGIC: {
+            int v = EVAL(expr->op1);
+            uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+            int r = (int)(a - ((a * expr->magic) >> expr->shift) * (uint64_t)expr->number);
+            return (v < 0 ? -r : r);
+        }
+        case OP_SUMN: {
+            uint32_t sum = (uint32_t)expr->number;
+            for (size_t i = 0; i < expr->argCount; i++)
+                sum += (uint32_t)EVAL(expr->args[i]);
+            return (ExprValue)sum;
+        }
+        case OP_PRODUCTN: {
+            uint32_t product = (uint32_t)expr->number;
+            for (size_t i = 0; i < expr->argCount; i++)
+                product *= (uint32_t)EVAL(expr->args[i]);
+            return (ExprValue)product;
+        }
+        case OP_BITANDN: {
+            ExprValue value = expr->number;
+            for (size_t i = 0; i < expr->argCount; i++)
+                value &= EVAL(expr->args[i]);
+            return value;
+        }
+        case OP_BITORN: {
+            ExprValue value = expr->number;
+            for (size_t i = 0; i < expr->argCount; i++)
+                value |= EVAL(expr->args[i]);
+            return value;
+        }
+        case OP_BITXORN: {
+            ExprValue value = expr->number;
+            for (size_t i = 0; i < expr->argCount; i++)
+                value ^= EVAL(expr->args[i]);
+            return value;
+        }
+        default: throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
     }
 }
 
@@ -80,8 +138,126 @@ ExprValue exprEvaluate(const Expr* expr, ExprEvaluator& eval)
 
 struct Context
 {
-    ExprToken* curToken;
+    ExprTokenReader reader;
+    const ExprStreamToken* curToken;    // always &reader.cur
     ExprResolver* resolver;
+    ExprArena* arena;
+    ExprError* error;
+    std::exception_ptr exception;       // thrown by the resolver, rethrown once the parser has cleaned up
+    std::vector<ExprGroup>* groups;     // NULL unless parsing for ExprIncremental
+};
+
+static Expr* newExpr(Context* c)
+{
+    if (c->arena)
+        return (Expr*)c->arena->allocate(sizeof(Expr));
+    return new Expr;
+}
+
+static Expr** newArgs(Context* c, Expr* const* args, size_t count)
+{
+    if (count == 0)
+        return NULL;
+    Expr** result;
+    if (c->arena)
+        result = (Expr**)c->arena->allocate(count * sizeof(Expr*));
+    else
+        result = new Expr*[count];
+    memcpy(result, args, count * sizeof(Expr*));
+    return result;
+}
+
+// Releases a partially built subtree when parsing fails
+static void freeExpr(Context* c, Expr* expr)
+{
+    if (!c->arena)
+        exprFree(expr);
+}
+
+// Parser functions return NULL on failure, after the error has been stored
+static Expr* fail(Context* c, const ExprError& error)
+{
+    *c->error = error;
+    if (c->error->position() == EXPR_NO_POSITION)
+        c->error->setPosition(c->curToken->offset);
+    return NULL;
+}
+
+static Expr* resolverThrew(Context* c)
+{
+    c->exception = std::current_exception();
+    return fail(c, ExprError(EXPR_ERROR, "resolver failed."));
+}
+
+// Called with the closing delimiter as the current token
+static void addGroup(Context* c, size_t open, Expr* expr)
+{
+    if (c->groups) {
+        ExprGroup group = { open, c->curToken->offset, expr };
+        c->groups->push_back(group);
+    }
+}
+
+static bool nextToken(Context* c)
+{
+    return exprReadToken(&c->reader, c->error);
+}
+
+static void tokenSymbol(Context* c, ExprSymbol* symbol)
+{
+    symbol->name = c->reader.input + c->curToken->offset;
+    symbol->length = c->curToken->length;
+    symbol->id = c->curToken->symbol;
+    if (symbol->id != EXPR_NO_SYMBOL)
+        symbol->hash = c->curToken->hash;
+    else
+        symbol->hash = exprHashName(symbol->name, symbol->length);
+}
+
+// Binary operators, indexed by token ID. Higher precedence binds tighter; all of them are left-associative.
+// Precedence 0 means that token is not a binary operator.
+
+struct BinaryOperator
+{
+    int precedence;
+    ExprOp op;
+};
+
+static const BinaryOperator binaryOperators[] = {
+    {  0, OP_NUMBER        },   // TOK_END
+    {  0, OP_NUMBER        },   // TOK_NUMBER
+    {  0, OP_NUMBER        },   // TOK_IDENT
+    {  0, OP_NUMBER        },   // TOK_AT
+    {  0, OP_NUMBER        },   // TOK_COMMA
+    {  9, OP_PLUS          },   // TOK_PLUS
+    {  9, OP_MINUS         },   // TOK_MINUS
+    { 10, OP_MULTIPLY      },   // TOK_ASTERISK
+    { 10, OP_DIVIDE        },   // TOK_SLASH
+    { 10, OP_REMAINDER     },   // TOK_PERCENT
+    {  0, OP_NUMBER        },   // TOK_LPAREN
+    {  0, OP_NUMBER        },   // TOK_RPAREN
+    {  0, OP_NUMBER        },   // TOK_QUESTION
+    {  0, OP_NUMBER        },   // TOK_COLON
+    {  5, OP_BITAND        },   // TOK_AMPERSAND
+    {  2, OP_LOGICAND      },   // TOK_DOUBLE_AMPERSAND
+    {  3, OP_BITOR         },   // TOK_VBAR
+    {  1, OP_LOGICOR       },   // TOK_DOUBLE_VBAR
+    {  4, OP_BITXOR        },   // TOK_CARET
+    {  0, OP_NUMBER        },   // TOK_TILDE
+    {  0, OP_NUMBER        },   // TOK_EXCLAMATION
+    {  0, OP_NUMBER        },   // TOK_HASH
+    {  0, OP_NUMBER        },   // TOK_DOLLAR
+    {  6, OP_EQUAL         },   // TOK_EQUAL
+    {  6, OP_EQUAL         },   // TOK_DOUBLE_EQUAL
+    {  6, OP_NOTEQUAL      },   // TOK_NOT_EQUAL
+    {  7, OP_LESS          },   // TOK_LESS
+    {  7, OP_LESSEQUAL     },   // TOK_LESS_EQUAL
+    {  7, OP_GREATER       },   // TOK_GREATER
+    {  7, OP_GREATEREQUAL  },   // TOK_GREATER_EQUAL
+    {  8, OP_SHR           },   // TOK_SHR
+    {  8, OP_SHL           },   // TOK_SHL
+    {  0, OP_NUMBER        },   // TOK_LBRACKET
+    {  0, OP_NUMBER        },   // TOK_RBRACKET
 };
 
 static Expr* expression(Context* c);
@@ -89,178 +265,300 @@ static Expr* expression(Context* c);
 static Expr* primaryExpression(Context* c)
 {
     const char* type;
+    size_t typeLength;
+    size_t open;
     Expr* result;
 
     switch (c->curToken->id) {
         case TOK_LPAREN:
-            c->curToken = c->curToken->next;
-            result = expression(c);
-            if (c->curToken->id != TOK_RPAREN)
-                throw ExprError("missing ')'.");
-            c->curToken = c->curToken->next;
+            open = c->curToken->offset;
+            if (!nextToken(c) || !(result = expression(c)))
+                return NULL;
+            if (c->curToken->id != TOK_RPAREN) {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ')'."));
+            }
+            addGroup(c, open, result);
+            if (!nextToken(c)) {
+                freeExpr(c, result);
+                return NULL;
+            }
             return result;
 
         case TOK_DOLLAR:
-            result = new Expr;
+            if (!nextToken(c))
+                return NULL;
+            result = newExpr(c);
             result->op = OP_DOLLAR;
-            c->curToken = c->curToken->next;
             return result;
 
-        case TOK_NUMBER:
-            result = new Expr;
+        case TOK_NUMBER: {
+            ExprValue number = c->curToken->number;
+            if (!nextToken(c))
+                return NULL;
+            result = newExpr(c);
             result->op = OP_NUMBER;
-            result->number = c->curToken->number;
-            c->curToken = c->curToken->next;
+            result->number = number;
             return result;
+        }
 
         case TOK_LBRACKET:
             type = "b";
+            typeLength = 1;
           mem:
-            c->curToken = c->curToken->next;
+            open = c->curToken->offset;
+            if (!nextToken(c))
+                return NULL;
             /*
             if (c->curToken->id == TOK_IDENT) {
                 type = c->curToken->text;
-                c->curToken = c->curToken->next;
+                nextToken(c);
                 if (c->curToken->id != TOK_COLON)
                     throw ExprError("missing ':'.");
-                c->curToken = c->curToken->next;
+                nextToken(c);
             }
             */
-            result = expression(c);
-            if (c->curToken->id != TOK_RBRACKET)
-                throw ExprError("missing ']'.");
-            c->curToken = c->curToken->next;
-            if (!strcmp(type, "b")) {
-                Expr* expr = new Expr;
+            if (!(result = expression(c)))
+                return NULL;
+            if (c->curToken->id != TOK_RBRACKET) {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ']'."));
+            }
+            addGroup(c, open, result);
+            if (!nextToken(c)) {
+                freeExpr(c, result);
+                return NULL;
+            }
+            if (typeLength == 1 && type[0] == 'b') {
+                Expr* expr = newExpr(c);
                 expr->op = OP_MEMBYTE;
                 expr->op1 = result;
                 return expr;
-            } else if (!strcmp(type, "w")) {
-                Expr* expr = new Expr;
+            } else if (typeLength == 1 && type[0] == 'w') {
+                Expr* expr = newExpr(c);
                 expr->op = OP_MEMWORD;
                 expr->op1 = result;
                 return expr;
-            } else if (!strcmp(type, "d")) {
-                Expr* expr = new Expr;
+            } else if (typeLength == 1 && type[0] == 'd') {
+                Expr* expr = newExpr(c);
                 expr->op = OP_MEMDWORD;
                 expr->op1 = result;
                 return expr;
-            } else
-                throw ExprError("unknown data type '%s'.", type);
+            } else {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_UNKNOWN_DATA_TYPE, "unknown data type '%.*s'.", (int)typeLength, type));
+            }
 
         case TOK_IDENT: {
-            if (c->curToken->next->id == TOK_AT) {
-                type = c->curToken->text;
-                c->curToken = c->curToken->next->next;
+            ExprSymbol symbol;
+            tokenSymbol(c, &symbol);
+            if (c->reader.next.id == TOK_AT) {
+                type = symbol.name;
+                typeLength = symbol.length;
+                if (!nextToken(c) || !nextToken(c))
+                    return NULL;
                 if (c->curToken->id != TOK_LBRACKET)
-                    throw ExprError("missing '[' after '@'.");
+                    return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing '[' after '@'."));
                 goto mem;
-            } else if (c->curToken->next->id == TOK_LPAREN) {
+            } else if (c->reader.next.id == TOK_LPAREN) {
                 // Function
-                const char* name = c->curToken->text;
-                c->curToken = c->curToken->next->next;
-                ExprCallback0 cb0 = c->resolver->resolveFunc0(name); 
-                ExprCallback1 cb1 = c->resolver->resolveFunc1(name);
-                ExprCallback2 cb2 = c->resolver->resolveFunc2(name);
-                ExprCallback3 cb3 = c->resolver->resolveFunc3(name);
-                if (!cb0 && !cb1 && !cb2 && !cb3)
-                    throw ExprError("unknown function '%s'.", name);
-                int expectedArgs;
-                if (cb0)
+                open = c->reader.next.offset;
+                if (!nextToken(c) || !nextToken(c))
+                    return NULL;
+                ExprFunction func = ExprFunction();
+                bool found;
+                try {
+                    found = c->resolver->resolveFunction(symbol, func);
+                } catch (...) {
+                    return resolverThrew(c);
+                }
+                if (!found || (!func.cb0 && !func.cb1 && !func.cb2 && !func.cb3
+                        && !func.ucb0 && !func.ucb1 && !func.ucb2 && !func.ucb3 && !func.cbN))
+                    return fail(c, ExprError(EXPR_UNKNOWN_FUNCTION, "unknown function '%.*s'.", (int)symbol.length, symbol.name));
+                int expectedArgs = 0;
+                if (func.cb0 || func.ucb0)
                     expectedArgs = 0;
-                else if (cb1)
+                else if (func.cb1 || func.ucb1)
                     expectedArgs = 1;
-                else if (cb2)
+                else if (func.cb2 || func.ucb2)
                     expectedArgs = 2;
-                else if (cb3)
+                else if (func.cb3 || func.ucb3)
                     expectedArgs = 3;
-                Expr* args[EXPR_MAX_FUNC_ARGS] = {NULL};
+                Expr* args[EXPR_MAX_VARIADIC_ARGS] = {NULL};
                 int numArgs = 0;
                 if (c->curToken->id != TOK_RPAREN) {
                     for (;;) {
-                        if (numArgs >= EXPR_MAX_FUNC_ARGS)
-                            throw ExprError("too many arguments for function '%s' (expected %d).", name, expectedArgs);
-                        args[numArgs++] = expression(c);
+                        if (func.cbN && numArgs >= EXPR_MAX_VARIADIC_ARGS) {
+                            fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "too many arguments for function '%.*s' (at most %d).", (int)symbol.length, symbol.name, (int)EXPR_MAX_VARIADIC_ARGS));
+                            goto freeArgs;
+                        }
+                        if (!func.cbN && numArgs >= EXPR_MAX_FUNC_ARGS) {
+                            fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "too many arguments for function '%.*s' (expected %d).", (int)symbol.length, symbol.name, expectedArgs));
+                            goto freeArgs;
+                        }
+                        if (!(args[numArgs] = expression(c)))
+                            goto freeArgs;
+                        ++numArgs;
+                        if (c->curToken->id != TOK_RPAREN && c->curToken->id != TOK_COMMA) {
+                            fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ','."));
+                            goto freeArgs;
+                        }
+                        addGroup(c, open, args[numArgs - 1]);
                         if (c->curToken->id == TOK_RPAREN)
                             break;
-                        if (c->curToken->id != TOK_COMMA)
-                            throw ExprError("missing ','.");
-                        c->curToken = c->curToken->next;
+                        open = c->curToken->offset;
+                        if (!nextToken(c))
+                            goto freeArgs;
                     }
                 }
-                c->curToken = c->curToken->next;
+                if (!nextToken(c))
+                    goto freeArgs;
                 switch (numArgs) {
                     case 0:
-                        if (!cb0)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        result = new Expr;
-                        result->op = OP_FUNC0;
-                        result->cb0 = cb0;
-                        return result;
+                        if (func.cb0) {
+                            result = newExpr(c);
+                            result->op = OP_FUNC0;
+                            result->cb0 = func.cb0;
+                            return result;
+                        }
+                        if (func.ucb0) {
+                            result = newExpr(c);
+                            result->op = OP_USERFUNC0;
+                            result->ucb0 = func.ucb0;
+                            result->user = func.user;
+                            return result;
+                        }
+                        break;
                     case 1:
-                        if (!cb1)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        result = new Expr;
-                        result->op = OP_FUNC1;
-                        result->cb1 = cb1;
-                        result->op1 = args[0];
-                        return result;
+                        if (func.cb1) {
+                            result = newExpr(c);
+                            result->op = OP_FUNC1;
+                            result->cb1 = func.cb1;
+                            result->op1 = args[0];
+                            return result;
+                        }
+                        if (func.ucb1) {
+                            result = newExpr(c);
+                            result->op = OP_USERFUNC1;
+                            result->ucb1 = func.ucb1;
+                            result->user = func.user;
+                            result->op1 = args[0];
+                            return result;
+                        }
+                        break;
                     case 2:
-                        if (!cb2)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        result = new Expr;
-                        result->op = OP_FUNC2;
-                        result->cb2 = cb2;
-                        result->op1 = args[0];
-                        result->op2 = args[1];
-                        return result;
+                        if (func.cb2) {
+                            result = newExpr(c);
+                            result->op = OP_FUNC2;
+                            result->cb2 = func.cb2;
+                            result->op1 = args[0];
+                            result->op2 = args[1];
+                            return result;
+                        }
+                        if (func.ucb2) {
+                            result = newExpr(c);
+                            result->op = OP_USERFUNC2;
+                            result->ucb2 = func.ucb2;
+                            result->user = func.user;
+                            result->op1 = args[0];
+                            result->op2 = args[1];
+                            return result;
+                        }
+                        break;
                     case 3:
-                        if (!cb3)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        result = new Expr;
-                        result->op = OP_FUNC3;
-                        result->cb3 = cb3;
-                        result->op1 = args[0];
-                        result->op2 = args[1];
-                        result->op3 = args[2];
-                        return result;
-                    default:
-                        throw ExprError("internal error.");
+                        if (func.cb3) {
+                            result = newExpr(c);
+                            result->op = OP_FUNC3;
+                            result->cb3 = func.cb3;
+                            result->op1 = args[0];
+                            result->op2 = args[1];
+                            result->op3 = args[2];
+                            return result;
+                        }
+                        if (func.ucb3) {
+                            result = newExpr(c);
+                            result->op = OP_USERFUNC3;
+                            result->ucb3 = func.ucb3;
+                            result->user = func.user;
+                            result->op1 = args[0];
+                            result->op2 = args[1];
+                            result->op3 = args[2];
+                            return result;
+                        }
+                        break;
                 }
+                if (func.cbN) {
+                    result = newExpr(c);
+                    result->op = OP_FUNCN;
+                    result->cbN = func.cbN;
+                    result->user = func.user;
+                    result->args = newArgs(c, args, numArgs);
+                    result->argCount = numArgs;
+                    return result;
+                }
+                fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "invalid number of arguments for function '%.*s' (expected %d, got %d).", (int)symbol.length, symbol.name, expectedArgs, numArgs));
+              freeArgs:
+                for (int i = 0; i < numArgs; i++)
+                    freeExpr(c, args[i]);
+                return NULL;
             } else {
                 // Label, register, etc.
                 ExprValuePtr ptr;
                 ptr.readValue = NULL;
                 ptr.ptr = NULL;
                 ptr.sizeInBytes = 0;
-                if (!c->resolver->resolveVariable(c->curToken->text, ptr))
-                    throw ExprError("unknown identifier '%s'.", c->curToken->text);
-
-                c->curToken = c->curToken->next;
+                ptr.readUserValue = NULL;
+                ptr.user = NULL;
+                ptr.isConstant = false;
+                ptr.value = 0;
+                bool found;
+                try {
+                    found = c->resolver->resolveVariable(symbol, ptr);
+                } catch (...) {
+                    return resolverThrew(c);
+                }
+                if (!found)
+                    return fail(c, ExprError(EXPR_UNKNOWN_IDENTIFIER, "unknown identifier '%.*s'.", (int)symbol.length, symbol.name));
+
+                if (!nextToken(c))
+                    return NULL;
+                if (ptr.isConstant) {
+                    if (ptr.readValue != NULL || ptr.readUserValue != NULL || ptr.ptr != NULL)
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    result = newExpr(c);
+                    result->op = OP_NUMBER;
+                    result->number = ptr.value;
+                    return result;
+                }
+                ExprOp op;
                 if (ptr.readValue) {
+                    if (ptr.ptr != NULL || ptr.readUserValue != NULL)
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    op = OP_CALLBACKVALUE;
+                } else if (ptr.readUserValue) {
                     if (ptr.ptr != NULL)
-                        throw ExprError("internal error.");
-                    result = new Expr;
-                    result->op = OP_CALLBACKVALUE;
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    op = OP_USERCALLBACKVALUE;
                 } else {
                     if (ptr.ptr == NULL)
-                        throw ExprError("internal error.");
-                    result = new Expr;
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
                     switch (ptr.sizeInBytes) {
-                        case 1: result->op = OP_BYTEVALUE; break;
-                        case 2: result->op = OP_WORDVALUE; break;
-                        case 3: result->op = OP_U24VALUE; break;
-                        case 4: result->op = OP_DWORDVALUE; break;
-                        default: throw ExprError("internal error.");
+                        case 1: op = OP_BYTEVALUE; break;
+                        case 2: op = OP_WORDVALUE; break;
+                        case 3: op = OP_U24VALUE; break;
+                        case 4: op = OP_DWORDVALUE; break;
+                        default: return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
                     }
                 }
+                result = newExpr(c);
+                result->op = op;
                 result->valuePtr = ptr;
                 return result;
             }
         }
 
         default:
-            throw ExprError("syntax error in expression.");
+            return fail(c, ExprError(EXPR_SYNTAX_ERROR, "syntax error in expression."));
     }
 }
 
@@ -268,28 +566,32 @@ static Expr* primaryExpression(Context* c)
 static Expr* unaryExpression(Context* c)
 {
     #define NEXT primaryExpression
+    Expr* operand;
     Expr* op;
 
     switch (c->curToken->id) {
         case TOK_MINUS:
-            c->curToken = c->curToken->next;
-            op = new Expr;
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            op = newExpr(c);
             op->op = OP_NEGATE;
-            op->op1 = unaryExpression(c);
+            op->op1 = operand;
             return op;
 
         case TOK_EXCLAMATION:
-            c->curToken = c->curToken->next;
-            op = new Expr;
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            op = newExpr(c);
             op->op = OP_LOGICNOT;
-            op->op1 = unaryExpression(c);
+            op->op1 = operand;
             return op;
 
         case TOK_TILDE:
-            c->curToken = c->curToken->next;
-            op = new Expr;
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            op = newExpr(c);
             op->op = OP_BITNOT;
-            op->op1 = unaryExpression(c);
+            op->op1 = operand;
             return op;
     }
 
@@ -297,279 +599,219 @@ static Expr* unaryExpression(Context* c)
     #undef NEXT
 }
 
-static Expr* multiplicativeExpression(Context* c)
+static Expr* binaryExpression(Context* c, int minPrecedence)
 {
-    #define NEXT unaryExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_ASTERISK || c->curToken->id == TOK_SLASH || c->curToken->id == TOK_PERCENT) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* result = new Expr;
-        switch (op) {
-            case TOK_ASTERISK: result->op = OP_MULTIPLY; break;
-            case TOK_SLASH: result->op = OP_DIVIDE; break;
-            case TOK_PERCENT: result->op = OP_REMAINDER; break;
+    Expr* left = unaryExpression(c);
+    if (!left)
+        return NULL;
+
+    for (;;) {
+        const BinaryOperator* op = &binaryOperators[c->curToken->id];
+        if (op->precedence < minPrecedence)
+            break;
+
+        Expr* right;
+        if (!nextToken(c) || !(right = binaryExpression(c, op->precedence + 1))) {
+            freeExpr(c, left);
+            return NULL;
         }
-        result->op1 = left;
-        result->op2 = right;
-        left = result;
-    }
 
-    #undef NEXT
-    return left;
-}
-
-static Expr* additiveExpression(Context* c)
-{
-    #define NEXT multiplicativeExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_PLUS || c->curToken->id == TOK_MINUS) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* result = new Expr;
-        switch (op) {
-            case TOK_PLUS: result->op = OP_PLUS; break;
-            case TOK_MINUS: result->op = OP_MINUS; break;
-        }
+        Expr* result = newExpr(c);
+        result->op = op->op;
         result->op1 = left;
         result->op2 = right;
         left = result;
     }
 
-    #undef NEXT
     return left;
 }
 
-static Expr* shiftExpression(Context* c)
+static Expr* expression(Context* c)
 {
-    #define NEXT additiveExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_SHL || c->curToken->id == TOK_SHR) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* result = new Expr;
-        switch (op) {
-            case TOK_SHL: result->op = OP_SHL; break;
-            case TOK_SHR: result->op = OP_SHR; break;
+    Expr* expr = binaryExpression(c, 1);
+    if (!expr)
+        return NULL;
+
+    if (c->curToken->id == TOK_QUESTION) {
+        Expr* trueCase;
+        Expr* falseCase;
+        if (!nextToken(c) || !(trueCase = expression(c))) {
+            freeExpr(c, expr);
+            return NULL;
         }
-        result->op1 = left;
-        result->op2 = right;
-        left = result;
+        if (c->curToken->id != TOK_COLON) {
+            freeExpr(c, expr);
+            freeExpr(c, trueCase);
+            return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ':'."));
+        }
+        if (!nextToken(c) || !(falseCase = expression(c))) {
+            freeExpr(c, expr);
+            freeExpr(c, trueCase);
+            return NULL;
+        }
+
+        Expr* cond = newExpr(c);
+        cond->op = OP_COND;
+        cond->op1 = expr;
+        cond->op2 = trueCase;
+        cond->op3 = falseCase;
+        expr = cond;
     }
 
-    #undef NEXT
-    return left;
+    return expr;
 }
 
-static Expr* relationalExpression(Context* c)
-{
-    #define NEXT shiftExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_LESS || c->curToken->id == TOK_LESS_EQUAL
-            || c->curToken->id == TOK_GREATER || c->curToken->id == TOK_GREATER_EQUAL) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* result = new Expr;
-        switch (op) {
-            case TOK_LESS: result->op = OP_LESS; break;
-            case TOK_LESS_EQUAL: result->op = OP_LESSEQUAL; break;
-            case TOK_GREATER: result->op = OP_GREATER; break;
-            case TOK_GREATER_EQUAL: result->op = OP_GREATEREQUAL; break;
-        }
-        result->op1 = left;
-        result->op2 = right;
-        left = result;
-    }
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    #undef NEXT
-    return left;
+Expr* exprParse(const char* input, ExprResolver& resolver)
+{
+    return exprParse(input, strlen(input), resolver);
 }
 
-static Expr* equalityExpression(Context* c)
+// Most expressions are a lone number or name; for those the leaf is built directly, without descending through
+// every precedence level
+static bool isTrivial(Context* c)
 {
-    #define NEXT relationalExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_EQUAL || c->curToken->id == TOK_DOUBLE_EQUAL || c->curToken->id == TOK_NOT_EQUAL) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* result = new Expr;
-        switch (op) {
-            case TOK_DOUBLE_EQUAL:
-            case TOK_EQUAL: result->op = OP_EQUAL; break;
-            case TOK_NOT_EQUAL: result->op = OP_NOTEQUAL; break;
-        }
-        result->op1 = left;
-        result->op2 = right;
-        left = result;
+    switch (c->curToken->id) {
+        case TOK_NUMBER:
+        case TOK_IDENT:
+        case TOK_DOLLAR:
+            return c->reader.next.id == TOK_END;
+        default:
+            return false;
     }
-
-    #undef NEXT
-    return left;
 }
 
-static Expr* bitwiseAndExpression(Context* c)
+static Expr* parseInput(Context* c, ExprResolver& resolver, ExprArena* arena,
+    std::vector<ExprGroup>* groups = NULL)
 {
-    #define NEXT equalityExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_AMPERSAND) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* op = new Expr;
-        op->op = OP_BITAND;
-        op->op1 = left;
-        op->op2 = right;
-        left = op;
+    c->curToken = &c->reader.cur;
+    c->resolver = &resolver;
+    c->arena = arena;
+    c->groups = groups;
+
+    Expr* result;
+    if (isTrivial(c))
+        result = primaryExpression(c);
+    else
+        result = expression(c);
+    if (c->exception)
+        std::rethrow_exception(c->exception);
+    if (result && c->curToken->id != TOK_END) {
+        freeExpr(c, result);
+        return fail(c, ExprError(EXPR_SYNTAX_ERROR, "syntax error in expression."));
     }
 
-    #undef NEXT
-    return left;
+    return result;
 }
 
-static Expr* bitwiseXorExpression(Context* c)
+static Expr* parseSource(const char* input, size_t length, ExprResolver& resolver, ExprSymbolPool* symbols,
+    ExprArena* arena, ExprError* error)
 {
-    #define NEXT bitwiseAndExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_CARET) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* op = new Expr;
-        op->op = OP_BITXOR;
-        op->op1 = left;
-        op->op2 = right;
-        left = op;
-    }
-
-    #undef NEXT
-    return left;
+    Context c;
+    c.error = error;
+    if (!exprInitTokenReader(&c.reader, input, length, symbols, error))
+        return NULL;
+    return parseInput(&c, resolver, arena);
 }
 
-static Expr* bitwiseOrExpression(Context* c)
+Expr* exprParse(const char* input, size_t length, ExprResolver& resolver, ExprSymbolPool* symbols, ExprArena* arena)
 {
-    #define NEXT bitwiseXorExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_VBAR) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* op = new Expr;
-        op->op = OP_BITOR;
-        op->op1 = left;
-        op->op2 = right;
-        left = op;
-    }
-
-    #undef NEXT
-    return left;
+    ExprError error;
+    Expr* result = parseSource(input, length, resolver, symbols, arena, &error);
+    if (!result)
+        throw error;
+    return result;
 }
 
-static Expr* logicalAndExpression(Context* c)
+Expr* exprParse(const ExprTokenBatch* batch, size_t index, ExprResolver& resolver, ExprArena* arena)
 {
-    #define NEXT bitwiseOrExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_DOUBLE_AMPERSAND) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* op = new Expr;
-        op->op = OP_LOGICAND;
-        op->op1 = left;
-        op->op2 = right;
-        left = op;
-    }
+    const ExprBatchEntry* entry = &batch->entries[index];
+    if (entry->lexerError)
+        return exprParse(batch->stream.input + entry->offset, entry->length, resolver, NULL, arena);
 
-    #undef NEXT
-    return left;
+    ExprError error;
+    Context c;
+    c.error = &error;
+    exprInitTokenReader(&c.reader, batch, index);
+    Expr* result = parseInput(&c, resolver, arena);
+    if (!result)
+        throw error;
+    return result;
 }
 
-static Expr* logicalOrExpression(Context* c)
+ExprParseResult exprTryParse(const char* input, ExprResolver& resolver)
 {
-    #define NEXT logicalAndExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_DOUBLE_VBAR) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-
-        Expr* op = new Expr;
-        op->op = OP_LOGICOR;
-        op->op1 = left;
-        op->op2 = right;
-        left = op;
-    }
-
-    #undef NEXT
-    return left;
+    return exprTryParse(input, strlen(input), resolver);
 }
 
-static Expr* conditionalExpression(Context* c)
+ExprParseResult exprTryParse(const char* input, size_t length, ExprResolver& resolver,
+    ExprSymbolPool* symbols, ExprArena* arena)
 {
-    #define NEXT logicalOrExpression
-    Expr* expr = NEXT(c);
-
-    if (c->curToken->id == TOK_QUESTION) {
-        c->curToken = c->curToken->next;
-        Expr* trueCase = expression(c);
-        if (c->curToken->id != TOK_COLON)
-            throw ExprError("missing ':'.");
-        c->curToken = c->curToken->next;
-        Expr* falseCase = expression(c);
-
-        Expr* cond = new Expr;
-        cond->op = OP_COND;
-        cond->op1 = expr;
-        cond->op2 = trueCase;
-        cond->op3 = falseCase;
-        expr = cond;
-    }
-
-    #undef NEXT
-    return expr;
+    ExprParseResult result;
+    result.expr = parseSource(input, length, resolver, symbols, arena, &result.error);
+    return result;
 }
 
-static Expr* expression(Context* c)
+ExprParseResult exprTryParse(const char* input, const ExprStreamToken* tokens, ExprResolver& resolver,
+    std::vector<ExprGroup>* groups)
 {
-    #define NEXT conditionalExpression
-    return NEXT(c);
-    #undef NEXT
+    ExprParseResult result;
+    Context c;
+    c.error = &result.error;
+    exprInitTokenReader(&c.reader, input, tokens);
+    result.expr = parseInput(&c, resolver, NULL, groups);
+    return result;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-Expr* exprParse(const char* input, ExprResolver& resolver)
+int exprOperandCount(ExprOp op)
 {
-    ExprTokenList list = exprLexer(input);
+    switch (op) {
+        case OP_NUMBER:
+        case OP_CALLBACKVALUE:
+        case OP_USERCALLBACKVALUE:
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE:
+        case OP_FUNC0:
+        case OP_USERFUNC0:
+        case OP_FUNCN:
+        case OP_DOLLAR:
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN:
+            return 0;
 
-    Context c;
-    c.curToken = list.first;
-    c.resolver = &resolver;
-    Expr* result = expression(&c);
+        case OP_FUNC1:
+        case OP_USERFUNC1:
+        case OP_MEMBYTE:
+        case OP_MEMWORD:
+        case OP_MEMDWORD:
+        case OP_LOGICNOT:
+        case OP_BITNOT:
+        case OP_NEGATE:
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC:
+            return 1;
 
-    if (c.curToken->id != TOK_END)
-        throw ExprError("syntax error in expression.");
+        case OP_FUNC3:
+        case OP_USERFUNC3:
+        case OP_COND:
+            return 3;
 
-    exprFreeTokens(&list);
-    return result;
+        default:
+            return 2;
+    }
+}
+
+bool exprHasArgs(ExprOp op)
+{
+    return op == OP_FUNCN || (op >= OP_SUMN && op <= OP_BITXORN);
 }
 
 void exprFree(Expr* expr)
@@ -580,25 +822,33 @@ void exprFree(Expr* expr)
     switch (expr->op) {
         case OP_NUMBER:
         case OP_CALLBACKVALUE:
+        case OP_USERCALLBACKVALUE:
         case OP_BYTEVALUE:
         case OP_WORDVALUE:
         case OP_U24VALUE:
         case OP_DWORDVALUE:
         case OP_FUNC0:
+        case OP_USERFUNC0:
         case OP_DOLLAR:
-            return;
+            break;
 
         case OP_FUNC1:
+        case OP_USERFUNC1:
         case OP_MEMBYTE:
         case OP_MEMWORD:
         case OP_MEMDWORD:
         case OP_LOGICNOT:
         case OP_BITNOT:
         case OP_NEGATE:
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC:
             exprFree(expr->op1);
-            return;
+            break;
 
         case OP_FUNC2:
+        case OP_USERFUNC2:
         case OP_LOGICOR:
         case OP_LOGICAND:
         case OP_BITOR:
@@ -619,18 +869,32 @@ void exprFree(Expr* expr)
         case OP_REMAINDER:
             exprFree(expr->op1);
             exprFree(expr->op2);
-            return;
+            break;
 
         case OP_FUNC3:
+        case OP_USERFUNC3:
         case OP_COND:
             exprFree(expr->op1);
             exprFree(expr->op2);
             exprFree(expr->op3);
-            return;
+            break;
+
+        case OP_FUNCN:
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN:
+            for (size_t i = 0; i < expr->argCount; i++)
+                exprFree(expr->args[i]);
+            delete[] expr->args;
+            break;
 
         default:
-            throw ExprError("internal error.");
+            throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
     }
+
+    delete expr;
 }
 
 } // namespace
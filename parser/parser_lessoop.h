@@ -25,6 +25,10 @@ SOFTWARE.
 #include "parser/common.h"
 #include "parser/resolve_oop.h"
 
+struct ExprTokenBatch;
+class ExprSymbolPool;
+class ExprArena;
+
 namespace ParserLessOop
 {
 
@@ -32,6 +36,7 @@ enum ExprOp
 {
     OP_NUMBER,
     OP_CALLBACKVALUE,
+    OP_USERCALLBACKVALUE,
     OP_BYTEVALUE,
     OP_WORDVALUE,
     OP_U24VALUE,
@@ -40,6 +45,11 @@ enum ExprOp
     OP_FUNC1,
     OP_FUNC2,
     OP_FUNC3,
+    OP_USERFUNC0,
+    OP_USERFUNC1,
+    OP_USERFUNC2,
+    OP_USERFUNC3,
+    OP_FUNCN,
     OP_MEMBYTE,
     OP_MEMWORD,
     OP_MEMDWORD,
@@ -66,6 +76,17 @@ enum ExprOp
     OP_MULTIPLY,
     OP_DIVIDE,
     OP_REMAINDER,
+    // Produced by exprSimplify(); number is the divisor
+    OP_DIVPOW2,
+    OP_REMPOW2,
+    OP_DIVMAGIC,
+    OP_REMMAGIC,
+    // Produced by exprFlatten(); operands are in args, number is the merged constant
+    OP_SUMN,
+    OP_PRODUCTN,
+    OP_BITANDN,
+    OP_BITORN,
+    OP_BITXORN,
 };
 
 struct Expr
@@ -73,18 +94,52 @@ struct Expr
     ExprOp op;
     ExprValue number;
     ExprValuePtr valuePtr;
-    ExprCallback0 cb0;
-    ExprCallback1 cb1;
-    ExprCallback2 cb2;
-    ExprCallback3 cb3;
+    union               // the one that matches op
+    {
+        ExprCallback0 cb0;
+        ExprCallback1 cb1;
+        ExprCallback2 cb2;
+        ExprCallback3 cb3;
+        ExprUserCallback0 ucb0;
+        ExprUserCallback1 ucb1;
+        ExprUserCallback2 ucb2;
+        ExprUserCallback3 ucb3;
+        ExprCallbackN cbN;
+        uint64_t magic;     // for OP_DIVMAGIC and OP_REMMAGIC
+    };
+    void* user;         // for OP_USERFUNCx and OP_FUNCN
+    Expr** args;        // for nodes with exprHasArgs()
+    union
+    {
+        size_t argCount;    // for nodes with exprHasArgs()
+        int shift;          // for OP_DIVPOW2, OP_REMPOW2, OP_DIVMAGIC and OP_REMMAGIC
+    };
     Expr* op1;
     Expr* op2;
     Expr* op3;
 };
 
+struct ExprParseResult
+{
+    Expr* expr;         // NULL on failure
+    ExprError error;    // status() is EXPR_OK on success
+};
+
 Expr* exprParse(const char* input, ExprResolver& resolver);
+// When an arena is given, all nodes are allocated from it and the result must not be passed to exprFree()
+Expr* exprParse(const char* input, size_t length, ExprResolver& resolver,
+    ExprSymbolPool* symbols = NULL, ExprArena* arena = NULL);
+Expr* exprParse(const ExprTokenBatch* batch, size_t index, ExprResolver& resolver, ExprArena* arena = NULL);
+// Same as exprParse(), but reports errors through the result instead of throwing ExprError. Nothing is leaked
+// on failure; exceptions thrown by the resolver are passed through.
+ExprParseResult exprTryParse(const char* input, ExprResolver& resolver);
+ExprParseResult exprTryParse(const char* input, size_t length, ExprResolver& resolver,
+    ExprSymbolPool* symbols = NULL, ExprArena* arena = NULL);
 ExprValue exprEvaluate(const Expr* expr, ExprEvaluator& eval);
 void exprFree(Expr* expr);
+// Number of op1..op3 fields used by nodes of this kind; nodes with exprHasArgs() keep their operands in args instead
+int exprOperandCount(ExprOp op);
+bool exprHasArgs(ExprOp op);
 
 } // namespace
 
@@ -21,7 +21,10 @@ SOFTWARE.
 */
 #include "parser/parser_oop.h"
 #include "parser/lexer.h"
+#include "parser/arena.h"
+#include <limits.h>
 #include <string.h>
+#include <exception>
 
 namespace ParserOop
 {
@@ -39,6 +42,8 @@ public:
         return m_number;
     }
 
+    bool isConstant(ExprValue* value) const { *value = m_number; return true; }
+
 private:
     ExprValue m_number;
 };
@@ -53,6 +58,24 @@ public:
         return m_ptr.readValue();
     }
 
+    bool canDiscard() const { return false; }
+
+private:
+    ExprValuePtr m_ptr;
+};
+
+class UserCallbackValueExpr : public Expr
+{
+public:
+    explicit UserCallbackValueExpr(ExprValuePtr ptr) : m_ptr(ptr) {}
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        return m_ptr.readUserValue(m_ptr.user);
+    }
+
+    bool canDiscard() const { return false; }
+
 private:
     ExprValuePtr m_ptr;
 };
@@ -125,6 +148,8 @@ public:
         return m_callback();
     }
 
+    bool canDiscard() const { return false; }
+
 private:
     ExprCallback0 m_callback;
 };
@@ -140,6 +165,14 @@ public:
         return m_callback(m_arg1->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        return this;
+    }
+
 private:
     ExprCallback1 m_callback;
     Expr* m_arg1;
@@ -156,6 +189,15 @@ public:
         return m_callback(m_arg1->evaluate(e), m_arg2->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        m_arg2 = m_arg2->foldConstants(arena);
+        return this;
+    }
+
 private:
     ExprCallback2 m_callback;
     Expr* m_arg1;
@@ -173,6 +215,16 @@ public:
         return m_callback(m_arg1->evaluate(e), m_arg2->evaluate(e), m_arg3->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        m_arg2 = m_arg2->foldConstants(arena);
+        m_arg3 = m_arg3->foldConstants(arena);
+        return this;
+    }
+
 private:
     ExprCallback3 m_callback;
     Expr* m_arg1;
@@ -180,6 +232,134 @@ private:
     Expr* m_arg3;
 };
 
+class UserFunc0Expr : public Expr
+{
+public:
+    UserFunc0Expr(ExprUserCallback0 cb, void* user) : m_callback(cb), m_user(user) {}
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        return m_callback(m_user);
+    }
+
+    bool canDiscard() const { return false; }
+
+private:
+    ExprUserCallback0 m_callback;
+    void* m_user;
+};
+
+class UserFunc1Expr : public Expr
+{
+public:
+    UserFunc1Expr(ExprUserCallback1 cb, void* user, Expr* arg1) : m_callback(cb), m_user(user), m_arg1(arg1) {}
+    ~UserFunc1Expr() { delete m_arg1; }
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        return m_callback(m_arg1->evaluate(e), m_user);
+    }
+
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        return this;
+    }
+
+private:
+    ExprUserCallback1 m_callback;
+    void* m_user;
+    Expr* m_arg1;
+};
+
+class UserFunc2Expr : public Expr
+{
+public:
+    UserFunc2Expr(ExprUserCallback2 cb, void* user, Expr* arg1, Expr* arg2) : m_callback(cb), m_user(user), m_arg1(arg1), m_arg2(arg2) {}
+    ~UserFunc2Expr() { delete m_arg1; delete m_arg2; }
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        return m_callback(m_arg1->evaluate(e), m_arg2->evaluate(e), m_user);
+    }
+
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        m_arg2 = m_arg2->foldConstants(arena);
+        return this;
+    }
+
+private:
+    ExprUserCallback2 m_callback;
+    void* m_user;
+    Expr* m_arg1;
+    Expr* m_arg2;
+};
+
+class UserFunc3Expr : public Expr
+{
+public:
+    UserFunc3Expr(ExprUserCallback3 cb, void* user, Expr* arg1, Expr* arg2, Expr* arg3) : m_callback(cb), m_user(user), m_arg1(arg1), m_arg2(arg2), m_arg3(arg3) {}
+    ~UserFunc3Expr() { delete m_arg1; delete m_arg2; delete m_arg3; }
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        return m_callback(m_arg1->evaluate(e), m_arg2->evaluate(e), m_arg3->evaluate(e), m_user);
+    }
+
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        m_arg1 = m_arg1->foldConstants(arena);
+        m_arg2 = m_arg2->foldConstants(arena);
+        m_arg3 = m_arg3->foldConstants(arena);
+        return this;
+    }
+
+private:
+    ExprUserCallback3 m_callback;
+    void* m_user;
+    Expr* m_arg1;
+    Expr* m_arg2;
+    Expr* m_arg3;
+};
+
+class FuncNExpr : public Expr
+{
+public:
+    FuncNExpr(ExprCallbackN cb, void* user, Expr** args, size_t count) : m_callback(cb), m_user(user), m_args(args), m_count(count) {}
+    ~FuncNExpr() { for (size_t i = 0; i < m_count; i++) delete m_args[i]; delete[] m_args; }
+
+    ExprValue evaluate(ExprEvaluator& e) const
+    {
+        ExprValue args[EXPR_MAX_VARIADIC_ARGS];
+        for (size_t i = 0; i < m_count; i++)
+            args[i] = m_args[i]->evaluate(e);
+        return m_callback(args, m_count, m_user);
+    }
+
+    bool canDiscard() const { return false; }
+
+    Expr* foldConstants(ExprArena* arena)
+    {
+        for (size_t i = 0; i < m_count; i++)
+            m_args[i] = m_args[i]->foldConstants(arena);
+        return this;
+    }
+
+private:
+    ExprCallbackN m_callback;
+    void* m_user;
+    Expr** m_args;
+    size_t m_count;
+};
+
 class MemByteExpr : public Expr
 {
 public:
@@ -191,6 +371,9 @@ public:
         return e.memByte(m_op->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+    Expr* foldConstants(ExprArena* arena) { m_op = m_op->foldConstants(arena); return this; }
+
 private:
     Expr* m_op;
 };
@@ -206,6 +389,9 @@ public:
         return e.memWord(m_op->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+    Expr* foldConstants(ExprArena* arena) { m_op = m_op->foldConstants(arena); return this; }
+
 private:
     Expr* m_op;
 };
@@ -221,6 +407,9 @@ public:
         return e.memDword(m_op->evaluate(e));
     }
 
+    bool canDiscard() const { return false; }
+    Expr* foldConstants(ExprArena* arena) { m_op = m_op->foldConstants(arena); return this; }
+
 private:
     Expr* m_op;
 };
@@ -236,6 +425,50 @@ public:
     }
 };
 
+// Operator that computes its value from its operand only
+class UnaryExpr : public Expr
+{
+public:
+    explicit UnaryExpr(Expr* op) : m_op(op) {}
+    ~UnaryExpr() { delete m_op; }
+
+    bool canDiscard() const { return m_op->canDiscard(); }
+    Expr* foldConstants(ExprArena* arena);
+
+protected:
+    Expr* m_op;
+};
+
+// Operator that computes its value from its two operands only
+class BinaryExpr : public Expr
+{
+public:
+    BinaryExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
+    ~BinaryExpr() { delete m_left; delete m_right; }
+
+    bool canDiscard() const { return m_left->canDiscard() && m_right->canDiscard(); }
+    Expr* foldConstants(ExprArena* arena);
+
+protected:
+    Expr* m_left;
+    Expr* m_right;
+
+    // False if evaluating would fail, so that the error is still reported at run time
+    virtual bool canFold(ExprValue left, ExprValue right) const { (void)left; (void)right; return true; }
+};
+
+// && and ||, which can be short-circuited with only one side constant
+class LogicExpr : public BinaryExpr
+{
+public:
+    LogicExpr(Expr* left, Expr* right, bool isAnd) : BinaryExpr(left, right), m_isAnd(isAnd) {}
+
+    Expr* foldConstants(ExprArena* arena);
+
+private:
+    bool m_isAnd;
+};
+
 class ConditionalExpr : public Expr
 {
 public:
@@ -250,358 +483,463 @@ public:
             return m_falseCase->evaluate(e);
     }
 
+    bool canDiscard() const { return m_cond->canDiscard() && m_trueCase->canDiscard() && m_falseCase->canDiscard(); }
+    Expr* foldConstants(ExprArena* arena);
+
 private:
     Expr* m_cond;
     Expr* m_falseCase;
     Expr* m_trueCase;
 };
 
-class LogicOrExpr : public Expr
+class LogicOrExpr : public LogicExpr
 {
 public:
-    LogicOrExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~LogicOrExpr() { delete m_left; delete m_right; }
+    LogicOrExpr(Expr* left, Expr* right) : LogicExpr(left, right, false) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) || m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class LogicAndExpr : public Expr
+class LogicAndExpr : public LogicExpr
 {
 public:
-    LogicAndExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~LogicAndExpr() { delete m_left; delete m_right; }
+    LogicAndExpr(Expr* left, Expr* right) : LogicExpr(left, right, true) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) && m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class LogicNotExpr : public Expr
+class LogicNotExpr : public UnaryExpr
 {
 public:
-    LogicNotExpr(Expr* op) : m_op(op) {}
-    ~LogicNotExpr() { delete m_op; }
+    LogicNotExpr(Expr* op) : UnaryExpr(op) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return !m_op->evaluate(e);
     }
-
-private:
-    Expr* m_op;
 };
 
-class OrExpr : public Expr
+class OrExpr : public BinaryExpr
 {
 public:
-    OrExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~OrExpr() { delete m_left; delete m_right; }
+    OrExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) | m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class AndExpr : public Expr
+class AndExpr : public BinaryExpr
 {
 public:
-    AndExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~AndExpr() { delete m_left; delete m_right; }
+    AndExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) & m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class XorExpr : public Expr
+class XorExpr : public BinaryExpr
 {
 public:
-    XorExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~XorExpr() { delete m_left; delete m_right; }
+    XorExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) ^ m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class NotExpr : public Expr
+class NotExpr : public UnaryExpr
 {
 public:
-    NotExpr(Expr* op) : m_op(op) {}
-    ~NotExpr() { delete m_op; }
+    NotExpr(Expr* op) : UnaryExpr(op) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return ~m_op->evaluate(e);
     }
-
-private:
-    Expr* m_op;
 };
 
-class EqualityExpr : public Expr
+class EqualityExpr : public BinaryExpr
 {
 public:
-    EqualityExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~EqualityExpr() { delete m_left; delete m_right; }
+    EqualityExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) == m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class InequalityExpr : public Expr
+class InequalityExpr : public BinaryExpr
 {
 public:
-    InequalityExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~InequalityExpr() { delete m_left; delete m_right; }
+    InequalityExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) != m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class LessExpr : public Expr
+class LessExpr : public BinaryExpr
 {
 public:
-    LessExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~LessExpr() { delete m_left; delete m_right; }
+    LessExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) < m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class LessEqualExpr : public Expr
+class LessEqualExpr : public BinaryExpr
 {
 public:
-    LessEqualExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~LessEqualExpr() { delete m_left; delete m_right; }
+    LessEqualExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) <= m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class GreaterExpr : public Expr
+class GreaterExpr : public BinaryExpr
 {
 public:
-    GreaterExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~GreaterExpr() { delete m_left; delete m_right; }
+    GreaterExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) > m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class GreaterEqualExpr : public Expr
+class GreaterEqualExpr : public BinaryExpr
 {
 public:
-    GreaterEqualExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~GreaterEqualExpr() { delete m_left; delete m_right; }
+    GreaterEqualExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) >= m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class ShlExpr : public Expr
+class ShlExpr : public BinaryExpr
 {
 public:
-    ShlExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~ShlExpr() { delete m_left; delete m_right; }
+    ShlExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) << m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class ShrExpr : public Expr
+class ShrExpr : public BinaryExpr
 {
 public:
-    ShrExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~ShrExpr() { delete m_left; delete m_right; }
+    ShrExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return (ExprValue)((ExprUValue)m_left->evaluate(e) >> (ExprUValue)m_right->evaluate(e));
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class PlusExpr : public Expr
+class PlusExpr : public BinaryExpr
 {
 public:
-    PlusExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~PlusExpr() { delete m_left; delete m_right; }
+    PlusExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) + m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class MinusExpr : public Expr
+class MinusExpr : public BinaryExpr
 {
 public:
-    MinusExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~MinusExpr() { delete m_left; delete m_right; }
+    MinusExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) - m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class NegateExpr : public Expr
+class NegateExpr : public UnaryExpr
 {
 public:
-    NegateExpr(Expr* op) : m_op(op) {}
-    ~NegateExpr() { delete m_op; }
+    NegateExpr(Expr* op) : UnaryExpr(op) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return -m_op->evaluate(e);
     }
-
-private:
-    Expr* m_op;
 };
 
-class MultiplyExpr : public Expr
+class MultiplyExpr : public BinaryExpr
 {
 public:
-    MultiplyExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~MultiplyExpr() { delete m_left; delete m_right; }
+    MultiplyExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         return m_left->evaluate(e) * m_right->evaluate(e);
     }
-
-private:
-    Expr* m_left;
-    Expr* m_right;
 };
 
-class DivideExpr : public Expr
+class DivideExpr : public BinaryExpr
 {
 public:
-    DivideExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~DivideExpr() { delete m_left; delete m_right; }
+    DivideExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         int r = m_right->evaluate(e);
         if (r == 0)
-            throw ExprError("division by zero.");
+            throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero.");
         return m_left->evaluate(e) / r;
     }
 
+    bool canDiscard() const { return false; }
+
 private:
-    Expr* m_left;
-    Expr* m_right;
+    bool canFold(ExprValue left, ExprValue right) const { return right != 0 && !(right == -1 && left == INT_MIN); }
 };
 
-class RemainderExpr : public Expr
+class RemainderExpr : public BinaryExpr
 {
 public:
-    RemainderExpr(Expr* left, Expr* right) : m_left(left), m_right(right) {}
-    ~RemainderExpr() { delete m_left; delete m_right; }
+    RemainderExpr(Expr* left, Expr* right) : BinaryExpr(left, right) {}
 
     ExprValue evaluate(ExprEvaluator& e) const
     {
         int r = m_right->evaluate(e);
         if (r == 0)
-            throw ExprError("division by zero.");
+            throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero.");
         return m_left->evaluate(e) % r;
     }
 
+    bool canDiscard() const { return false; }
+
 private:
-    Expr* m_left;
-    Expr* m_right;
+    bool canFold(ExprValue left, ExprValue right) const { return right != 0 && !(right == -1 && left == INT_MIN); }
 };
 
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Constant folding
+
+static void release(Expr* expr, ExprArena* arena)
+{
+    if (!arena)
+        delete expr;
+}
+
+static Expr* replaceWithNumber(Expr* expr, ExprValue value, ExprArena* arena)
+{
+    release(expr, arena);
+    return new (arena) NumberExpr(value);
+}
+
+Expr* UnaryExpr::foldConstants(ExprArena* arena)
+{
+    m_op = m_op->foldConstants(arena);
+    ExprValue value;
+    if (!m_op->isConstant(&value))
+        return this;
+    ExprEvaluator e(0);
+    return replaceWithNumber(this, evaluate(e), arena);
+}
+
+Expr* BinaryExpr::foldConstants(ExprArena* arena)
+{
+    m_left = m_left->foldConstants(arena);
+    m_right = m_right->foldConstants(arena);
+    ExprValue left, right;
+    if (!m_left->isConstant(&left) || !m_right->isConstant(&right) || !canFold(left, right))
+        return this;
+    ExprEvaluator e(0);
+    return replaceWithNumber(this, evaluate(e), arena);
+}
+
+Expr* LogicExpr::foldConstants(ExprArena* arena)
+{
+    Expr* result = BinaryExpr::foldConstants(arena);
+    if (result != this)
+        return result;
+
+    // Value that decides the result on its own: 0 for &&, anything else for ||
+    ExprValue value;
+    Expr* operand;
+    if (m_left->isConstant(&value)) {
+        if ((value != 0) != m_isAnd)
+            return replaceWithNumber(this, m_isAnd ? 0 : 1, arena);
+        operand = m_right;
+        m_right = NULL;
+    } else if (m_right->isConstant(&value)) {
+        if ((value != 0) != m_isAnd) {
+            if (!m_left->canDiscard())
+                return this;
+            return replaceWithNumber(this, m_isAnd ? 0 : 1, arena);
+        }
+        operand = m_left;
+        m_left = NULL;
+    } else
+        return this;
+
+    release(this, arena);
+    return new (arena) InequalityExpr(operand, new (arena) NumberExpr(0));
+}
+
+Expr* ConditionalExpr::foldConstants(ExprArena* arena)
+{
+    m_cond = m_cond->foldConstants(arena);
+    m_trueCase = m_trueCase->foldConstants(arena);
+    m_falseCase = m_falseCase->foldConstants(arena);
+    ExprValue value;
+    if (!m_cond->isConstant(&value))
+        return this;
+
+    Expr* taken;
+    if (value) {
+        taken = m_trueCase;
+        m_trueCase = NULL;
+    } else {
+        taken = m_falseCase;
+        m_falseCase = NULL;
+    }
+    release(this, arena);
+    return taken;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 /// Parser
 
 struct Context
 {
-    ExprToken* curToken;
+    ExprTokenReader reader;
+    const ExprStreamToken* curToken;    // always &reader.cur
     ExprResolver* resolver;
+    ExprArena* arena;
+    ExprError* error;
+    std::exception_ptr exception;       // thrown by the resolver, rethrown once the parser has cleaned up
+};
+
+static Expr** newArgs(Context* c, Expr* const* args, size_t count)
+{
+    if (count == 0)
+        return NULL;
+    Expr** result;
+    if (c->arena)
+        result = (Expr**)c->arena->allocate(count * sizeof(Expr*));
+    else
+        result = new Expr*[count];
+    memcpy(result, args, count * sizeof(Expr*));
+    return result;
+}
+
+// Releases a partially built subtree when parsing fails
+static void freeExpr(Context* c, Expr* expr)
+{
+    if (!c->arena)
+        delete expr;
+}
+
+// Parser functions return NULL on failure, after the error has been stored
+static Expr* fail(Context* c, const ExprError& error)
+{
+    *c->error = error;
+    if (c->error->position() == EXPR_NO_POSITION)
+        c->error->setPosition(c->curToken->offset);
+    return NULL;
+}
+
+static Expr* resolverThrew(Context* c)
+{
+    c->exception = std::current_exception();
+    return fail(c, ExprError(EXPR_ERROR, "resolver failed."));
+}
+
+static bool nextToken(Context* c)
+{
+    return exprReadToken(&c->reader, c->error);
+}
+
+static void tokenSymbol(Context* c, ExprSymbol* symbol)
+{
+    symbol->name = c->reader.input + c->curToken->offset;
+    symbol->length = c->curToken->length;
+    symbol->id = c->curToken->symbol;
+    if (symbol->id != EXPR_NO_SYMBOL)
+        symbol->hash = c->curToken->hash;
+    else
+        symbol->hash = exprHashName(symbol->name, symbol->length);
+}
+
+// Binary operators, indexed by token ID. Higher precedence binds tighter; all of them are left-associative.
+// Precedence 0 means that token is not a binary operator.
+
+typedef Expr* (*BinaryExprFactory)(ExprArena* arena, Expr* left, Expr* right);
+
+template <class T> static Expr* newBinaryExpr(ExprArena* arena, Expr* left, Expr* right)
+{
+    return new (arena) T(left, right);
+}
+
+struct BinaryOperator
+{
+    int precedence;
+    BinaryExprFactory create;
+};
+
+static const BinaryOperator binaryOperators[] = {
+    {  0, NULL                                     },   // TOK_END
+    {  0, NULL                                     },   // TOK_NUMBER
+    {  0, NULL                                     },   // TOK_IDENT
+    {  0, NULL                                     },   // TOK_AT
+    {  0, NULL                                     },   // TOK_COMMA
+    {  9, newBinaryExpr<PlusExpr>                  },   // TOK_PLUS
+    {  9, newBinaryExpr<MinusExpr>                 },   // TOK_MINUS
+    { 10, newBinaryExpr<MultiplyExpr>              },   // TOK_ASTERISK
+    { 10, newBinaryExpr<DivideExpr>                },   // TOK_SLASH
+    { 10, newBinaryExpr<RemainderExpr>             },   // TOK_PERCENT
+    {  0, NULL                                     },   // TOK_LPAREN
+    {  0, NULL                                     },   // TOK_RPAREN
+    {  0, NULL                                     },   // TOK_QUESTION
+    {  0, NULL                                     },   // TOK_COLON
+    {  5, newBinaryExpr<AndExpr>                   },   // TOK_AMPERSAND
+    {  2, newBinaryExpr<LogicAndExpr>              },   // TOK_DOUBLE_AMPERSAND
+    {  3, newBinaryExpr<OrExpr>                    },   // TOK_VBAR
+    {  1, newBinaryExpr<LogicOrExpr>               },   // TOK_DOUBLE_VBAR
+    {  4, newBinaryExpr<XorExpr>                   },   // TOK_CARET
+    {  0, NULL                                     },   // TOK_TILDE
+    {  0, NULL                                     },   // TOK_EXCLAMATION
+    {  0, NULL                                     },   // TOK_HASH
+    {  0, NULL                                     },   // TOK_DOLLAR
+    {  6, newBinaryExpr<EqualityExpr>              },   // TOK_EQUAL
+    {  6, newBinaryExpr<EqualityExpr>              },   // TOK_DOUBLE_EQUAL
+    {  6, newBinaryExpr<InequalityExpr>            },   // TOK_NOT_EQUAL
+    {  7, newBinaryExpr<LessExpr>                  },   // TOK_LESS
+    {  7, newBinaryExpr<LessEqualExpr>             },   // TOK_LESS_EQUAL
+    {  7, newBinaryExpr<GreaterExpr>               },   // TOK_GREATER
+    {  7, newBinaryExpr<GreaterEqualExpr>          },   // TOK_GREATER_EQUAL
+    {  8, newBinaryExpr<ShrExpr>                   },   // TOK_SHR
+    {  8, newBinaryExpr<ShlExpr>                   },   // TOK_SHL
+    {  0, NULL                                     },   // TOK_LBRACKET
+    {  0, NULL                                     },   // TOK_RBRACKET
 };
 
 static Expr* expression(Context* c);
@@ -609,145 +947,215 @@ static Expr* expression(Context* c);
 static Expr* primaryExpression(Context* c)
 {
     const char* type;
+    size_t typeLength;
     Expr* result;
 
     switch (c->curToken->id) {
         case TOK_LPAREN:
-            c->curToken = c->curToken->next;
-            result = expression(c);
-            if (c->curToken->id != TOK_RPAREN)
-                throw ExprError("missing ')'.");
-            c->curToken = c->curToken->next;
+            if (!nextToken(c) || !(result = expression(c)))
+                return NULL;
+            if (c->curToken->id != TOK_RPAREN) {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ')'."));
+            }
+            if (!nextToken(c)) {
+                freeExpr(c, result);
+                return NULL;
+            }
             return result;
 
         case TOK_DOLLAR:
-            result = new DollarExpr();
-            c->curToken = c->curToken->next;
-            return result;
-
-        case TOK_NUMBER:
-            result = new NumberExpr(c->curToken->number);
-            c->curToken = c->curToken->next;
-            return result;
+            if (!nextToken(c))
+                return NULL;
+            return new (c->arena) DollarExpr();
+
+        case TOK_NUMBER: {
+            ExprValue number = c->curToken->number;
+            if (!nextToken(c))
+                return NULL;
+            return new (c->arena) NumberExpr(number);
+        }
 
         case TOK_LBRACKET:
             type = "b";
+            typeLength = 1;
           mem:
-            c->curToken = c->curToken->next;
+            if (!nextToken(c))
+                return NULL;
             /*
             if (c->curToken->id == TOK_IDENT) {
                 type = c->curToken->text;
-                c->curToken = c->curToken->next;
+                nextToken(c);
                 if (c->curToken->id != TOK_COLON)
                     throw ExprError("missing ':'.");
-                c->curToken = c->curToken->next;
+                nextToken(c);
             }
             */
-            result = expression(c);
-            if (c->curToken->id != TOK_RBRACKET)
-                throw ExprError("missing ']'.");
-            c->curToken = c->curToken->next;
-            if (!strcmp(type, "b"))
-                return new MemByteExpr(result);
-            else if (!strcmp(type, "w"))
-                return new MemWordExpr(result);
-            else if (!strcmp(type, "d"))
-                return new MemDwordExpr(result);
-            else
-                throw ExprError("unknown data type '%s'.", type);
+            if (!(result = expression(c)))
+                return NULL;
+            if (c->curToken->id != TOK_RBRACKET) {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ']'."));
+            }
+            if (!nextToken(c)) {
+                freeExpr(c, result);
+                return NULL;
+            }
+            if (typeLength == 1 && type[0] == 'b')
+                return new (c->arena) MemByteExpr(result);
+            else if (typeLength == 1 && type[0] == 'w')
+                return new (c->arena) MemWordExpr(result);
+            else if (typeLength == 1 && type[0] == 'd')
+                return new (c->arena) MemDwordExpr(result);
+            else {
+                freeExpr(c, result);
+                return fail(c, ExprError(EXPR_UNKNOWN_DATA_TYPE, "unknown data type '%.*s'.", (int)typeLength, type));
+            }
 
         case TOK_IDENT: {
-            if (c->curToken->next->id == TOK_AT) {
-                type = c->curToken->text;
-                c->curToken = c->curToken->next->next;
+            ExprSymbol symbol;
+            tokenSymbol(c, &symbol);
+            if (c->reader.next.id == TOK_AT) {
+                type = symbol.name;
+                typeLength = symbol.length;
+                if (!nextToken(c) || !nextToken(c))
+                    return NULL;
                 if (c->curToken->id != TOK_LBRACKET)
-                    throw ExprError("missing '[' after '@'.");
+                    return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing '[' after '@'."));
                 goto mem;
-            } else if (c->curToken->next->id == TOK_LPAREN) {
+            } else if (c->reader.next.id == TOK_LPAREN) {
                 // Function
-                const char* name = c->curToken->text;
-                c->curToken = c->curToken->next->next;
-                ExprCallback0 cb0 = c->resolver->resolveFunc0(name); 
-                ExprCallback1 cb1 = c->resolver->resolveFunc1(name);
-                ExprCallback2 cb2 = c->resolver->resolveFunc2(name);
-                ExprCallback3 cb3 = c->resolver->resolveFunc3(name);
-                if (!cb0 && !cb1 && !cb2 && !cb3)
-                    throw ExprError("unknown function '%s'.", name);
-                int expectedArgs;
-                if (cb0)
+                if (!nextToken(c) || !nextToken(c))
+                    return NULL;
+                ExprFunction func = ExprFunction();
+                bool found;
+                try {
+                    found = c->resolver->resolveFunction(symbol, func);
+                } catch (...) {
+                    return resolverThrew(c);
+                }
+                if (!found || (!func.cb0 && !func.cb1 && !func.cb2 && !func.cb3
+                        && !func.ucb0 && !func.ucb1 && !func.ucb2 && !func.ucb3 && !func.cbN))
+                    return fail(c, ExprError(EXPR_UNKNOWN_FUNCTION, "unknown function '%.*s'.", (int)symbol.length, symbol.name));
+                int expectedArgs = 0;
+                if (func.cb0 || func.ucb0)
                     expectedArgs = 0;
-                else if (cb1)
+                else if (func.cb1 || func.ucb1)
                     expectedArgs = 1;
-                else if (cb2)
+                else if (func.cb2 || func.ucb2)
                     expectedArgs = 2;
-                else if (cb3)
+                else if (func.cb3 || func.ucb3)
                     expectedArgs = 3;
-                Expr* args[EXPR_MAX_FUNC_ARGS] = {NULL};
+                Expr* args[EXPR_MAX_VARIADIC_ARGS] = {NULL};
                 int numArgs = 0;
                 if (c->curToken->id != TOK_RPAREN) {
                     for (;;) {
-                        if (numArgs >= EXPR_MAX_FUNC_ARGS)
-                            throw ExprError("too many arguments for function '%s' (expected %d).", name, expectedArgs);
-                        args[numArgs++] = expression(c);
+                        if (func.cbN && numArgs >= EXPR_MAX_VARIADIC_ARGS) {
+                            fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "too many arguments for function '%.*s' (at most %d).", (int)symbol.length, symbol.name, (int)EXPR_MAX_VARIADIC_ARGS));
+                            goto freeArgs;
+                        }
+                        if (!func.cbN && numArgs >= EXPR_MAX_FUNC_ARGS) {
+                            fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "too many arguments for function '%.*s' (expected %d).", (int)symbol.length, symbol.name, expectedArgs));
+                            goto freeArgs;
+                        }
+                        if (!(args[numArgs] = expression(c)))
+                            goto freeArgs;
+                        ++numArgs;
                         if (c->curToken->id == TOK_RPAREN)
                             break;
-                        if (c->curToken->id != TOK_COMMA)
-                            throw ExprError("missing ','.");
-                        c->curToken = c->curToken->next;
+                        if (c->curToken->id != TOK_COMMA) {
+                            fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ','."));
+                            goto freeArgs;
+                        }
+                        if (!nextToken(c))
+                            goto freeArgs;
                     }
                 }
-                c->curToken = c->curToken->next;
+                if (!nextToken(c))
+                    goto freeArgs;
                 switch (numArgs) {
                     case 0:
-                        if (!cb0)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        return new Func0Expr(cb0);
+                        if (func.cb0)
+                            return new (c->arena) Func0Expr(func.cb0);
+                        if (func.ucb0)
+                            return new (c->arena) UserFunc0Expr(func.ucb0, func.user);
+                        break;
                     case 1:
-                        if (!cb1)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        return new Func1Expr(cb1, args[0]);
+                        if (func.cb1)
+                            return new (c->arena) Func1Expr(func.cb1, args[0]);
+                        if (func.ucb1)
+                            return new (c->arena) UserFunc1Expr(func.ucb1, func.user, args[0]);
+                        break;
                     case 2:
-                        if (!cb2)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        return new Func2Expr(cb2, args[0], args[1]);
+                        if (func.cb2)
+                            return new (c->arena) Func2Expr(func.cb2, args[0], args[1]);
+                        if (func.ucb2)
+                            return new (c->arena) UserFunc2Expr(func.ucb2, func.user, args[0], args[1]);
+                        break;
                     case 3:
-                        if (!cb3)
-                            throw ExprError("invalid number of arguments for function '%s' (expected %d, got %d).", name, expectedArgs, numArgs);
-                        return new Func3Expr(cb3, args[0], args[1], args[2]);
-                    default:
-                        throw ExprError("internal error.");
+                        if (func.cb3)
+                            return new (c->arena) Func3Expr(func.cb3, args[0], args[1], args[2]);
+                        if (func.ucb3)
+                            return new (c->arena) UserFunc3Expr(func.ucb3, func.user, args[0], args[1], args[2]);
+                        break;
                 }
+                if (func.cbN)
+                    return new (c->arena) FuncNExpr(func.cbN, func.user, newArgs(c, args, numArgs), numArgs);
+                fail(c, ExprError(EXPR_INVALID_ARGUMENT_COUNT, "invalid number of arguments for function '%.*s' (expected %d, got %d).", (int)symbol.length, symbol.name, expectedArgs, numArgs));
+              freeArgs:
+                for (int i = 0; i < numArgs; i++)
+                    freeExpr(c, args[i]);
+                return NULL;
             } else {
                 // Label, register, etc.
                 ExprValuePtr ptr;
                 ptr.readValue = NULL;
                 ptr.ptr = NULL;
                 ptr.sizeInBytes = 0;
-                if (!c->resolver->resolveVariable(c->curToken->text, ptr))
-                    throw ExprError("unknown identifier '%s'.", c->curToken->text);
-
-                c->curToken = c->curToken->next;
+                ptr.readUserValue = NULL;
+                ptr.user = NULL;
+                ptr.isConstant = false;
+                ptr.value = 0;
+                bool found;
+                try {
+                    found = c->resolver->resolveVariable(symbol, ptr);
+                } catch (...) {
+                    return resolverThrew(c);
+                }
+                if (!found)
+                    return fail(c, ExprError(EXPR_UNKNOWN_IDENTIFIER, "unknown identifier '%.*s'.", (int)symbol.length, symbol.name));
+
+                if (!nextToken(c))
+                    return NULL;
+                if (ptr.isConstant) {
+                    if (ptr.readValue != NULL || ptr.readUserValue != NULL || ptr.ptr != NULL)
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    return new (c->arena) NumberExpr(ptr.value);
+                }
                 if (ptr.readValue) {
+                    if (ptr.ptr != NULL || ptr.readUserValue != NULL)
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    return new (c->arena) CallbackValueExpr(ptr);
+                } else if (ptr.readUserValue) {
                     if (ptr.ptr != NULL)
-                        throw ExprError("internal error.");
-                    return new CallbackValueExpr(ptr);
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
+                    return new (c->arena) UserCallbackValueExpr(ptr);
                 } else {
                     if (ptr.ptr == NULL)
-                        throw ExprError("internal error.");
+                        return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
                     switch (ptr.sizeInBytes) {
-                        case 1: return new ByteValueExpr(ptr);
-                        case 2: return new WordValueExpr(ptr);
-                        case 3: return new U24ValueExpr(ptr);
-                        case 4: return new DwordValueExpr(ptr);
-                        default: throw ExprError("internal error.");
+                        case 1: return new (c->arena) ByteValueExpr(ptr);
+                        case 2: return new (c->arena) WordValueExpr(ptr);
+                        case 3: return new (c->arena) U24ValueExpr(ptr);
+                        case 4: return new (c->arena) DwordValueExpr(ptr);
+                        default: return fail(c, ExprError(EXPR_INTERNAL_ERROR, "internal error."));
                     }
                 }
-                return result;
             }
         }
 
         default:
-            throw ExprError("syntax error in expression.");
+            return fail(c, ExprError(EXPR_SYNTAX_ERROR, "syntax error in expression."));
     }
 }
 
@@ -755,241 +1163,188 @@ static Expr* primaryExpression(Context* c)
 static Expr* unaryExpression(Context* c)
 {
     #define NEXT primaryExpression
+    Expr* operand;
 
     switch (c->curToken->id) {
         case TOK_MINUS:
-            c->curToken = c->curToken->next;
-            return new NegateExpr(unaryExpression(c));
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            return new (c->arena) NegateExpr(operand);
 
         case TOK_EXCLAMATION:
-            c->curToken = c->curToken->next;
-            return new LogicNotExpr(unaryExpression(c));
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            return new (c->arena) LogicNotExpr(operand);
 
         case TOK_TILDE:
-            c->curToken = c->curToken->next;
-            return new NotExpr(unaryExpression(c));
+            if (!nextToken(c) || !(operand = unaryExpression(c)))
+                return NULL;
+            return new (c->arena) NotExpr(operand);
     }
 
     return NEXT(c);
     #undef NEXT
 }
 
-static Expr* multiplicativeExpression(Context* c)
+static Expr* binaryExpression(Context* c, int minPrecedence)
 {
-    #define NEXT unaryExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_ASTERISK || c->curToken->id == TOK_SLASH || c->curToken->id == TOK_PERCENT) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        switch (op) {
-            case TOK_ASTERISK: left = new MultiplyExpr(left, right); break;
-            case TOK_SLASH: left = new DivideExpr(left, right); break;
-            case TOK_PERCENT: left = new RemainderExpr(left, right); break;
+    Expr* left = unaryExpression(c);
+    if (!left)
+        return NULL;
+
+    for (;;) {
+        const BinaryOperator* op = &binaryOperators[c->curToken->id];
+        if (op->precedence < minPrecedence)
+            break;
+
+        Expr* right;
+        if (!nextToken(c) || !(right = binaryExpression(c, op->precedence + 1))) {
+            freeExpr(c, left);
+            return NULL;
         }
-    }
-
-    #undef NEXT
-    return left;
-}
 
-static Expr* additiveExpression(Context* c)
-{
-    #define NEXT multiplicativeExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_PLUS || c->curToken->id == TOK_MINUS) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        switch (op) {
-            case TOK_PLUS: left = new PlusExpr(left, right); break;
-            case TOK_MINUS: left = new MinusExpr(left, right); break;
-        }
+        left = op->create(c->arena, left, right);
     }
 
-    #undef NEXT
     return left;
 }
 
-static Expr* shiftExpression(Context* c)
+static Expr* expression(Context* c)
 {
-    #define NEXT additiveExpression
-    Expr* left = NEXT(c);
+    Expr* expr = binaryExpression(c, 1);
+    if (!expr)
+        return NULL;
 
-    while (c->curToken->id == TOK_SHL || c->curToken->id == TOK_SHR) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        switch (op) {
-            case TOK_SHL: left = new ShlExpr(left, right); break;
-            case TOK_SHR: left = new ShrExpr(left, right); break;
+    if (c->curToken->id == TOK_QUESTION) {
+        Expr* trueCase;
+        Expr* falseCase;
+        if (!nextToken(c) || !(trueCase = expression(c))) {
+            freeExpr(c, expr);
+            return NULL;
         }
-    }
-
-    #undef NEXT
-    return left;
-}
-
-static Expr* relationalExpression(Context* c)
-{
-    #define NEXT shiftExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_LESS || c->curToken->id == TOK_LESS_EQUAL
-            || c->curToken->id == TOK_GREATER || c->curToken->id == TOK_GREATER_EQUAL) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        switch (op) {
-            case TOK_LESS: left = new LessExpr(left, right); break;
-            case TOK_LESS_EQUAL: left = new LessEqualExpr(left, right); break;
-            case TOK_GREATER: left = new GreaterExpr(left, right); break;
-            case TOK_GREATER_EQUAL: left = new GreaterEqualExpr(left, right); break;
+        if (c->curToken->id != TOK_COLON) {
+            freeExpr(c, expr);
+            freeExpr(c, trueCase);
+            return fail(c, ExprError(EXPR_SYNTAX_ERROR, "missing ':'."));
         }
+        if (!nextToken(c) || !(falseCase = expression(c))) {
+            freeExpr(c, expr);
+            freeExpr(c, trueCase);
+            return NULL;
+        }
+        expr = new (c->arena) ConditionalExpr(expr, trueCase, falseCase);
     }
 
-    #undef NEXT
-    return left;
+    return expr;
 }
 
-static Expr* equalityExpression(Context* c)
-{
-    #define NEXT relationalExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_EQUAL || c->curToken->id == TOK_DOUBLE_EQUAL || c->curToken->id == TOK_NOT_EQUAL) {
-        int op = c->curToken->id;
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        switch (op) {
-            case TOK_DOUBLE_EQUAL:
-            case TOK_EQUAL: left = new EqualityExpr(left, right); break;
-            case TOK_NOT_EQUAL: left = new InequalityExpr(left, right); break;
-        }
-    }
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    #undef NEXT
-    return left;
+void* Expr::operator new(size_t size, ExprArena* arena)
+{
+    if (arena)
+        return arena->allocate(size);
+    return ::operator new(size);
 }
 
-static Expr* bitwiseAndExpression(Context* c)
+// Only called when a constructor throws; arena memory is reclaimed together with the arena
+void Expr::operator delete(void* ptr, ExprArena* arena)
 {
-    #define NEXT equalityExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_AMPERSAND) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        left = new AndExpr(left, right);
-    }
-
-    #undef NEXT
-    return left;
+    if (!arena)
+        ::operator delete(ptr);
 }
 
-static Expr* bitwiseXorExpression(Context* c)
+Expr* Expr::fold(Expr* expr, ExprArena* arena)
 {
-    #define NEXT bitwiseAndExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_CARET) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        left = new XorExpr(left, right);
-    }
-
-    #undef NEXT
-    return left;
+    return expr->foldConstants(arena);
 }
 
-static Expr* bitwiseOrExpression(Context* c)
+Expr* Expr::parse(const char* input, ExprResolver& resolver)
 {
-    #define NEXT bitwiseXorExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_VBAR) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        left = new OrExpr(left, right);
-    }
-
-    #undef NEXT
-    return left;
+    return parse(input, strlen(input), resolver);
 }
 
-static Expr* logicalAndExpression(Context* c)
+// Most expressions are a lone number or name; for those the leaf is built directly, without descending through
+// every precedence level
+static bool isTrivial(Context* c)
 {
-    #define NEXT bitwiseOrExpression
-    Expr* left = NEXT(c);
-
-    while (c->curToken->id == TOK_DOUBLE_AMPERSAND) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        left = new LogicAndExpr(left, right);
+    switch (c->curToken->id) {
+        case TOK_NUMBER:
+        case TOK_IDENT:
+        case TOK_DOLLAR:
+            return c->reader.next.id == TOK_END;
+        default:
+            return false;
     }
-
-    #undef NEXT
-    return left;
 }
 
-static Expr* logicalOrExpression(Context* c)
+static Expr* parseInput(Context* c, ExprResolver& resolver, ExprArena* arena)
 {
-    #define NEXT logicalAndExpression
-    Expr* left = NEXT(c);
+    c->curToken = &c->reader.cur;
+    c->resolver = &resolver;
+    c->arena = arena;
 
-    while (c->curToken->id == TOK_DOUBLE_VBAR) {
-        c->curToken = c->curToken->next;
-        Expr* right = NEXT(c);
-        left = new LogicOrExpr(left, right);
+    Expr* result;
+    if (isTrivial(c))
+        result = primaryExpression(c);
+    else
+        result = expression(c);
+    if (c->exception)
+        std::rethrow_exception(c->exception);
+    if (result && c->curToken->id != TOK_END) {
+        freeExpr(c, result);
+        return fail(c, ExprError(EXPR_SYNTAX_ERROR, "syntax error in expression."));
     }
 
-    #undef NEXT
-    return left;
+    return result;
 }
 
-static Expr* conditionalExpression(Context* c)
+static Expr* parseSource(const char* input, size_t length, ExprResolver& resolver, ExprSymbolPool* symbols,
+    ExprArena* arena, ExprError* error)
 {
-    #define NEXT logicalOrExpression
-    Expr* expr = NEXT(c);
-
-    if (c->curToken->id == TOK_QUESTION) {
-        c->curToken = c->curToken->next;
-        Expr* trueCase = expression(c);
-        if (c->curToken->id != TOK_COLON)
-            throw ExprError("missing ':'.");
-        c->curToken = c->curToken->next;
-        Expr* falseCase = expression(c);
-        expr = new ConditionalExpr(expr, trueCase, falseCase);
-    }
-
-    #undef NEXT
-    return expr;
+    Context c;
+    c.error = error;
+    if (!exprInitTokenReader(&c.reader, input, length, symbols, error))
+        return NULL;
+    return parseInput(&c, resolver, arena);
 }
 
-static Expr* expression(Context* c)
+Expr* Expr::parse(const char* input, size_t length, ExprResolver& resolver,
+    ExprSymbolPool* symbols, ExprArena* arena)
 {
-    #define NEXT conditionalExpression
-    return NEXT(c);
-    #undef NEXT
+    ExprError error;
+    Expr* result = parseSource(input, length, resolver, symbols, arena, &error);
+    if (!result)
+        throw error;
+    return result;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-Expr* Expr::parse(const char* input, ExprResolver& resolver)
+Expr* Expr::parse(const ExprTokenBatch* batch, size_t index, ExprResolver& resolver, ExprArena* arena)
 {
-    ExprTokenList list = exprLexer(input);
+    const ExprBatchEntry* entry = &batch->entries[index];
+    if (entry->lexerError)
+        return parse(batch->stream.input + entry->offset, entry->length, resolver, NULL, arena);
 
+    ExprError error;
     Context c;
-    c.curToken = list.first;
-    c.resolver = &resolver;
-    Expr* result = expression(&c);
+    c.error = &error;
+    exprInitTokenReader(&c.reader, batch, index);
+    Expr* result = parseInput(&c, resolver, arena);
+    if (!result)
+        throw error;
+    return result;
+}
 
-    if (c.curToken->id != TOK_END)
-        throw ExprError("syntax error in expression.");
+ParseResult Expr::tryParse(const char* input, ExprResolver& resolver)
+{
+    return tryParse(input, strlen(input), resolver);
+}
 
-    exprFreeTokens(&list);
+ParseResult Expr::tryParse(const char* input, size_t length, ExprResolver& resolver,
+    ExprSymbolPool* symbols, ExprArena* arena)
+{
+    ParseResult result;
+    result.expr = parseSource(input, length, resolver, symbols, arena, &result.error);
     return result;
 }
 
@@ -25,9 +25,15 @@ SOFTWARE.
 #include "parser/common.h"
 #include "parser/resolve_oop.h"
 
+struct ExprTokenBatch;
+class ExprSymbolPool;
+class ExprArena;
+
 namespace ParserOop
 {
 
+struct ParseResult;
+
 class Expr
 {
 public:
@@ -35,6 +41,36 @@ public:
     virtual ExprValue evaluate(ExprEvaluator& e) const = 0;
 
     static Expr* parse(const char* input, ExprResolver& resolver);
+    // When an arena is given, all nodes are allocated from it and the result must not be deleted
+    static Expr* parse(const char* input, size_t length, ExprResolver& resolver,
+        ExprSymbolPool* symbols = NULL, ExprArena* arena = NULL);
+    static Expr* parse(const ExprTokenBatch* batch, size_t index, ExprResolver& resolver, ExprArena* arena = NULL);
+
+    // Same as parse(), but reports errors through the result instead of throwing ExprError. Nothing is leaked
+    // on failure; exceptions thrown by the resolver are passed through.
+    static ParseResult tryParse(const char* input, ExprResolver& resolver);
+    static ParseResult tryParse(const char* input, size_t length, ExprResolver& resolver,
+        ExprSymbolPool* symbols = NULL, ExprArena* arena = NULL);
+
+    // Folds constant subtrees the same way as ParserLessOop::exprFold(). Returns the new root; the old one must not
+    // be used afterwards. Pass the arena the tree was parsed into, if any.
+    static Expr* fold(Expr* expr, ExprArena* arena = NULL);
+
+    // Used by the optimization passes
+    virtual bool isConstant(ExprValue* value) const { (void)value; return false; }
+    virtual bool canDiscard() const { return true; }    // calls no callbacks of any kind and cannot throw
+    virtual Expr* foldConstants(ExprArena* arena) { (void)arena; return this; }
+
+    static void* operator new(size_t size) { return ::operator new(size); }
+    static void* operator new(size_t size, ExprArena* arena);
+    static void operator delete(void* ptr) { ::operator delete(ptr); }
+    static void operator delete(void* ptr, ExprArena* arena);
+};
+
+struct ParseResult
+{
+    Expr* expr;         // NULL on failure
+    ExprError error;    // status() is EXPR_OK on success
 };
 
 } // namespace
@@ -0,0 +1,553 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/register_code.h"
+#include <algorithm>
+#include <string.h>
+#include <utility>
+
+namespace ParserLessOop
+{
+
+// An instruction is the ExprOp of the node it was compiled from. Binary operators with a constant right operand
+// have IMMEDIATE set and take it from imm instead of src2. &&, || and ?: become jumps.
+enum
+{
+    BC_JUMP = OP_BITXORN + 1,   // to imm
+    BC_JUMPIFZERO,              // to imm if src1 is 0
+    BC_ANDJUMP,                 // to imm if src1 is 0
+    BC_ORJUMP,                  // to imm, setting src1 to 1, if src1 is not 0
+    BC_TOBOOL,
+    BC_CHECKDIVISOR,            // throws if src1 is 0
+    BC_RETURN,                  // src1
+    IMMEDIATE = 0x100,
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Compiler
+
+// Operator that gives the same result with the operands exchanged, -1 if there is none
+static int swappedOp(int op)
+{
+    switch (op) {
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_EQUAL:
+        case OP_NOTEQUAL:
+        case OP_PLUS:
+        case OP_MULTIPLY:
+            return op;
+        case OP_LESS: return OP_GREATER;
+        case OP_LESSEQUAL: return OP_GREATEREQUAL;
+        case OP_GREATER: return OP_LESS;
+        case OP_GREATEREQUAL: return OP_LESSEQUAL;
+        default: return -1;
+    }
+}
+
+// Appends pointers to the slot fields the instruction reads, followed by the one it writes
+static void collectSlots(ExprRegisterCode::Instruction& insn, std::vector<uint32_t>& args,
+    std::vector<uint32_t*>& result)
+{
+    int sources;
+    bool hasDst = true;
+    switch (insn.op) {
+        case BC_JUMP: sources = 0; hasDst = false; break;
+        case BC_JUMPIFZERO:
+        case BC_ANDJUMP:
+        case BC_ORJUMP:
+        case BC_CHECKDIVISOR:
+        case BC_RETURN: sources = 1; hasDst = false; break;
+        case BC_TOBOOL: sources = 1; break;
+        default: sources = ((insn.op & IMMEDIATE) ? 1 : exprOperandCount((ExprOp)insn.op)); break;
+    }
+
+    if (insn.op < IMMEDIATE && exprHasArgs((ExprOp)insn.op)) {
+        for (uint32_t i = 0; i < insn.src2; i++)
+            result.push_back(&args[insn.src1 + i]);
+    }
+    if (sources > 0)
+        result.push_back(&insn.src1);
+    if (sources > 1)
+        result.push_back(&insn.src2);
+    if (sources > 2)
+        result.push_back(&insn.src3);
+    if (hasDst)
+        result.push_back(&insn.dst);
+}
+
+ExprRegisterCode::ExprRegisterCode()
+    : m_slotCount(0)
+    , m_valueCount(0)
+{
+}
+
+void ExprRegisterCode::compile(const Expr* expr)
+{
+    m_code.clear();
+    m_args.clear();
+    m_slotCount = 0;
+    m_valueCount = 0;
+
+    uint32_t result = newValue();
+    compileNode(expr, result);
+    emit(BC_RETURN, 0).src1 = result;
+    allocateSlots();
+}
+
+ExprRegisterCode::Instruction& ExprRegisterCode::emit(int op, uint32_t dst)
+{
+    Instruction insn;
+    memset(&insn, 0, sizeof(insn));
+    insn.op = op;
+    insn.dst = dst;
+    m_code.push_back(insn);
+    return m_code.back();
+}
+
+// Returns the position of the argument values in m_args
+uint32_t ExprRegisterCode::compileArgs(Expr* const* args, size_t count)
+{
+    std::vector<uint32_t> values(count);
+    for (size_t i = 0; i < count; i++) {
+        values[i] = newValue();
+        compileNode(args[i], values[i]);
+    }
+    uint32_t position = (uint32_t)m_args.size();
+    m_args.insert(m_args.end(), values.begin(), values.end());
+    return position;
+}
+
+void ExprRegisterCode::compileNode(const Expr* expr, uint32_t dst)
+{
+    switch (expr->op) {
+        case OP_NUMBER:
+            emit(OP_NUMBER, dst).imm = expr->number;
+            return;
+
+        case OP_CALLBACKVALUE:
+            emit(OP_CALLBACKVALUE, dst).readValue = expr->valuePtr.readValue;
+            return;
+
+        case OP_USERCALLBACKVALUE: {
+            Instruction& insn = emit(OP_USERCALLBACKVALUE, dst);
+            insn.readUserValue = expr->valuePtr.readUserValue;
+            insn.user = expr->valuePtr.user;
+            return;
+        }
+
+        case OP_BYTEVALUE:
+        case OP_WORDVALUE:
+        case OP_U24VALUE:
+        case OP_DWORDVALUE:
+            emit(expr->op, dst).ptr = expr->valuePtr.ptr;
+            return;
+
+        case OP_DOLLAR:
+            emit(OP_DOLLAR, dst);
+            return;
+
+        case OP_FUNC0:
+        case OP_FUNC1:
+        case OP_FUNC2:
+        case OP_FUNC3:
+        case OP_USERFUNC0:
+        case OP_USERFUNC1:
+        case OP_USERFUNC2:
+        case OP_USERFUNC3: {
+            int count = exprOperandCount(expr->op);
+            uint32_t src[3] = { 0, 0, 0 };
+            const Expr* operands[3] = { expr->op1, expr->op2, expr->op3 };
+            for (int i = 0; i < count; i++) {
+                src[i] = newValue();
+                compileNode(operands[i], src[i]);
+            }
+            Instruction& insn = emit(expr->op, dst);
+            insn.src1 = src[0];
+            insn.src2 = src[1];
+            insn.src3 = src[2];
+            insn.cb0 = expr->cb0;       // the whole callback union
+            insn.user = expr->user;
+            return;
+        }
+
+        case OP_FUNCN: {
+            uint32_t args = compileArgs(expr->args, expr->argCount);
+            Instruction& insn = emit(OP_FUNCN, dst);
+            insn.src1 = args;
+            insn.src2 = (uint32_t)expr->argCount;
+            insn.cbN = expr->cbN;
+            insn.user = expr->user;
+            return;
+        }
+
+        case OP_SUMN:
+        case OP_PRODUCTN:
+        case OP_BITANDN:
+        case OP_BITORN:
+        case OP_BITXORN: {
+            uint32_t args = compileArgs(expr->args, expr->argCount);
+            Instruction& insn = emit(expr->op, dst);
+            insn.src1 = args;
+            insn.src2 = (uint32_t)expr->argCount;
+            insn.imm = expr->number;
+            return;
+        }
+
+        case OP_COND: {
+            uint32_t condition = newValue();
+            compileNode(expr->op1, condition);
+            size_t toElse = m_code.size();
+            emit(BC_JUMPIFZERO, 0).src1 = condition;
+            compileNode(expr->op2, dst);
+            size_t toEnd = m_code.size();
+            emit(BC_JUMP, 0);
+            m_code[toElse].imm = (ExprValue)m_code.size();
+            compileNode(expr->op3, dst);
+            m_code[toEnd].imm = (ExprValue)m_code.size();
+            return;
+        }
+
+        case OP_LOGICAND:
+        case OP_LOGICOR: {
+            // The left value decides on its own if it is 0 for && or not 0 for ||; it is then the result
+            compileNode(expr->op1, dst);
+            size_t toEnd = m_code.size();
+            emit(expr->op == OP_LOGICAND ? BC_ANDJUMP : BC_ORJUMP, 0).src1 = dst;
+            uint32_t right = newValue();
+            compileNode(expr->op2, right);
+            emit(BC_TOBOOL, dst).src1 = right;
+            m_code[toEnd].imm = (ExprValue)m_code.size();
+            return;
+        }
+
+        case OP_MEMBYTE:
+        case OP_MEMWORD:
+        case OP_MEMDWORD:
+        case OP_LOGICNOT:
+        case OP_BITNOT:
+        case OP_NEGATE: {
+            uint32_t src = newValue();
+            compileNode(expr->op1, src);
+            emit(expr->op, dst).src1 = src;
+            return;
+        }
+
+        case OP_DIVPOW2:
+        case OP_REMPOW2:
+        case OP_DIVMAGIC:
+        case OP_REMMAGIC: {
+            uint32_t src = newValue();
+            compileNode(expr->op1, src);
+            Instruction& insn = emit(expr->op, dst);
+            insn.src1 = src;
+            insn.src2 = (uint32_t)expr->shift;
+            insn.imm = expr->number;
+            if (expr->op == OP_DIVMAGIC || expr->op == OP_REMMAGIC)
+                insn.magic = expr->magic;
+            return;
+        }
+
+        case OP_DIVIDE:
+        case OP_REMAINDER: {
+            uint32_t dividend = newValue();
+            if (expr->op2->op == OP_NUMBER && expr->op2->number != 0) {
+                compileNode(expr->op1, dividend);
+                Instruction& insn = emit(expr->op | IMMEDIATE, dst);
+                insn.src1 = dividend;
+                insn.imm = expr->op2->number;
+                return;
+            }
+            // The tree walker checks the divisor before it evaluates the dividend
+            uint32_t divisor = newValue();
+            compileNode(expr->op2, divisor);
+            emit(BC_CHECKDIVISOR, 0).src1 = divisor;
+            compileNode(expr->op1, dividend);
+            Instruction& insn = emit(expr->op, dst);
+            insn.src1 = dividend;
+            insn.src2 = divisor;
+            return;
+        }
+
+        case OP_BITOR:
+        case OP_BITAND:
+        case OP_BITXOR:
+        case OP_EQUAL:
+        case OP_NOTEQUAL:
+        case OP_LESS:
+        case OP_LESSEQUAL:
+        case OP_GREATER:
+        case OP_GREATEREQUAL:
+        case OP_SHL:
+        case OP_SHR:
+        case OP_PLUS:
+        case OP_MINUS:
+        case OP_MULTIPLY: {
+            int op = expr->op;
+            const Expr* left = expr->op1;
+            const Expr* right = expr->op2;
+            if (left->op == OP_NUMBER && right->op != OP_NUMBER && swappedOp(op) >= 0) {
+                op = swappedOp(op);
+                left = expr->op2;
+                right = expr->op1;
+            }
+
+            uint32_t src1 = newValue();
+            compileNode(left, src1);
+            if (right->op == OP_NUMBER) {
+                Instruction& insn = emit(op | IMMEDIATE, dst);
+                insn.src1 = src1;
+                insn.imm = right->number;
+                return;
+            }
+            uint32_t src2 = newValue();
+            compileNode(right, src2);
+            Instruction& insn = emit(op, dst);
+            insn.src1 = src1;
+            insn.src2 = src2;
+            return;
+        }
+    }
+
+    throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
+}
+
+// Every value lives from the first to the last instruction that mentions it. Jumps only go forward, so this covers
+// all paths through the conditional code in between. Values are visited in the order they start and get the first
+// free slot; a slot becomes free after the last read of its value, so an instruction may write the slot it reads.
+void ExprRegisterCode::allocateSlots()
+{
+    std::vector<size_t> first(m_valueCount, (size_t)-1);
+    std::vector<size_t> last(m_valueCount, 0);
+    std::vector<uint32_t*> slots;
+    for (size_t i = 0; i < m_code.size(); i++) {
+        slots.clear();
+        collectSlots(m_code[i], m_args, slots);
+        for (size_t j = 0; j < slots.size(); j++) {
+            uint32_t value = *slots[j];
+            first[value] = std::min(first[value], i);
+            last[value] = std::max(last[value], i);
+        }
+    }
+
+    std::vector<std::pair<size_t, uint32_t> > order(m_valueCount);
+    for (uint32_t value = 0; value < m_valueCount; value++)
+        order[value] = std::make_pair(first[value], value);
+    std::sort(order.begin(), order.end());
+
+    std::vector<uint32_t> slotOf(m_valueCount);
+    std::vector<std::pair<size_t, uint32_t> > active;  // last use and slot
+    std::vector<uint32_t> freeSlots;
+    for (size_t i = 0; i < order.size(); i++) {
+        size_t start = order[i].first;
+        uint32_t value = order[i].second;
+        if (start == (size_t)-1)
+            continue;   // never used
+
+        for (size_t j = 0; j < active.size(); ) {
+            if (active[j].first <= start) {
+                freeSlots.push_back(active[j].second);
+                active[j] = active.back();
+                active.pop_back();
+            } else
+                ++j;
+        }
+
+        uint32_t slot;
+        if (!freeSlots.empty()) {
+            slot = freeSlots.back();
+            freeSlots.pop_back();
+        } else
+            slot = (uint32_t)m_slotCount++;
+        slotOf[value] = slot;
+        active.push_back(std::make_pair(last[value], slot));
+    }
+
+    for (size_t i = 0; i < m_code.size(); i++) {
+        slots.clear();
+        collectSlots(m_code[i], m_args, slots);
+        for (size_t j = 0; j < slots.size(); j++)
+            *slots[j] = slotOf[*slots[j]];
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/// Interpreter
+
+#define BINARY(code, op) \
+    case code: regs[insn->dst] = regs[insn->src1] op regs[insn->src2]; break; \
+    case code | IMMEDIATE: regs[insn->dst] = regs[insn->src1] op insn->imm; break
+
+ExprValue ExprRegisterCode::evaluate(ExprEvaluator& eval) const
+{
+    enum { LOCAL_SLOT_COUNT = 32 };
+    if (m_slotCount <= LOCAL_SLOT_COUNT) {
+        ExprValue regs[LOCAL_SLOT_COUNT];
+        return run(regs, eval);
+    }
+    std::vector<ExprValue> regs(m_slotCount);
+    return run(&regs[0], eval);
+}
+
+// regs has at least m_slotCount values
+ExprValue ExprRegisterCode::run(ExprValue* regs, ExprEvaluator& eval) const
+{
+    const Instruction* code = &m_code[0];
+    const uint32_t* args = (m_args.empty() ? NULL : &m_args[0]);
+    const Instruction* insn = code;
+    for (;;) {
+        switch (insn->op) {
+            case OP_NUMBER: regs[insn->dst] = insn->imm; break;
+            case OP_CALLBACKVALUE: regs[insn->dst] = insn->readValue(); break;
+            case OP_USERCALLBACKVALUE: regs[insn->dst] = insn->readUserValue(insn->user); break;
+            case OP_BYTEVALUE: regs[insn->dst] = *(const uint8_t*)insn->ptr; break;
+            case OP_WORDVALUE: regs[insn->dst] = *(const uint16_t*)insn->ptr; break;
+            case OP_U24VALUE: regs[insn->dst] = *(const uint16_t*)insn->ptr | (*((const uint8_t*)insn->ptr + 2) << 16); break;
+            case OP_DWORDVALUE: regs[insn->dst] = *(const uint32_t*)insn->ptr; break;
+            case OP_DOLLAR: regs[insn->dst] = eval.pc(); break;
+            case OP_FUNC0: regs[insn->dst] = insn->cb0(); break;
+            case OP_FUNC1: regs[insn->dst] = insn->cb1(regs[insn->src1]); break;
+            case OP_FUNC2: regs[insn->dst] = insn->cb2(regs[insn->src1], regs[insn->src2]); break;
+            case OP_FUNC3: regs[insn->dst] = insn->cb3(regs[insn->src1], regs[insn->src2], regs[insn->src3]); break;
+            case OP_USERFUNC0: regs[insn->dst] = insn->ucb0(insn->user); break;
+            case OP_USERFUNC1: regs[insn->dst] = insn->ucb1(regs[insn->src1], insn->user); break;
+            case OP_USERFUNC2: regs[insn->dst] = insn->ucb2(regs[insn->src1], regs[insn->src2], insn->user); break;
+            case OP_USERFUNC3:
+                regs[insn->dst] = insn->ucb3(regs[insn->src1], regs[insn->src2], regs[insn->src3], insn->user);
+                break;
+            case OP_FUNCN: {
+                ExprValue values[EXPR_MAX_VARIADIC_ARGS];
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    values[i] = regs[args[insn->src1 + i]];
+                regs[insn->dst] = insn->cbN(values, insn->src2, insn->user);
+                break;
+            }
+            case OP_MEMBYTE: regs[insn->dst] = eval.memByte(regs[insn->src1]); break;
+            case OP_MEMWORD: regs[insn->dst] = eval.memWord(regs[insn->src1]); break;
+            case OP_MEMDWORD: regs[insn->dst] = eval.memDword(regs[insn->src1]); break;
+            case OP_LOGICNOT: regs[insn->dst] = !regs[insn->src1]; break;
+            case OP_BITNOT: regs[insn->dst] = ~regs[insn->src1]; break;
+            case OP_NEGATE: regs[insn->dst] = -regs[insn->src1]; break;
+            BINARY(OP_BITOR, |);
+            BINARY(OP_BITAND, &);
+            BINARY(OP_BITXOR, ^);
+            BINARY(OP_EQUAL, ==);
+            BINARY(OP_NOTEQUAL, !=);
+            BINARY(OP_LESS, <);
+            BINARY(OP_LESSEQUAL, <=);
+            BINARY(OP_GREATER, >);
+            BINARY(OP_GREATEREQUAL, >=);
+            case OP_SHL: regs[insn->dst] = (ExprValue)((ExprUValue)regs[insn->src1] << regs[insn->src2]); break;
+            case OP_SHL | IMMEDIATE: regs[insn->dst] = (ExprValue)((ExprUValue)regs[insn->src1] << insn->imm); break;
+            BINARY(OP_SHR, >>);
+            BINARY(OP_PLUS, +);
+            BINARY(OP_MINUS, -);
+            BINARY(OP_MULTIPLY, *);
+            BINARY(OP_DIVIDE, /);         // divisor was checked by BC_CHECKDIVISOR or is a non-zero constant
+            BINARY(OP_REMAINDER, %);
+            case OP_DIVPOW2: {
+                int v = regs[insn->src1];
+                regs[insn->dst] = (v + ((v >> 31) & (insn->imm - 1))) >> insn->src2;
+                break;
+            }
+            case OP_REMPOW2: {
+                int v = regs[insn->src1];
+                regs[insn->dst] = v - ((v + ((v >> 31) & (insn->imm - 1))) & -insn->imm);
+                break;
+            }
+            case OP_DIVMAGIC: {
+                int v = regs[insn->src1];
+                uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+                int q = (int)((a * insn->magic) >> insn->src2);
+                regs[insn->dst] = (v < 0 ? -q : q);
+                break;
+            }
+            case OP_REMMAGIC: {
+                int v = regs[insn->src1];
+                uint64_t a = (v < 0 ? 0 - (uint64_t)(int64_t)v : (uint64_t)v);
+                int r = (int)(a - ((a * insn->magic) >> insn->src2) * (uint64_t)insn->imm);
+                regs[insn->dst] = (v < 0 ? -r : r);
+                break;
+            }
+            case OP_SUMN: {
+                uint32_t sum = (uint32_t)insn->imm;
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    sum += (uint32_t)regs[args[insn->src1 + i]];
+                regs[insn->dst] = (ExprValue)sum;
+                break;
+            }
+            case OP_PRODUCTN: {
+                uint32_t product = (uint32_t)insn->imm;
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    product *= (uint32_t)regs[args[insn->src1 + i]];
+                regs[insn->dst] = (ExprValue)product;
+                break;
+            }
+            case OP_BITANDN: {
+                ExprValue value = insn->imm;
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    value &= regs[args[insn->src1 + i]];
+                regs[insn->dst] = value;
+                break;
+            }
+            case OP_BITORN: {
+                ExprValue value = insn->imm;
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    value |= regs[args[insn->src1 + i]];
+                regs[insn->dst] = value;
+                break;
+            }
+            case OP_BITXORN: {
+                ExprValue value = insn->imm;
+                for (uint32_t i = 0; i < insn->src2; i++)
+                    value ^= regs[args[insn->src1 + i]];
+                regs[insn->dst] = value;
+                break;
+            }
+            case BC_JUMP: insn = code + insn->imm; continue;
+            case BC_JUMPIFZERO:
+            case BC_ANDJUMP:
+                if (regs[insn->src1] == 0) {
+                    insn = code + insn->imm;
+                    continue;
+                }
+                break;
+            case BC_ORJUMP:
+                if (regs[insn->src1] != 0) {
+                    regs[insn->src1] = 1;
+                    insn = code + insn->imm;
+                    continue;
+                }
+                break;
+            case BC_TOBOOL: regs[insn->dst] = (regs[insn->src1] != 0); break;
+            case BC_CHECKDIVISOR:
+                if (regs[insn->src1] == 0)
+                    throw ExprError(EXPR_DIVISION_BY_ZERO, "division by zero.");
+                break;
+            case BC_RETURN: return regs[insn->src1];
+            default: throw ExprError(EXPR_INTERNAL_ERROR, "internal error.");
+        }
+        ++insn;
+    }
+}
+
+} // namespace
@@ -0,0 +1,95 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_REGISTER_CODE_H
+#define DRUNKFLY_PARSER_REGISTER_CODE_H
+
+#include "parser/parser_lessoop.h"
+#include <vector>
+
+namespace ParserLessOop
+{
+
+// Expression compiled into three-address instructions for a register machine: every instruction reads its
+// operands from numbered slots and writes its result into another one ("add r2, r0, r1"), and a constant right
+// operand is encoded in the instruction itself ("add r1, r0, #4"). This needs fewer dispatches than ExprBytecode,
+// which spends instructions on pushing operands. Slots are assigned by linear scan over the live ranges of the
+// intermediate values, so the register file stays small and is reused. Results are the same as those of
+// exprEvaluate() on the tree, but callbacks may be called in a different order, see ExprBytecode. evaluate() may
+// be called from several threads.
+class ExprRegisterCode
+{
+public:
+    ExprRegisterCode();
+
+    // Replaces the program; the tree is not referenced afterwards and may be freed
+    void compile(const Expr* expr);
+
+    // Must not be called before compile()
+    ExprValue evaluate(ExprEvaluator& eval) const;
+
+    size_t instructionCount() const { return m_code.size(); }
+    size_t slotCount() const { return m_slotCount; }
+
+    struct Instruction
+    {
+        int op;
+        uint32_t dst;
+        uint32_t src1;      // for OP_FUNCN and the n-ary ops: position of the first argument slot in m_args
+        uint32_t src2;      // for OP_FUNCN and the n-ary ops: number of arguments
+        uint32_t src3;
+        ExprValue imm;      // immediate operand, constant or jump target
+        union
+        {
+            const void* ptr;
+            ExprValue (*readValue)(void);
+            ExprValue (*readUserValue)(void* user);
+            ExprCallback0 cb0;
+            ExprCallback1 cb1;
+            ExprCallback2 cb2;
+            ExprCallback3 cb3;
+            ExprUserCallback0 ucb0;
+            ExprUserCallback1 ucb1;
+            ExprUserCallback2 ucb2;
+            ExprUserCallback3 ucb3;
+            ExprCallbackN cbN;
+            uint64_t magic;
+        };
+        void* user;
+    };
+
+private:
+    std::vector<Instruction> m_code;
+    std::vector<uint32_t> m_args;   // argument slots of OP_FUNCN and the n-ary ops
+    size_t m_slotCount;
+    uint32_t m_valueCount;          // while compiling; values are numbered until slots are assigned
+
+    Instruction& emit(int op, uint32_t dst);
+    uint32_t newValue() { return m_valueCount++; }
+    uint32_t compileArgs(Expr* const* args, size_t count);
+    void compileNode(const Expr* expr, uint32_t dst);
+    void allocateSlots();
+    ExprValue run(ExprValue* regs, ExprEvaluator& eval) const;
+};
+
+} // namespace
+
+#endif
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/resolve_oop.h"
+#include <string.h>
+
+static const char* nameToString(char* buf, const char* name, size_t length)
+{
+    if (length > EXPR_MAX_IDENT_LENGTH)
+        throw ExprError(EXPR_IDENTIFIER_TOO_LONG, "identifier too long.");
+    memcpy(buf, name, length);
+    buf[length] = 0;
+    return buf;
+}
+
+ExprCallback0 ExprResolver::resolveFunc0(const char* name, size_t nameLength)
+{
+    char buf[EXPR_MAX_IDENT_LENGTH + 1];
+    return resolveFunc0(nameToString(buf, name, nameLength));
+}
+
+ExprCallback1 ExprResolver::resolveFunc1(const char* name, size_t nameLength)
+{
+    char buf[EXPR_MAX_IDENT_LENGTH + 1];
+    return resolveFunc1(nameToString(buf, name, nameLength));
+}
+
+ExprCallback2 ExprResolver::resolveFunc2(const char* name, size_t nameLength)
+{
+    char buf[EXPR_MAX_IDENT_LENGTH + 1];
+    return resolveFunc2(nameToString(buf, name, nameLength));
+}
+
+ExprCallback3 ExprResolver::resolveFunc3(const char* name, size_t nameLength)
+{
+    char buf[EXPR_MAX_IDENT_LENGTH + 1];
+    return resolveFunc3(nameToString(buf, name, nameLength));
+}
+
+bool ExprResolver::resolveVariable(const char* name, size_t nameLength, ExprValuePtr& result)
+{
+    char buf[EXPR_MAX_IDENT_LENGTH + 1];
+    return resolveVariable(nameToString(buf, name, nameLength), result);
+}
+
+bool ExprResolver::resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+{
+    result.cb0 = resolveFunc0(symbol);
+    result.cb1 = resolveFunc1(symbol);
+    result.cb2 = resolveFunc2(symbol);
+    result.cb3 = resolveFunc3(symbol);
+    return result.cb0 || result.cb1 || result.cb2 || result.cb3;
+}
+
+void ExprResolver::resolveMany(const ExprNameRequest* names, size_t count, ExprNameResult* results)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (names[i].function)
+            results[i].found = resolveFunction(names[i].symbol, results[i].function);
+        else
+            results[i].found = resolveVariable(names[i].symbol, results[i].variable);
+    }
+}
@@ -24,15 +24,62 @@ SOFTWARE.
 
 #include "parser/common.h"
 
+// Name for ExprResolver::resolveMany()
+struct ExprNameRequest
+{
+    ExprSymbol symbol;
+    bool function;              // called as a function, otherwise used as a variable
+};
+
+struct ExprNameResult
+{
+    bool found;
+    ExprValuePtr variable;      // for variables
+    ExprFunction function;      // for functions
+};
+
+// Parsing calls the resolver only from the parsing thread; see compile_batch.h for the contract when several
+// expressions are compiled in parallel.
 class ExprResolver
 {
 public:
     virtual ~ExprResolver() {}
+
+    // Must change whenever any name starts to resolve differently; ExprCache does not reuse expressions
+    // compiled under another generation.
+    virtual uint32_t generation() const { return 0; }
+
     virtual ExprCallback0 resolveFunc0(const char* name) { (void)name; return NULL; }
     virtual ExprCallback1 resolveFunc1(const char* name) { (void)name; return NULL; }
     virtual ExprCallback2 resolveFunc2(const char* name) { (void)name; return NULL; }
     virtual ExprCallback3 resolveFunc3(const char* name) { (void)name; return NULL; }
     virtual bool resolveVariable(const char* name, ExprValuePtr& result) { (void)name; (void)result; return false; }
+
+    // Name points into the parser input and is NOT NUL-terminated; default implementations copy it into
+    // a temporary buffer and forward to the methods above.
+    virtual ExprCallback0 resolveFunc0(const char* name, size_t nameLength);
+    virtual ExprCallback1 resolveFunc1(const char* name, size_t nameLength);
+    virtual ExprCallback2 resolveFunc2(const char* name, size_t nameLength);
+    virtual ExprCallback3 resolveFunc3(const char* name, size_t nameLength);
+    virtual bool resolveVariable(const char* name, size_t nameLength, ExprValuePtr& result);
+
+    // Parsers call these. Symbol ID is only set when parsing with an ExprSymbolPool, hash is always valid.
+    // Default implementations forward to the methods above.
+    virtual ExprCallback0 resolveFunc0(const ExprSymbol& symbol) { return resolveFunc0(symbol.name, symbol.length); }
+    virtual ExprCallback1 resolveFunc1(const ExprSymbol& symbol) { return resolveFunc1(symbol.name, symbol.length); }
+    virtual ExprCallback2 resolveFunc2(const ExprSymbol& symbol) { return resolveFunc2(symbol.name, symbol.length); }
+    virtual ExprCallback3 resolveFunc3(const ExprSymbol& symbol) { return resolveFunc3(symbol.name, symbol.length); }
+    virtual bool resolveVariable(const ExprSymbol& symbol, ExprValuePtr& result)
+        { return resolveVariable(symbol.name, symbol.length, result); }
+
+    // Parsers call this once per function call, with result cleared, so only available arities need to be set.
+    // Returns false for unknown functions. Default implementation asks resolveFunc0() ... resolveFunc3() in turn;
+    // override it to look the name up only once.
+    virtual bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result);
+
+    // Two-phase compilation (see compileResolved()) asks for all names at once; results are cleared beforehand.
+    // Default implementation calls resolveFunction() or resolveVariable() for each name.
+    virtual void resolveMany(const ExprNameRequest* names, size_t count, ExprNameResult* results);
 };
 
 class ExprEvaluator
@@ -0,0 +1,140 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/symbol_pool.h"
+#include <string.h>
+
+ExprSymbolPool::ExprSymbolPool()
+    : m_entries(NULL)
+    , m_count(0)
+    , m_capacity(0)
+    , m_text(NULL)
+    , m_textSize(0)
+    , m_textCapacity(0)
+    , m_table(NULL)
+    , m_tableSize(0)
+{
+}
+
+ExprSymbolPool::~ExprSymbolPool()
+{
+    delete[] m_entries;
+    delete[] m_text;
+    delete[] m_table;
+}
+
+uint32_t ExprSymbolPool::intern(const char* name, size_t length)
+{
+    return intern(name, length, exprHashName(name, length));
+}
+
+uint32_t ExprSymbolPool::intern(const char* name, size_t length, uint32_t hash)
+{
+    // Keep load factor below 1/2
+    if ((m_count + 1) * 2 > m_tableSize)
+        rehash(m_tableSize > 0 ? m_tableSize * 2 : 256);
+
+    size_t mask = m_tableSize - 1;
+    size_t slot = hash & mask;
+    while (m_table[slot] != 0) {
+        const Entry* entry = &m_entries[m_table[slot] - 1];
+        if (entry->hash == hash && entry->length == length && !memcmp(m_text + entry->offset, name, length))
+            return m_table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    if (m_count == m_capacity) {
+        size_t capacity = (m_capacity > 0 ? m_capacity * 2 : 128);
+        Entry* entries = new Entry[capacity];
+        if (m_count > 0)
+            memcpy(entries, m_entries, m_count * sizeof(Entry));
+        delete[] m_entries;
+        m_entries = entries;
+        m_capacity = capacity;
+    }
+
+    if (m_textSize + length > m_textCapacity) {
+        size_t capacity = (m_textCapacity > 0 ? m_textCapacity * 2 : 4096);
+        while (capacity < m_textSize + length)
+            capacity *= 2;
+        char* text = new char[capacity];
+        if (m_textSize > 0)
+            memcpy(text, m_text, m_textSize);
+        delete[] m_text;
+        m_text = text;
+        m_textCapacity = capacity;
+    }
+
+    uint32_t id = (uint32_t)m_count++;
+    Entry* entry = &m_entries[id];
+    entry->offset = m_textSize;
+    entry->length = length;
+    entry->hash = hash;
+    memcpy(m_text + m_textSize, name, length);
+    m_textSize += length;
+
+    m_table[slot] = id + 1;
+    return id;
+}
+
+uint32_t ExprSymbolPool::find(const char* name, size_t length, uint32_t hash) const
+{
+    if (m_count == 0)
+        return EXPR_NO_SYMBOL;
+
+    size_t mask = m_tableSize - 1;
+    size_t slot = hash & mask;
+    while (m_table[slot] != 0) {
+        const Entry* entry = &m_entries[m_table[slot] - 1];
+        if (entry->hash == hash && entry->length == length && !memcmp(m_text + entry->offset, name, length))
+            return m_table[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    return EXPR_NO_SYMBOL;
+}
+
+ExprSymbol ExprSymbolPool::symbol(uint32_t id) const
+{
+    const Entry* entry = &m_entries[id];
+    ExprSymbol symbol;
+    symbol.name = m_text + entry->offset;
+    symbol.length = entry->length;
+    symbol.id = id;
+    symbol.hash = entry->hash;
+    return symbol;
+}
+
+void ExprSymbolPool::rehash(size_t tableSize)
+{
+    delete[] m_table;
+    m_table = new uint32_t[tableSize];
+    m_tableSize = tableSize;
+    memset(m_table, 0, tableSize * sizeof(uint32_t));
+
+    size_t mask = tableSize - 1;
+    for (size_t i = 0; i < m_count; i++) {
+        size_t slot = m_entries[i].hash & mask;
+        while (m_table[slot] != 0)
+            slot = (slot + 1) & mask;
+        m_table[slot] = (uint32_t)(i + 1);
+    }
+}
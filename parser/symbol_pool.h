@@ -0,0 +1,70 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_SYMBOL_POOL_H
+#define DRUNKFLY_PARSER_SYMBOL_POOL_H
+
+#include "parser/common.h"
+
+// Assigns a stable ID to every distinct identifier seen by the lexer. Intended to live for a whole session
+// (e.g. loading of a project) and be shared by all expressions lexed in it. Not thread safe.
+class ExprSymbolPool
+{
+public:
+    ExprSymbolPool();
+    ~ExprSymbolPool();
+
+    size_t count() const { return m_count; }
+
+    uint32_t intern(const char* name, size_t length);
+    uint32_t intern(const char* name, size_t length, uint32_t hash);
+
+    // Returns EXPR_NO_SYMBOL if the name was never interned. Safe to call from many threads as long as nothing
+    // is interned at the same time.
+    uint32_t find(const char* name, size_t length, uint32_t hash) const;
+
+    // Returned name points into the pool and is only valid until the next call to intern()
+    ExprSymbol symbol(uint32_t id) const;
+
+private:
+    struct Entry
+    {
+        size_t offset;
+        size_t length;
+        uint32_t hash;
+    };
+
+    Entry* m_entries;
+    size_t m_count;
+    size_t m_capacity;
+    char* m_text;
+    size_t m_textSize;
+    size_t m_textCapacity;
+    uint32_t* m_table;      // ID + 1, or 0 if slot is empty
+    size_t m_tableSize;
+
+    void rehash(size_t tableSize);
+
+    ExprSymbolPool(const ExprSymbolPool&);
+    ExprSymbolPool& operator=(const ExprSymbolPool&);
+};
+
+#endif
@@ -0,0 +1,167 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include "parser/worker_pool.h"
+
+ExprWorkerPool::ExprWorkerPool(size_t threadCount)
+    : m_task(NULL)
+    , m_context(NULL)
+    , m_job(0)
+    , m_busy(0)
+    , m_failed(false)
+    , m_quit(false)
+{
+    if (threadCount == 0)
+        threadCount = std::thread::hardware_concurrency();
+    if (threadCount == 0)
+        threadCount = 1;
+
+    m_threadCount = threadCount;
+    m_ranges = new Range[threadCount];
+    for (size_t i = 0; i < threadCount; i++) {
+        m_ranges[i].begin = 0;
+        m_ranges[i].end = 0;
+    }
+
+    m_threads.reserve(threadCount - 1);
+    for (size_t i = 1; i < threadCount; i++)
+        m_threads.push_back(std::thread(&ExprWorkerPool::threadMain, this, i));
+}
+
+ExprWorkerPool::~ExprWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_start.notify_all();
+
+    for (size_t i = 0; i < m_threads.size(); i++)
+        m_threads[i].join();
+
+    delete[] m_ranges;
+}
+
+void ExprWorkerPool::run(size_t count, Task task, void* context)
+{
+    if (count == 0)
+        return;
+
+    for (size_t i = 0; i < m_threadCount; i++) {
+        std::lock_guard<std::mutex> lock(m_ranges[i].mutex);
+        m_ranges[i].begin = count * i / m_threadCount;
+        m_ranges[i].end = count * (i + 1) / m_threadCount;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_task = task;
+        m_context = context;
+        m_exception = std::exception_ptr();
+        m_failed = false;
+        m_busy = m_threadCount;
+        ++m_job;
+    }
+    m_start.notify_all();
+
+    work(0);
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_done.wait(lock, [this] { return m_busy == 0; });
+
+    std::exception_ptr exception = m_exception;
+    m_exception = std::exception_ptr();
+    lock.unlock();
+
+    if (exception)
+        std::rethrow_exception(exception);
+}
+
+void ExprWorkerPool::threadMain(size_t worker)
+{
+    uint64_t job = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_start.wait(lock, [this, job] { return m_quit || m_job != job; });
+            if (m_quit)
+                return;
+            job = m_job;
+        }
+
+        work(worker);
+    }
+}
+
+void ExprWorkerPool::work(size_t worker)
+{
+    size_t index;
+    while (next(worker, &index)) {
+        try {
+            m_task(m_context, worker, index);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_failed.exchange(true))
+                m_exception = std::current_exception();
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (--m_busy == 0)
+        m_done.notify_one();
+}
+
+bool ExprWorkerPool::next(size_t worker, size_t* index)
+{
+    if (m_failed.load(std::memory_order_relaxed))
+        return false;
+
+    Range& own = m_ranges[worker];
+    {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (own.begin < own.end) {
+            *index = own.begin++;
+            return true;
+        }
+    }
+
+    // Own range is empty: steal the back half of the first non-empty range found
+    for (size_t i = 1; i < m_threadCount; i++) {
+        Range& victim = m_ranges[(worker + i) % m_threadCount];
+        size_t begin, end;
+        {
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.begin >= victim.end)
+                continue;
+            end = victim.end;
+            begin = victim.end - (victim.end - victim.begin + 1) / 2;
+            victim.end = begin;
+        }
+
+        std::lock_guard<std::mutex> lock(own.mutex);
+        *index = begin;
+        own.begin = begin + 1;
+        own.end = end;
+        return true;
+    }
+
+    return false;
+}
@@ -0,0 +1,83 @@
+/*
+Copyright (c) 2023 Drunk Fly
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifndef DRUNKFLY_PARSER_WORKER_POOL_H
+#define DRUNKFLY_PARSER_WORKER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads that run index-based jobs. Each worker starts with an equal contiguous range of indices
+// and takes them from the front; a worker that runs out steals the back half of another worker's range. The
+// thread calling run() takes part as worker 0, so a pool of one thread runs everything on the caller.
+class ExprWorkerPool
+{
+public:
+    typedef void (*Task)(void* context, size_t worker, size_t index);
+
+    // Zero means one thread per hardware thread
+    explicit ExprWorkerPool(size_t threadCount = 0);
+    ~ExprWorkerPool();
+
+    size_t threadCount() const { return m_threadCount; }
+
+    // Calls task once for every index in [0, count) and waits for all calls to complete. If any call throws,
+    // remaining indices are skipped and the first exception is rethrown here. Not reentrant.
+    void run(size_t count, Task task, void* context);
+
+private:
+    struct Range
+    {
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+        char padding[64];   // keep ranges of different workers on different cache lines
+    };
+
+    Range* m_ranges;
+    size_t m_threadCount;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_start;
+    std::condition_variable m_done;
+    Task m_task;
+    void* m_context;
+    std::exception_ptr m_exception;
+    uint64_t m_job;
+    size_t m_busy;
+    std::atomic<bool> m_failed;
+    bool m_quit;
+
+    void threadMain(size_t worker);
+    void work(size_t worker);
+    bool next(size_t worker, size_t* index);
+
+    ExprWorkerPool(const ExprWorkerPool&);
+    ExprWorkerPool& operator=(const ExprWorkerPool&);
+};
+
+#endif
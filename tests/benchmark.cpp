@@ -23,14 +23,17 @@ SOFTWARE.
 #include "tests/tinyexpr/tinyexpr.h"
 #include "parser/parser_oop.h"
 #include "parser/parser_lessoop.h"
+#include "parser/bytecode.h"
+#include "parser/register_code.h"
+#include "parser/lexer.h"
+#include "parser/expr_cache.h"
+#include "parser/compile_batch.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
-#ifndef _WIN32
-#error "Sorry, benchmark only supports Win32!"
-#endif
-
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN 1
 #include <windows.h>
 
@@ -42,6 +45,16 @@ static double getTime()
     QueryPerformanceCounter(&counter);
     return (double)((long double)counter.QuadPart / (long double)freq.QuadPart);
 }
+#else
+#include <time.h>
+
+static double getTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+#endif
 
 static ParserOop::Expr* oopCompile(const char* input)
 {
@@ -77,6 +90,10 @@ static void benchmark(const char* input)
 
     ParserOop::Expr* oopExpr = oopCompile(input);
     ParserLessOop::Expr* lessOopExpr = lessOopCompile(input);
+    ParserLessOop::ExprBytecode bytecode;
+    bytecode.compile(lessOopExpr);
+    ParserLessOop::ExprRegisterCode registerCode;
+    registerCode.compile(lessOopExpr);
     int err;
     te_expr* tinyExpr = te_compile(input, vars, 1, &err);
 
@@ -104,6 +121,30 @@ static void benchmark(const char* input)
         ParserLessOop::exprEvaluate(lessOopExpr, e);
     double lessOopEnd = getTime();
 
+    // ParserLessOop bytecode
+
+    // Heat up caches, etc.
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        bytecode.evaluate(e);
+
+    // Measure
+    double bytecodeStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        bytecode.evaluate(e);
+    double bytecodeEnd = getTime();
+
+    // ParserLessOop register code
+
+    // Heat up caches, etc.
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        registerCode.evaluate(e);
+
+    // Measure
+    double registerStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        registerCode.evaluate(e);
+    double registerEnd = getTime();
+
     // TinyExpr
 
     // Heat up caches, etc.
@@ -118,18 +159,190 @@ static void benchmark(const char* input)
 
     // Print results and cleanup
 
-    printf("\"%s\": oop %.3f seconds, lessoop: %.3f seconds, tinyexpr: %.3f seconds.\n",
-        input, oopEnd - oopStart, lessOopEnd - lessOopStart, tinyEnd - tinyStart);
+    printf("\"%s\": oop %.3f seconds, lessoop: %.3f seconds, bytecode (%lu instructions): %.3f seconds, "
+        "registers (%lu instructions, %lu slots): %.3f seconds, tinyexpr: %.3f seconds.\n",
+        input, oopEnd - oopStart, lessOopEnd - lessOopStart,
+        (unsigned long)bytecode.instructionCount(), bytecodeEnd - bytecodeStart,
+        (unsigned long)registerCode.instructionCount(), (unsigned long)registerCode.slotCount(),
+        registerEnd - registerStart, tinyEnd - tinyStart);
 
     delete oopExpr;
     ParserLessOop::exprFree(lessOopExpr);
     te_free(tinyExpr);
 }
 
+static void benchmarkLexer(const char* input)
+{
+    const size_t ITER_COUNT = 1000000;
+    size_t length = strlen(input);
+
+    ExprTokenStream stream;
+    exprInitTokenStream(&stream);
+
+    // Heat up caches, etc.
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        exprLexerStream(&stream, input, length);
+
+    // Measure
+    double start = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        exprLexerStream(&stream, input, length);
+    double end = getTime();
+
+    printf("lexer \"%s\": %.3f seconds, %.1f MB/s.\n",
+        input, end - start, (double)length * ITER_COUNT / (end - start) / (1024.0 * 1024.0));
+
+    exprFreeTokenStream(&stream);
+}
+
+// Parses every prefix of the input, as an editor does while the user is typing; most of them are invalid
+static void benchmarkTyping(const char* input)
+{
+    const size_t ITER_COUNT = 100000;
+    size_t length = strlen(input);
+    size_t errors = 0;
+    MyResolver r;
+
+    // ParserOop
+
+    double oopStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++) {
+        for (size_t n = 1; n <= length; n++) {
+            ParserOop::ParseResult result = ParserOop::Expr::tryParse(input, n, r);
+            if (!result.expr)
+                ++errors;
+            delete result.expr;
+        }
+    }
+    double oopEnd = getTime();
+
+    // ParserLessOop
+
+    double lessOopStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++) {
+        for (size_t n = 1; n <= length; n++) {
+            ParserLessOop::ExprParseResult result = ParserLessOop::exprTryParse(input, n, r);
+            if (!result.expr)
+                ++errors;
+            ParserLessOop::exprFree(result.expr);
+        }
+    }
+    double lessOopEnd = getTime();
+
+    printf("typing \"%s\": oop %.3f seconds, lessoop: %.3f seconds, %.0f%% invalid.\n",
+        input, oopEnd - oopStart, lessOopEnd - lessOopStart, 100.0 * errors / (2.0 * ITER_COUNT * length));
+}
+
+static void benchmarkCache(const char* input)
+{
+    const size_t ITER_COUNT = 1000000;
+    MyResolver r;
+
+    double parseStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        ParserLessOop::exprFree(ParserLessOop::exprParse(input, r));
+    double parseEnd = getTime();
+
+    ParserLessOop::ExprCache cache;
+    double cacheStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        cache.compile(input, r);
+    double cacheEnd = getTime();
+
+    printf("compile \"%s\": parse %.3f seconds, cache: %.3f seconds (%lu hits).\n",
+        input, parseEnd - parseStart, cacheEnd - cacheStart, (unsigned long)cache.hits());
+}
+
+// Most expressions in a program are a single number or label
+static void benchmarkTrivial(const char* input)
+{
+    const size_t ITER_COUNT = 10000000;
+    size_t length = strlen(input);
+    MyResolver r;
+
+    double oopStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        delete ParserOop::Expr::parse(input, length, r);
+    double oopEnd = getTime();
+
+    double lessOopStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++)
+        ParserLessOop::exprFree(ParserLessOop::exprParse(input, length, r));
+    double lessOopEnd = getTime();
+
+    printf("trivial \"%s\": oop %.3f seconds, lessoop: %.3f seconds.\n",
+        input, oopEnd - oopStart, lessOopEnd - lessOopStart);
+}
+
+// Compiles the same set of expressions serially and on pools of increasing size
+static void benchmarkCompileBatch(const char* input)
+{
+    const size_t COUNT = 100000;
+    const size_t ITER_COUNT = 10;
+    MyResolver r;
+
+    std::vector<const char*> inputs(COUNT, input);
+    std::vector<ParserLessOop::ExprParseResult> results(COUNT);
+
+    double serialStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++) {
+        for (size_t j = 0; j < COUNT; j++)
+            ParserLessOop::exprFree(ParserLessOop::exprParse(inputs[j], r));
+    }
+    double serialEnd = getTime();
+    printf("batch \"%s\": serial %.3f seconds", input, serialEnd - serialStart);
+
+    double resolvedStart = getTime();
+    for (size_t i = 0; i < ITER_COUNT; i++) {
+        ParserLessOop::compileResolved(&inputs[0], COUNT, r, &results[0]);
+        for (size_t j = 0; j < COUNT; j++)
+            ParserLessOop::exprFree(results[j].expr);
+    }
+    double resolvedEnd = getTime();
+    printf(", two-phase %.3f seconds", resolvedEnd - resolvedStart);
+
+    size_t maxThreads = std::thread::hardware_concurrency();
+    for (size_t threads = 1; ; threads *= 2) {
+        if (threads > maxThreads)
+            threads = maxThreads;
+
+        ExprWorkerPool pool(threads);
+        double start = getTime();
+        for (size_t i = 0; i < ITER_COUNT; i++) {
+            ParserLessOop::compileBatch(&inputs[0], COUNT, r, pool, &results[0]);
+            for (size_t j = 0; j < COUNT; j++)
+                ParserLessOop::exprFree(results[j].expr);
+        }
+        double end = getTime();
+        printf(", %lu threads %.3f seconds", (unsigned long)threads, end - start);
+
+        if (threads >= maxThreads)
+            break;
+    }
+    printf(".\n");
+}
+
 int main()
 {
+  #ifdef _WIN32
     QueryPerformanceFrequency(&freq);
     SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+  #endif
+
+    benchmarkLexer("4 + (var_32 / 4 - (32 + var_32)) * 19 - var_32");
+    benchmarkLexer("very.long.module.label_name + other.long.label - very.long.module.label_name_2");
+    benchmarkLexer("w@[very.long.module.label_name + 0x1234]         &&         other.long.label     !=     0xff00");
+
+    benchmarkTyping("fn2(var_32, 4) + (var_32 / 4 - (32 + var_32)) * 19");
+
+    benchmarkCache("4 + (var_32 / 4 - (32 + var_32)) * 19 - var_32");
+
+    benchmarkTrivial("$1234");
+    benchmarkTrivial("0b1010");
+    benchmarkTrivial("var_32");
+    benchmarkTrivial("  $");
+
+    benchmarkCompileBatch("4 + (var_32 / 4 - (32 + var_32)) * 19 - var_32");
 
     benchmark("4");
     //benchmark("4 + fn1(8) * 19 - var_32");
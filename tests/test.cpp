@@ -22,15 +22,28 @@ SOFTWARE.
 #include "tests/common.h"
 #include "parser/parser_oop.h"
 #include "parser/parser_lessoop.h"
+#include "parser/lexer.h"
+#include "parser/symbol_pool.h"
+#include "parser/arena.h"
+#include "parser/expr_cache.h"
+#include "parser/hash_cons.h"
+#include "parser/bytecode.h"
+#include "parser/compile_batch.h"
+#include "parser/incremental.h"
+#include "parser/optimize.h"
+#include "parser/register_code.h"
 #include <stdio.h>
 #include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
 
 static bool printPassed = true;
 static int total;
 static int passed;
 static int failed;
 
-static void check(const char* input, ExprValue expected)
+static void checkN(const char* input, size_t length, ExprValue expected, const ExprTokenBatch* batch = NULL, size_t index = 0)
 {
     int result;
     bool success;
@@ -41,23 +54,23 @@ static void check(const char* input, ExprValue expected)
 
     try {
         MyResolver r;
-        ParserOop::Expr* expr = ParserOop::Expr::parse(input, r);
+        ParserOop::Expr* expr = (batch ? ParserOop::Expr::parse(batch, index, r) : ParserOop::Expr::parse(input, length, r));
         MyEvaluator e;
         result = expr->evaluate(e);
         success = true;
     } catch (const ExprError& e) {
-        printf("[ FAIL ] ParserOop: \"%s\" unexpected error: %s\n", input, e.message());
+        printf("[ FAIL ] ParserOop: \"%.*s\" unexpected error: %s\n", (int)length, input, e.message());
         ++failed;
         success = false;
     }
 
     if (success) {
         if (result != expected) {
-            printf("[ FAIL ] ParserOop: \"%s\" => result %ld != expected %ld\n", input, (long)result, (long)expected);
+            printf("[ FAIL ] ParserOop: \"%.*s\" => result %ld != expected %ld\n", (int)length, input, (long)result, (long)expected);
             ++failed;
         } else {
             if (printPassed)
-                printf("[PASSED] ParserOop: \"%s\" => %ld\n", input, (long)result);
+                printf("[PASSED] ParserOop: \"%.*s\" => %ld\n", (int)length, input, (long)result);
             ++passed;
         }
     }
@@ -68,29 +81,29 @@ static void check(const char* input, ExprValue expected)
 
     try {
         MyResolver r;
-        ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+        ParserLessOop::Expr* expr = (batch ? ParserLessOop::exprParse(batch, index, r) : ParserLessOop::exprParse(input, length, r));
         MyEvaluator e;
         result = ParserLessOop::exprEvaluate(expr, e);
         success = true;
     } catch (const ExprError& e) {
-        printf("[ FAIL ] ParserLessOop: \"%s\" unexpected error: %s\n", input, e.message());
+        printf("[ FAIL ] ParserLessOop: \"%.*s\" unexpected error: %s\n", (int)length, input, e.message());
         ++failed;
         success = false;
     }
 
     if (success) {
         if (result != expected) {
-            printf("[ FAIL ] ParserLessOop: \"%s\" => result %ld != expected %ld\n", input, (long)result, (long)expected);
+            printf("[ FAIL ] ParserLessOop: \"%.*s\" => result %ld != expected %ld\n", (int)length, input, (long)result, (long)expected);
             ++failed;
         } else {
             if (printPassed)
-                printf("[PASSED] ParserLessOop: \"%s\" => %ld\n", input, (long)result);
+                printf("[PASSED] ParserLessOop: \"%.*s\" => %ld\n", (int)length, input, (long)result);
             ++passed;
         }
     }
 }
 
-static void checkError(const char* input, const char* message)
+static void checkErrorN(const char* input, size_t length, const char* message, const ExprTokenBatch* batch = NULL, size_t index = 0)
 {
     int result;
     bool success;
@@ -101,24 +114,24 @@ static void checkError(const char* input, const char* message)
 
     try {
         MyResolver r;
-        ParserOop::Expr* expr = ParserOop::Expr::parse(input, r);
+        ParserOop::Expr* expr = (batch ? ParserOop::Expr::parse(batch, index, r) : ParserOop::Expr::parse(input, length, r));
         MyEvaluator e;
         result = expr->evaluate(e);
         success = true;
     } catch (const ExprError& e) {
         if (!strcmp(e.message(), message)) {
             if (printPassed)
-                printf("[PASSED] [ParserOop] \"%s\" => error %s\n", input, e.message());
+                printf("[PASSED] [ParserOop] \"%.*s\" => error %s\n", (int)length, input, e.message());
             ++passed;
         } else {
-            printf("[ FAIL ] [ParserOop] \"%s\" unexpected error: %s (was expecting: %s)\n", input, e.message(), message);
+            printf("[ FAIL ] [ParserOop] \"%.*s\" unexpected error: %s (was expecting: %s)\n", (int)length, input, e.message(), message);
             ++failed;
         }
         success = false;
     }
 
     if (success) {
-        printf("[ FAIL ] [ParserOop] \"%s\" => unexpected success (was expecting: %s)\n", input, message);
+        printf("[ FAIL ] [ParserOop] \"%.*s\" => unexpected success (was expecting: %s)\n", (int)length, input, message);
         ++failed;
     }
 
@@ -128,28 +141,1243 @@ static void checkError(const char* input, const char* message)
 
     try {
         MyResolver r;
-        ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+        ParserLessOop::Expr* expr = (batch ? ParserLessOop::exprParse(batch, index, r) : ParserLessOop::exprParse(input, length, r));
         MyEvaluator e;
         result = ParserLessOop::exprEvaluate(expr, e);
         success = true;
     } catch (const ExprError& e) {
         if (!strcmp(e.message(), message)) {
             if (printPassed)
-                printf("[PASSED] [ParserLessOop] \"%s\" => error %s\n", input, e.message());
+                printf("[PASSED] [ParserLessOop] \"%.*s\" => error %s\n", (int)length, input, e.message());
             ++passed;
         } else {
-            printf("[ FAIL ] [ParserLessOop] \"%s\" unexpected error: %s (was expecting: %s)\n", input, e.message(), message);
+            printf("[ FAIL ] [ParserLessOop] \"%.*s\" unexpected error: %s (was expecting: %s)\n", (int)length, input, e.message(), message);
             ++failed;
         }
         success = false;
     }
 
     if (success) {
-        printf("[ FAIL ] [ParserLessOop] \"%s\" => unexpected success (was expecting: %s)\n", input, message);
+        printf("[ FAIL ] [ParserLessOop] \"%.*s\" => unexpected success (was expecting: %s)\n", (int)length, input, message);
+        ++failed;
+    }
+}
+
+static void check(const char* input, ExprValue expected)
+{
+    checkN(input, strlen(input), expected);
+}
+
+static void checkError(const char* input, const char* message)
+{
+    checkErrorN(input, strlen(input), message);
+}
+
+static void checkBatch(const char* input, char separator, size_t index, ExprValue expected)
+{
+    ExprTokenBatch batch;
+    exprInitTokenBatch(&batch);
+    exprLexerBatch(&batch, input, strlen(input), separator);
+    const ExprBatchEntry* entry = &batch.entries[index];
+    checkN(input + entry->offset, entry->length, expected, &batch, index);
+    exprFreeTokenBatch(&batch);
+}
+
+static void checkBatchError(const char* input, char separator, size_t index, const char* message)
+{
+    ExprTokenBatch batch;
+    exprInitTokenBatch(&batch);
+    exprLexerBatch(&batch, input, strlen(input), separator);
+    const ExprBatchEntry* entry = &batch.entries[index];
+    checkErrorN(input + entry->offset, entry->length, message, &batch, index);
+    exprFreeTokenBatch(&batch);
+}
+
+static void expect(bool condition, const char* what)
+{
+    ++total;
+    if (condition) {
+        if (printPassed)
+            printf("[PASSED] %s\n", what);
+        ++passed;
+    } else {
+        printf("[ FAIL ] %s\n", what);
         ++failed;
     }
 }
 
+class SymbolResolver : public MyResolver
+{
+public:
+    int interned;
+    int notInterned;
+
+    SymbolResolver() : interned(0), notInterned(0) {}
+
+    bool resolveVariable(const ExprSymbol& symbol, ExprValuePtr& result)
+    {
+        if (symbol.id != EXPR_NO_SYMBOL && symbol.hash == exprHashName(symbol.name, symbol.length))
+            ++interned;
+        else
+            ++notInterned;
+        return ExprResolver::resolveVariable(symbol, result);
+    }
+};
+
+static void checkSymbols()
+{
+    const char* input = "var.8 + var.16 * var.8 - fn1(var.16)";
+
+    ExprSymbolPool pool;
+    ExprTokenStream stream;
+    exprInitTokenStream(&stream);
+    exprLexerStream(&stream, input, strlen(input), &pool);
+    expect(pool.count() == 3, "symbol pool: 3 distinct identifiers");
+    expect(stream.tokens[0].symbol == stream.tokens[4].symbol, "symbol pool: same name gets same ID");
+    expect(stream.tokens[0].symbol != stream.tokens[2].symbol, "symbol pool: different names get different IDs");
+    ExprSymbol symbol = pool.symbol(stream.tokens[2].symbol);
+    expect(symbol.length == 6 && !memcmp(symbol.name, "var.16", 6), "symbol pool: name is stored");
+    expect(symbol.hash == exprHashName("var.16", 6), "symbol pool: hash is stored");
+    exprFreeTokenStream(&stream);
+
+    SymbolResolver r;
+    MyEvaluator e;
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, strlen(input), r, &pool);
+    expect(ParserLessOop::exprEvaluate(expr, e) == 0xda + 0xcada * 0xda - (0x8888 + 0xcada), "symbol pool: ParserLessOop result");
+    ParserOop::Expr* oopExpr = ParserOop::Expr::parse(input, strlen(input), r, &pool);
+    expect(oopExpr->evaluate(e) == 0xda + 0xcada * 0xda - (0x8888 + 0xcada), "symbol pool: ParserOop result");
+    expect(r.interned == 8 && r.notInterned == 0, "symbol pool: resolver receives IDs");
+    expect(pool.count() == 3, "symbol pool: parser reuses existing IDs");
+    ParserLessOop::exprFree(expr);
+    delete oopExpr;
+}
+
+static void checkArena()
+{
+    static const char* const inputs[] = { "1 + 2 * 3", "fn3(var.8, var.16, -var.24) ? b@[0x10] : $", "(var.32 > 1) && !0" };
+    const size_t count = sizeof(inputs) / sizeof(inputs[0]);
+
+    ExprArena arena(64);
+    MyResolver r;
+    MyEvaluator e;
+
+    ParserLessOop::Expr* lessOop[count];
+    ParserOop::Expr* oop[count];
+    for (size_t i = 0; i < count; i++) {
+        lessOop[i] = ParserLessOop::exprParse(inputs[i], strlen(inputs[i]), r, NULL, &arena);
+        oop[i] = ParserOop::Expr::parse(inputs[i], strlen(inputs[i]), r, NULL, &arena);
+    }
+
+    expect(arena.bytesUsed() > 0, "arena: nodes are allocated from the arena");
+    expect(ParserLessOop::exprEvaluate(lessOop[0], e) == 7 && oop[0]->evaluate(e) == 7, "arena: first expression");
+    expect(ParserLessOop::exprEvaluate(lessOop[1], e) == oop[1]->evaluate(e), "arena: second expression");
+    expect(ParserLessOop::exprEvaluate(lessOop[2], e) == 1 && oop[2]->evaluate(e) == 1, "arena: third expression");
+
+    size_t used = arena.bytesUsed();
+    try {
+        ParserLessOop::exprParse("1 + (2 *", 8, r, NULL, &arena);
+    } catch (const ExprError&) {
+    }
+    expect(ParserLessOop::exprEvaluate(lessOop[0], e) == 7, "arena: failed parse keeps earlier expressions");
+    expect(arena.bytesUsed() >= used, "arena: failed parse does not release memory");
+
+    arena.reset();
+    expect(arena.bytesUsed() == 0, "arena: reset releases all nodes");
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse("var.8 - 2", 9, r, NULL, &arena);
+    expect(ParserLessOop::exprEvaluate(expr, e) == 0xda - 2, "arena: reuse after reset");
+}
+
+class GenerationResolver : public MyResolver
+{
+public:
+    uint32_t value;
+
+    GenerationResolver() : value(0) {}
+    uint32_t generation() const { return value; }
+};
+
+static void checkCache()
+{
+    GenerationResolver r;
+    MyEvaluator e;
+
+    ParserLessOop::ExprCache cache(2, 1);
+    std::shared_ptr<const ParserLessOop::Expr> a = cache.compile("var.8 + 2", r);
+    std::shared_ptr<const ParserLessOop::Expr> b = cache.compile("  var.8\t+  2\n", r);
+    expect(a == b && cache.hits() == 1 && cache.misses() == 1, "cache: whitespace is normalized");
+    expect(ParserLessOop::exprEvaluate(b.get(), e) == 0xda + 2, "cache: ParserLessOop result");
+    cache.compile("var.8 + 3", r);
+    cache.compile("fn1(1)", r);
+    expect(cache.size() == 2 && cache.evictions() == 1 && cache.misses() == 3, "cache: least recently used entry is evicted");
+    expect(ParserLessOop::exprEvaluate(a.get(), e) == 0xda + 2, "cache: evicted expression stays valid while shared");
+    cache.compile("var.8+3", r);
+    expect(cache.hits() == 2, "cache: recently used entry is kept");
+    r.value = 1;
+    cache.compile("var.8+3", r);
+    expect(cache.hits() == 2 && cache.misses() == 4, "cache: resolver generation is part of the key");
+    try {
+        cache.compile("1 +", r);
+    } catch (const ExprError&) {
+    }
+    expect(cache.size() == 2 && cache.misses() == 5, "cache: failed compilation is not cached");
+
+    ParserOop::ExprCache oopCache(64, 4);
+    std::shared_ptr<const ParserOop::Expr> c = oopCache.compile("fn2(var.8, 3)", r);
+    expect(c == oopCache.compile("fn2( var.8 , 3 )", r), "cache: ParserOop hit");
+    expect(c->evaluate(e) == 0x9999 + 0xda * 3, "cache: ParserOop result");
+
+    static const char* const inputs[] = { "1", "2 * var.16", "fn0()", "var.8 - 1", "$ + 1", "fn3(1, 2, 3)",
+        "var.32 >> 4", "(1 + 2) * 3", "~var.8", "var.16 % 7", "b@[0x1000]", "!var.8" };
+    const size_t count = sizeof(inputs) / sizeof(inputs[0]);
+    ExprValue expected[count];
+    for (size_t i = 0; i < count; i++) {
+        ParserLessOop::Expr* expr = ParserLessOop::exprParse(inputs[i], r);
+        expected[i] = ParserLessOop::exprEvaluate(expr, e);
+        ParserLessOop::exprFree(expr);
+    }
+
+    ParserLessOop::ExprCache sharedCache(8, 4);
+    std::vector<std::thread> threads;
+    int mismatches[4] = { 0, 0, 0, 0 };
+    for (int t = 0; t < 4; t++) {
+        threads.push_back(std::thread([&, t]() {
+            MyResolver resolver;
+            MyEvaluator evaluator;
+            for (int i = 0; i < 5000; i++) {
+                size_t index = (size_t)(i * (t + 1) + t) % count;
+                std::shared_ptr<const ParserLessOop::Expr> expr = sharedCache.compile(inputs[index], resolver);
+                if (ParserLessOop::exprEvaluate(expr.get(), evaluator) != expected[index])
+                    ++mismatches[t];
+            }
+        }));
+    }
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    expect(mismatches[0] + mismatches[1] + mismatches[2] + mismatches[3] == 0, "cache: concurrent results");
+    expect(sharedCache.hits() + sharedCache.misses() == 4 * 5000 && sharedCache.size() <= 8, "cache: concurrent counters");
+}
+
+static void checkTryParse(const char* input, ExprStatus status, size_t position, const char* message)
+{
+    char what[256];
+    MyResolver r;
+
+    ParserOop::ParseResult oop = ParserOop::Expr::tryParse(input, r);
+    snprintf(what, sizeof(what), "ParserOop: tryParse \"%s\" => status %d at %d", input, (int)status, (int)position);
+    expect(oop.error.status() == status && oop.error.position() == position && (status != EXPR_OK) == !oop.expr, what);
+    snprintf(what, sizeof(what), "ParserOop: tryParse \"%s\" => message \"%s\"", input, message);
+    expect(!strcmp(oop.error.message(), message), what);
+    delete oop.expr;
+
+    ParserLessOop::ExprParseResult lessOop = ParserLessOop::exprTryParse(input, r);
+    snprintf(what, sizeof(what), "ParserLessOop: tryParse \"%s\" => status %d at %d", input, (int)status, (int)position);
+    expect(lessOop.error.status() == status && lessOop.error.position() == position && (status != EXPR_OK) == !lessOop.expr, what);
+    snprintf(what, sizeof(what), "ParserLessOop: tryParse \"%s\" => message \"%s\"", input, message);
+    expect(!strcmp(lessOop.error.message(), message), what);
+    ParserLessOop::exprFree(lessOop.expr);
+}
+
+static void checkHashCons()
+{
+    static const char* const inputs[] = { "(var.32 >> 8) + 1", "(var.32 >> 8) * 2", "fn0() + fn0()", "fn1(var.32 >> 8)" };
+    const size_t count = sizeof(inputs) / sizeof(inputs[0]);
+
+    MyResolver r;
+    MyEvaluator e;
+    ParserLessOop::ExprHashCons dag;
+
+    const ParserLessOop::Expr* shared[count];
+    for (size_t i = 0; i < count; i++)
+        shared[i] = dag.add(ParserLessOop::exprParse(inputs[i], r));
+
+    expect(shared[0]->op1 == shared[1]->op1, "hash cons: common subtree is shared");
+    expect(shared[0]->op1 == shared[3]->op1, "hash cons: function argument is shared");
+    expect(shared[2]->op1 != shared[2]->op2, "hash cons: function calls are not shared");
+    expect(dag.nodeCountBefore() == 17, "hash cons: node count before");
+    expect(dag.nodeCountAfter() == 11, "hash cons: node count after");
+
+    for (size_t i = 0; i < count; i++) {
+        ParserLessOop::Expr* expr = ParserLessOop::exprParse(inputs[i], r);
+        char what[256];
+        snprintf(what, sizeof(what), "hash cons: \"%s\" evaluates the same", inputs[i]);
+        expect(ParserLessOop::exprEvaluate(shared[i], e) == ParserLessOop::exprEvaluate(expr, e), what);
+        ParserLessOop::exprFree(expr);
+    }
+
+    const ParserLessOop::Expr* again = dag.add(ParserLessOop::exprParse("(var.32>>8)+1", r));
+    expect(again == shared[0] && dag.nodeCountAfter() == 11, "hash cons: identical expression adds no nodes");
+}
+
+class CountingResolver : public MyResolver
+{
+public:
+    int calls;
+
+    CountingResolver() : calls(0) {}
+
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        ++calls;
+        return MyResolver::resolveVariable(name, result);
+    }
+};
+
+class ThrowingResolver : public MyResolver
+{
+public:
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        if (!strcmp(name, "boom"))
+            throw 42;
+        return MyResolver::resolveVariable(name, result);
+    }
+};
+
+static void checkCompileBatch()
+{
+    static const char* const sources[] = { "var.8 + 1", "fn2(var.16, 3) * 2", "1 + (2", "unknown", "$ - var.32" };
+    const size_t sourceCount = sizeof(sources) / sizeof(sources[0]);
+    const size_t count = 1000;
+
+    std::vector<const char*> inputs(count);
+    for (size_t i = 0; i < count; i++)
+        inputs[i] = sources[i % sourceCount];
+
+    MyEvaluator e;
+    ExprWorkerPool pool(4);
+    expect(pool.threadCount() == 4, "compile batch: pool size");
+
+    std::vector<CountingResolver> resolvers(pool.threadCount());
+    std::vector<ExprResolver*> resolverPtrs(pool.threadCount());
+    for (size_t i = 0; i < resolverPtrs.size(); i++)
+        resolverPtrs[i] = &resolvers[i];
+
+    std::vector<ParserLessOop::ExprParseResult> lessOop(count);
+    size_t failed = ParserLessOop::compileBatch(&inputs[0], count, &resolverPtrs[0], pool, &lessOop[0]);
+    expect(failed == 2 * count / sourceCount, "compile batch: ParserLessOop failure count");
+
+    MyResolver r;
+    std::vector<ParserOop::ParseResult> oop(count);
+    failed = ParserOop::compileBatch(&inputs[0], count, r, pool, &oop[0]);
+    expect(failed == 2 * count / sourceCount, "compile batch: ParserOop failure count");
+
+    bool same = true;
+    for (size_t i = 0; i < count; i++) {
+        ParserLessOop::ExprParseResult serial = ParserLessOop::exprTryParse(inputs[i], r);
+        if (!serial.expr) {
+            same = same && !lessOop[i].expr && !oop[i].expr
+                && lessOop[i].error.status() == serial.error.status()
+                && oop[i].error.status() == serial.error.status()
+                && lessOop[i].error.position() == serial.error.position();
+        } else {
+            ExprValue value = ParserLessOop::exprEvaluate(serial.expr, e);
+            same = same && lessOop[i].expr && oop[i].expr
+                && ParserLessOop::exprEvaluate(lessOop[i].expr, e) == value && oop[i].expr->evaluate(e) == value;
+        }
+        ParserLessOop::exprFree(serial.expr);
+        ParserLessOop::exprFree(lessOop[i].expr);
+        delete oop[i].expr;
+    }
+    expect(same, "compile batch: results match serial parse");
+
+    int calls = 0;
+    for (size_t i = 0; i < resolvers.size(); i++)
+        calls += resolvers[i].calls;
+    expect(calls == (int)(4 * count / sourceCount), "compile batch: every per-thread resolver call is counted");
+
+    inputs[count / 2] = "var.8 + boom";
+    ThrowingResolver thrower;
+    bool thrown = false;
+    try {
+        ParserLessOop::compileBatch(&inputs[0], count, thrower, pool, &lessOop[0]);
+    } catch (int) {
+        thrown = true;
+    }
+    bool empty = true;
+    for (size_t i = 0; i < count; i++)
+        empty = empty && !lessOop[i].expr;
+    expect(thrown && empty, "compile batch: resolver exception is rethrown and nothing is leaked");
+
+    failed = ParserLessOop::compileBatch(&inputs[0], 0, r, pool, NULL);
+    expect(failed == 0, "compile batch: empty batch");
+}
+
+static bool sameTree(const ParserLessOop::Expr* a, const ParserLessOop::Expr* b)
+{
+    if (a->op != b->op || (a->op == ParserLessOop::OP_NUMBER && a->number != b->number))
+        return false;
+    int count = ParserLessOop::exprOperandCount(a->op);
+    return (count < 1 || sameTree(a->op1, b->op1)) && (count < 2 || sameTree(a->op2, b->op2))
+        && (count < 3 || sameTree(a->op3, b->op3));
+}
+
+static bool sameAsFullParse(const ParserLessOop::ExprIncremental& inc)
+{
+    MyResolver r;
+    MyEvaluator e;
+    const std::string& source = inc.source();
+    ParserLessOop::ExprParseResult full = ParserLessOop::exprTryParse(source.c_str(), source.length(), r);
+    const ParserLessOop::ExprParseResult& result = inc.result();
+
+    bool same;
+    if (!full.expr) {
+        same = !result.expr && result.error.status() == full.error.status()
+            && result.error.position() == full.error.position()
+            && !strcmp(result.error.message(), full.error.message());
+    } else
+        same = result.expr && sameTree(result.expr, full.expr)
+            && ParserLessOop::exprEvaluate(result.expr, e) == ParserLessOop::exprEvaluate(full.expr, e);
+
+    ParserLessOop::exprFree(full.expr);
+    return same;
+}
+
+static void checkIncremental()
+{
+    const char* input = "fn2(var.8, var.16 + 1) + (var.32 >> 8) * w@[var.8 - 2]";
+    CountingResolver r;
+    ParserLessOop::ExprIncremental inc;
+    inc.parse(input, strlen(input), r);
+    expect(inc.result().expr && sameAsFullParse(inc), "incremental: initial parse");
+    int calls = r.calls;
+
+    // "(var.32 >> 8)" => "(var.32 >> 4)"
+    inc.edit(36, 1, "4", 1, r);
+    expect(sameAsFullParse(inc), "incremental: edit inside parentheses");
+    expect(inc.lexedTokens() == 2 && inc.parsedTokens() == 4, "incremental: only the group is re-parsed");
+    expect(r.calls == calls, "incremental: known names are not resolved again");
+
+    // "var.16 + 1" => "var.16 + var.32"
+    inc.edit(20, 1, "var.32", 6, r);
+    expect(sameAsFullParse(inc), "incremental: edit inside function argument");
+    expect(inc.parsedTokens() == 4, "incremental: only the argument is re-parsed");
+
+    // "var.16" => "var.24", same length
+    inc.edit(15, 2, "24", 2, r);
+    expect(sameAsFullParse(inc), "incremental: identifier renamed in place");
+
+    inc.edit(strlen(inc.source().c_str()), 0, " -", 2, r);
+    expect(!inc.result().expr && sameAsFullParse(inc), "incremental: error is the same as full parse");
+    inc.edit(inc.source().length(), 0, " 3", 2, r);
+    expect(inc.result().expr && sameAsFullParse(inc), "incremental: recovers after an error");
+
+    inc.edit(0, 0, "  ", 2, r);
+    expect(inc.parsedTokens() == 0 && sameAsFullParse(inc), "incremental: whitespace only");
+
+    // Random edits, compared against parsing from scratch
+    static const char* const fragments[] = { "", " ", "1", "+", "-", "*", "(", ")", "[", "]", ",", "var.8",
+        "fn1(", "fn2(", "b@[", "8", ">>", "?", ":", "0x", "&&", "!", "$", "#" };
+    const size_t fragmentCount = sizeof(fragments) / sizeof(fragments[0]);
+    static const char* const starts[] = { "fn3(var.8, (var.16 + 2) * 3, w@[var.32 & 0xff])", "(((1)))",
+        "var.8 ? fn1((var.16)) : [var.32 + (4 << 2)]", "fn2(fn1(1), fn0()) - (2 * (3 + var.8))" };
+    unsigned seed = 12345;
+    bool same = true;
+    for (size_t round = 0; round < 400; round++) {
+        const char* start = starts[round % (sizeof(starts) / sizeof(starts[0]))];
+        inc.parse(start, strlen(start), r);
+        for (int i = 0; i < 10; i++) {
+            seed = seed * 1103515245u + 12345u;
+            size_t length = inc.source().length();
+            size_t offset = (seed >> 8) % (length + 1);
+            size_t deleted = ((seed >> 20) % 4 == 0 ? (seed >> 4) % 4 : 0);
+            const char* fragment = fragments[(seed >> 16) % fragmentCount];
+            inc.edit(offset, deleted, fragment, strlen(fragment), r);
+            same = same && sameAsFullParse(inc);
+        }
+    }
+    expect(same, "incremental: random edits match full parse");
+}
+
+// Looks every function up once, through the legacy methods of MyResolver
+class FunctionResolver : public MyResolver
+{
+public:
+    int lookups;
+    int legacyCalls;
+
+    FunctionResolver() : lookups(0), legacyCalls(0) {}
+
+    ExprCallback1 resolveFunc1(const char* name) { ++legacyCalls; return MyResolver::resolveFunc1(name); }
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        ++lookups;
+        char name[EXPR_MAX_IDENT_LENGTH + 1];
+        memcpy(name, symbol.name, symbol.length);
+        name[symbol.length] = 0;
+        result.cb0 = MyResolver::resolveFunc0(name);
+        result.cb1 = MyResolver::resolveFunc1(name);
+        result.cb2 = MyResolver::resolveFunc2(name);
+        result.cb3 = MyResolver::resolveFunc3(name);
+        return result.cb0 || result.cb1 || result.cb2 || result.cb3;
+    }
+};
+
+static void checkResolveFunction()
+{
+    const char* input = "fn0() + fn1(1) * fn2(2, 3) - fn3(4, 5, fn1(6))";
+    MyEvaluator e;
+    MyResolver legacy;
+    ParserLessOop::Expr* expected = ParserLessOop::exprParse(input, legacy);
+
+    FunctionResolver r;
+    ParserLessOop::Expr* lessOop = ParserLessOop::exprParse(input, r);
+    expect(r.lookups == 5 && r.legacyCalls == 0, "resolveFunction: ParserLessOop looks up each call once");
+    ParserOop::Expr* oop = ParserOop::Expr::parse(input, r);
+    expect(r.lookups == 10 && r.legacyCalls == 0, "resolveFunction: ParserOop looks up each call once");
+    expect(ParserLessOop::exprEvaluate(lessOop, e) == ParserLessOop::exprEvaluate(expected, e)
+        && oop->evaluate(e) == ParserLessOop::exprEvaluate(expected, e), "resolveFunction: same result as legacy methods");
+
+    ParserLessOop::ExprParseResult result = ParserLessOop::exprTryParse("1 + fn9(2)", r);
+    expect(!result.expr && result.error.status() == EXPR_UNKNOWN_FUNCTION, "resolveFunction: unknown function");
+    result = ParserLessOop::exprTryParse("fn2(1)", r);
+    expect(!result.expr && result.error.status() == EXPR_INVALID_ARGUMENT_COUNT, "resolveFunction: wrong arity");
+
+    ParserLessOop::exprFree(expected);
+    ParserLessOop::exprFree(lessOop);
+    delete oop;
+}
+
+class BulkResolver : public MyResolver
+{
+public:
+    int bulkCalls;
+    size_t names;
+    int variables;
+
+    BulkResolver() : bulkCalls(0), names(0), variables(0) {}
+
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        ++variables;
+        return MyResolver::resolveVariable(name, result);
+    }
+
+    void resolveMany(const ExprNameRequest* requests, size_t count, ExprNameResult* results)
+    {
+        ++bulkCalls;
+        names += count;
+        ExprResolver::resolveMany(requests, count, results);
+    }
+};
+
+static void checkCompileResolved()
+{
+    static const char* const inputs[] = { "var.8 + fn1(var.16)", "var.8 * var.8 - b@[var.32]", "fn1 + 1",
+        "unknown(2)", "w@[var.16] ^ $", "1 + (2", "fn2(var.8, fn1(3))" };
+    const size_t count = sizeof(inputs) / sizeof(inputs[0]);
+
+    MyResolver plain;
+    MyEvaluator e;
+    BulkResolver r;
+    ExprWorkerPool pool(2);
+    ParserLessOop::ExprParseResult lessOop[count];
+    ParserOop::ParseResult oop[count];
+
+    size_t failed = ParserLessOop::compileResolved(inputs, count, r, lessOop);
+    // var.8, var.16, var.32 and fn1 as variables; fn1, unknown and fn2 as functions
+    expect(r.bulkCalls == 1 && r.names == 7, "compile resolved: one bulk call with distinct names");
+    expect(r.variables == 4, "compile resolved: each variable is resolved once");
+    expect(failed == 3, "compile resolved: ParserLessOop failure count");
+    failed = ParserOop::compileResolved(inputs, count, r, oop, &pool);
+    expect(r.bulkCalls == 2 && failed == 3, "compile resolved: ParserOop on a pool");
+
+    bool same = true;
+    for (size_t i = 0; i < count; i++) {
+        ParserLessOop::ExprParseResult expected = ParserLessOop::exprTryParse(inputs[i], plain);
+        if (expected.expr) {
+            ExprValue value = ParserLessOop::exprEvaluate(expected.expr, e);
+            same = same && lessOop[i].expr && ParserLessOop::exprEvaluate(lessOop[i].expr, e) == value
+                && oop[i].expr && oop[i].expr->evaluate(e) == value;
+        } else {
+            same = same && !lessOop[i].expr && !oop[i].expr
+                && !strcmp(lessOop[i].error.message(), expected.error.message())
+                && !strcmp(oop[i].error.message(), expected.error.message());
+        }
+        ParserLessOop::exprFree(expected.expr);
+        ParserLessOop::exprFree(lessOop[i].expr);
+        delete oop[i].expr;
+    }
+    expect(same, "compile resolved: results match tryParse");
+}
+
+static ExprValue sumN(const ExprValue* args, size_t count, void* user)
+{
+    ExprValue sum = *(const ExprValue*)user;
+    for (size_t i = 0; i < count; i++)
+        sum += args[i];
+    return sum;
+}
+
+// Each group of three arguments is (value, low, high); true if every value is in its range
+static ExprValue inRangeN(const ExprValue* args, size_t count, void*)
+{
+    for (size_t i = 0; i + 2 < count; i += 3) {
+        if (args[i] < args[i + 1] || args[i] > args[i + 2])
+            return 0;
+    }
+    return 1;
+}
+
+class VariadicResolver : public MyResolver
+{
+public:
+    ExprValue base;
+
+    VariadicResolver() : base(100) {}
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        bool found = ExprResolver::resolveFunction(symbol, result);
+        if ((symbol.length == 3 && !memcmp(symbol.name, "sum", 3)) || (symbol.length == 3 && !memcmp(symbol.name, "fn1", 3))) {
+            result.cbN = sumN;
+            result.user = &base;
+            return true;
+        }
+        if (symbol.length == 8 && !memcmp(symbol.name, "inrange3", 8)) {
+            result.cbN = inRangeN;
+            return true;
+        }
+        return found;
+    }
+};
+
+static void checkVariadic(const char* input, ExprValue expected)
+{
+    VariadicResolver r;
+    MyEvaluator e;
+    ExprArena arena;
+    char what[256];
+
+    ParserLessOop::Expr* lessOop = ParserLessOop::exprParse(input, r);
+    ParserOop::Expr* oop = ParserOop::Expr::parse(input, strlen(input), r, NULL, &arena);
+    snprintf(what, sizeof(what), "variadic: \"%s\" => %d", input, expected);
+    expect(ParserLessOop::exprEvaluate(lessOop, e) == expected && oop->evaluate(e) == expected, what);
+    ParserLessOop::exprFree(lessOop);
+}
+
+static void checkVariadic()
+{
+    checkVariadic("sum()", 100);
+    checkVariadic("sum(1, 2, 3, 4, 5)", 115);
+    checkVariadic("inrange3(5, 1, 10, 20, 15, 30)", 1);
+    checkVariadic("inrange3(5, 1, 10, 40, 15, 30)", 0);
+    checkVariadic("fn1(8) + 1", 0x8888 + 8 + 1);    // fixed arity wins
+    checkVariadic("fn1(1, 2, 3, 4)", 110);
+    checkVariadic("sum(sum(1, 2), fn1(1, 1), 3 * 3)", 103 + 102 + 9 + 100);
+
+    std::string input = "sum(0";
+    for (int i = 1; i <= EXPR_MAX_VARIADIC_ARGS; i++)
+        input += ", 1";
+    input += ")";
+    VariadicResolver r;
+    ParserLessOop::ExprParseResult lessOop = ParserLessOop::exprTryParse(input.c_str(), r);
+    ParserOop::ParseResult oop = ParserOop::Expr::tryParse(input.c_str(), r);
+    expect(!lessOop.expr && !oop.expr && !strcmp(lessOop.error.message(), oop.error.message())
+        && !strcmp(lessOop.error.message(), "too many arguments for function 'sum' (at most 32)."), "variadic: too many arguments");
+
+    ParserLessOop::ExprHashCons dag;
+    MyEvaluator e;
+    const ParserLessOop::Expr* shared = dag.add(ParserLessOop::exprParse("sum(var.8 + 1, var.8 + 1)", r));
+    expect(shared->args[0] == shared->args[1] && ParserLessOop::exprEvaluate(shared, e) == 100 + 2 * (0xda + 1),
+        "variadic: arguments are hash-consed");
+}
+
+struct Emulator
+{
+    ExprValue pc;
+    ExprValue regs[4];
+};
+
+static ExprValue emulatorPC(void* user) { return ((Emulator*)user)->pc; }
+static ExprValue emulatorTicks(void* user) { return ((Emulator*)user)->pc * 4; }
+static ExprValue emulatorReg(ExprValue index, void* user) { return ((Emulator*)user)->regs[index & 3]; }
+static ExprValue emulatorPair(ExprValue hi, ExprValue lo, void* user)
+    { return (emulatorReg(hi, user) << 8) | emulatorReg(lo, user); }
+static ExprValue emulatorClamp(ExprValue v, ExprValue lo, ExprValue hi, void*) { return v < lo ? lo : (v > hi ? hi : v); }
+
+// Binds every name to one emulator instance through the user pointer
+class EmulatorResolver : public MyResolver
+{
+public:
+    explicit EmulatorResolver(Emulator* emulator) : m_emulator(emulator) {}
+
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        if (strcmp(name, "pc") != 0)
+            return MyResolver::resolveVariable(name, result);
+        result.readUserValue = emulatorPC;
+        result.user = m_emulator;
+        return true;
+    }
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        std::string name(symbol.name, symbol.length);
+        if (name == "ticks")
+            result.ucb0 = emulatorTicks;
+        else if (name == "reg")
+            result.ucb1 = emulatorReg;
+        else if (name == "pair")
+            result.ucb2 = emulatorPair;
+        else if (name == "clamp")
+            result.ucb3 = emulatorClamp;
+        else
+            return ExprResolver::resolveFunction(symbol, result);
+        result.user = m_emulator;
+        return true;
+    }
+
+private:
+    Emulator* m_emulator;
+};
+
+struct EmulatorThread
+{
+    ParserLessOop::Expr* lessOop;
+    ParserOop::Expr* oop;
+    ExprValue lessOopSum;
+    ExprValue oopSum;
+};
+
+static void runEmulator(EmulatorThread* t)
+{
+    MyEvaluator e;
+    t->lessOopSum = t->oopSum = 0;
+    for (int i = 0; i < 10000; i++) {
+        t->lessOopSum += ParserLessOop::exprEvaluate(t->lessOop, e);
+        t->oopSum += t->oop->evaluate(e);
+    }
+}
+
+static void checkUserCallbacks()
+{
+    const char* input = "pc + ticks() + reg(1) * pair(2, 3) - clamp(pc, 0x10, 0x20) + fn1(0)";
+    Emulator emulators[2] = { { 0x100, { 1, 2, 3, 4 } }, { 0x8, { 5, 6, 7, 8 } } };
+    ExprValue expected[2] = { 0x100 + 0x400 + 2 * 0x304 - 0x20 + 0x8888, 0x8 + 0x20 + 6 * 0x708 - 0x10 + 0x8888 };
+
+    EmulatorThread threads[2];
+    for (int i = 0; i < 2; i++) {
+        EmulatorResolver r(&emulators[i]);
+        threads[i].lessOop = ParserLessOop::exprParse(input, r);
+        threads[i].oop = ParserOop::Expr::parse(input, r);
+    }
+
+    std::thread worker(runEmulator, &threads[1]);
+    runEmulator(&threads[0]);
+    worker.join();
+
+    for (int i = 0; i < 2; i++) {
+        char what[256];
+        snprintf(what, sizeof(what), "user callbacks: emulator %d", i);
+        expect(threads[i].lessOopSum == expected[i] * 10000 && threads[i].oopSum == expected[i] * 10000, what);
+        ParserLessOop::exprFree(threads[i].lessOop);
+        delete threads[i].oop;
+    }
+
+    EmulatorResolver r(&emulators[0]);
+    ParserLessOop::ExprParseResult result = ParserLessOop::exprTryParse("pair(1)", r);
+    expect(!result.expr && !strcmp(result.error.message(), "invalid number of arguments for function 'pair' (expected 2, got 1)."),
+        "user callbacks: wrong arity");
+
+    ParserLessOop::ExprHashCons dag;
+    MyEvaluator e;
+    const ParserLessOop::Expr* shared = dag.add(ParserLessOop::exprParse("(pc + 1) * (pc + 1)", r));
+    expect(shared->op1 == shared->op2 && ParserLessOop::exprEvaluate(shared, e) == 0x101 * 0x101,
+        "user callbacks: user values are hash-consed");
+}
+
+// Labels and EQU constants are known after linking and never change
+class ConstantResolver : public MyResolver
+{
+public:
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        if (!strcmp(name, "start"))
+            result.value = 0x4000;
+        else if (!strcmp(name, "size"))
+            result.value = 12;
+        else if (!strcmp(name, "broken")) {
+            result.value = 1;
+            result.ptr = this;
+            result.sizeInBytes = 1;
+        } else
+            return MyResolver::resolveVariable(name, result);
+        result.isConstant = true;
+        return true;
+    }
+};
+
+static void checkConstantSymbols()
+{
+    ConstantResolver r;
+    MyEvaluator e;
+    const char* input = "start + size * var.8";
+    ExprValue expected = 0x4000 + 12 * 0xda;
+
+    ParserLessOop::Expr* lessOop = ParserLessOop::exprParse(input, r);
+    ParserOop::Expr* oop = ParserOop::Expr::parse(input, r);
+    expect(lessOop->op1->op == ParserLessOop::OP_NUMBER && lessOop->op1->number == 0x4000
+        && lessOop->op2->op1->op == ParserLessOop::OP_NUMBER, "constant symbols: inlined as numbers");
+    expect(ParserLessOop::exprEvaluate(lessOop, e) == expected && oop->evaluate(e) == expected, "constant symbols: evaluate");
+    ParserLessOop::exprFree(lessOop);
+    delete oop;
+
+    ParserLessOop::ExprParseResult result = ParserLessOop::exprTryParse("broken + 1", r);
+    ParserOop::ParseResult oopResult = ParserOop::Expr::tryParse("broken + 1", r);
+    expect(!result.expr && result.error.status() == EXPR_INTERNAL_ERROR
+        && !oopResult.expr && oopResult.error.status() == EXPR_INTERNAL_ERROR, "constant symbols: constant and reader both set");
+}
+
+// Result of evaluation, or the error message
+static std::string evaluateToString(const ParserLessOop::Expr* lessOop, ParserOop::Expr* oop)
+{
+    MyEvaluator e;
+    char buf[64];
+    try {
+        ExprValue value = (lessOop ? ParserLessOop::exprEvaluate(lessOop, e) : oop->evaluate(e));
+        snprintf(buf, sizeof(buf), "%d", value);
+        return buf;
+    } catch (const ExprError& error) {
+        return error.message();
+    }
+}
+
+// Folding must not change results, including runtime errors
+static void checkFold(const char* input, ParserLessOop::ExprOp expectedOp)
+{
+    MyResolver r;
+    ExprArena arena;
+    char what[256];
+
+    ParserLessOop::Expr* lessOop = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* lessOopFolded = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* lessOopArena = ParserLessOop::exprParse(input, strlen(input), r, NULL, &arena);
+    ParserOop::Expr* oop = ParserOop::Expr::parse(input, r);
+    ParserOop::Expr* oopFolded = ParserOop::Expr::fold(ParserOop::Expr::parse(input, r));
+    ParserOop::Expr* oopArena = ParserOop::Expr::fold(ParserOop::Expr::parse(input, strlen(input), r, NULL, &arena), &arena);
+    ParserLessOop::exprFold(lessOopFolded);
+    ParserLessOop::exprFold(lessOopArena, &arena);
+
+    std::string expected = evaluateToString(lessOop, NULL);
+    snprintf(what, sizeof(what), "fold: \"%s\" => %s", input, expected.c_str());
+    expect(evaluateToString(lessOopFolded, NULL) == expected && evaluateToString(lessOopArena, NULL) == expected
+        && evaluateToString(NULL, oop) == expected && evaluateToString(NULL, oopFolded) == expected
+        && evaluateToString(NULL, oopArena) == expected, what);
+
+    ExprValue value;
+    snprintf(what, sizeof(what), "fold: \"%s\" root node", input);
+    expect(lessOopFolded->op == expectedOp && lessOopArena->op == expectedOp
+        && oopFolded->isConstant(&value) == (expectedOp == ParserLessOop::OP_NUMBER), what);
+
+    ParserLessOop::exprFree(lessOop);
+    ParserLessOop::exprFree(lessOopFolded);
+    delete oop;
+    delete oopFolded;
+}
+
+static void checkFold()
+{
+    checkFold("4 + (8 * 2)", ParserLessOop::OP_NUMBER);
+    checkFold("-(3 << 4) ^ ~0x0f != !5", ParserLessOop::OP_NUMBER);
+    checkFold("var.8 + (8 * 2)", ParserLessOop::OP_PLUS);
+    checkFold("1 ? var.8 : fn1(2)", ParserLessOop::OP_BYTEVALUE);
+    checkFold("(2 > 3) ? fn1(2) : var.16 * (4 - 3)", ParserLessOop::OP_MULTIPLY);
+    checkFold("1 ? 2 : 1 / 0", ParserLessOop::OP_NUMBER);
+    checkFold("(1 - 1) ? 2 : 1 / 0", ParserLessOop::OP_DIVIDE);
+    checkFold("var.8 ? 1 + 1 : 2 * 2", ParserLessOop::OP_COND);
+    checkFold("0 && fn1(2)", ParserLessOop::OP_NUMBER);
+    checkFold("2 || fn1(2)", ParserLessOop::OP_NUMBER);
+    checkFold("3 && var.8", ParserLessOop::OP_NOTEQUAL);
+    checkFold("0 || var.8", ParserLessOop::OP_NOTEQUAL);
+    checkFold("var.8 && 7", ParserLessOop::OP_NOTEQUAL);
+    checkFold("var.8 || 0", ParserLessOop::OP_NOTEQUAL);
+    checkFold("var.8 && 0", ParserLessOop::OP_NUMBER);
+    checkFold("var.8 || 1", ParserLessOop::OP_NUMBER);
+    checkFold("fn1(var.8) && 0", ParserLessOop::OP_LOGICAND);
+    checkFold("varFn && 0", ParserLessOop::OP_LOGICAND);
+    checkFold("d@[var.8] || 1", ParserLessOop::OP_LOGICOR);
+    checkFold("var.8 / 0 || 1", ParserLessOop::OP_LOGICOR);
+    checkFold("1 / 0", ParserLessOop::OP_DIVIDE);
+    checkFold("5 % (2 - 2)", ParserLessOop::OP_REMAINDER);
+    checkFold("(0 - 2147483647 - 1) / 2", ParserLessOop::OP_NUMBER);
+    checkFold("100 / 7 + 100 % -7", ParserLessOop::OP_NUMBER);
+    checkFold("b@[2 + 2] + w@[$ + 1]", ParserLessOop::OP_PLUS);
+    checkFold("fn3(1 + 1, 2 * 2, var.8 + 0)", ParserLessOop::OP_FUNC3);
+
+    // Traps at run time, so it must not be folded either; not evaluated here
+    MyResolver r;
+    ParserLessOop::Expr* lessOop = ParserLessOop::exprParse("(0 - 2147483647 - 1) / -1", r);
+    ParserLessOop::exprFold(lessOop);
+    ParserOop::Expr* oop = ParserOop::Expr::fold(ParserOop::Expr::parse("(0 - 2147483647 - 1) % -1", r));
+    ExprValue value;
+    expect(lessOop->op == ParserLessOop::OP_DIVIDE && lessOop->op1->op == ParserLessOop::OP_NUMBER
+        && !oop->isConstant(&value), "fold: INT_MIN / -1 is left to the evaluator");
+    ParserLessOop::exprFree(lessOop);
+    delete oop;
+}
+
+static void checkSimplify(const char* input, ParserLessOop::ExprOp expectedOp)
+{
+    MyResolver r;
+    ExprArena arena;
+    char what[256];
+
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* simplified = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* simplifiedArena = ParserLessOop::exprParse(input, strlen(input), r, NULL, &arena);
+    ParserLessOop::exprSimplify(simplified);
+    ParserLessOop::exprSimplify(simplifiedArena, &arena);
+
+    std::string expected = evaluateToString(expr, NULL);
+    snprintf(what, sizeof(what), "simplify: \"%s\" => %s", input, expected.c_str());
+    expect(evaluateToString(simplified, NULL) == expected && evaluateToString(simplifiedArena, NULL) == expected
+        && simplified->op == expectedOp && simplifiedArena->op == expectedOp, what);
+
+    ParserLessOop::exprFree(expr);
+    ParserLessOop::exprFree(simplified);
+}
+
+static ExprValue dividend;
+
+class DividendResolver : public MyResolver
+{
+public:
+    bool resolveVariable(const char* name, ExprValuePtr& result)
+    {
+        if (strcmp(name, "x") != 0)
+            return MyResolver::resolveVariable(name, result);
+        result.ptr = &dividend;
+        result.sizeInBytes = 4;
+        return true;
+    }
+};
+
+static void checkSimplify()
+{
+    checkSimplify("var.32 * 8", ParserLessOop::OP_SHL);
+    checkSimplify("8 * var.32", ParserLessOop::OP_SHL);
+    checkSimplify("(0 - var.8) * 8", ParserLessOop::OP_SHL);     // shifts the negative value as unsigned
+    checkSimplify("var.32 / 16", ParserLessOop::OP_DIVPOW2);
+    checkSimplify("var.32 % 256", ParserLessOop::OP_REMPOW2);
+    checkSimplify("var.32 / 10", ParserLessOop::OP_DIVMAGIC);
+    checkSimplify("var.32 % -7", ParserLessOop::OP_REMMAGIC);
+    checkSimplify("var.32 / -8", ParserLessOop::OP_NEGATE);
+    checkSimplify("var.32 & 0xffffffff", ParserLessOop::OP_DWORDVALUE);
+    checkSimplify("0 + var.8", ParserLessOop::OP_BYTEVALUE);
+    checkSimplify("var.16 - 0 | 0 ^ 0", ParserLessOop::OP_WORDVALUE);
+    checkSimplify("0 - var.8", ParserLessOop::OP_NEGATE);
+    checkSimplify("var.8 ^ -1", ParserLessOop::OP_BITNOT);
+    checkSimplify("--var.8", ParserLessOop::OP_BYTEVALUE);
+    checkSimplify("~~var.16", ParserLessOop::OP_WORDVALUE);
+    checkSimplify("!!var.8", ParserLessOop::OP_NOTEQUAL);
+    checkSimplify("!!!var.8", ParserLessOop::OP_EQUAL);
+    checkSimplify("!(var.8 < 3)", ParserLessOop::OP_GREATEREQUAL);
+    checkSimplify("var.8 - var.8", ParserLessOop::OP_NUMBER);
+    checkSimplify("w@[var.16 + 1] == w@[var.16 + 1]", ParserLessOop::OP_EQUAL);    // memory reads are callbacks
+    checkSimplify("varFn - varFn", ParserLessOop::OP_MINUS);
+    checkSimplify("b@[var.8] * 0", ParserLessOop::OP_MULTIPLY);
+    checkSimplify("(var.16 + 1) == (var.16 + 1)", ParserLessOop::OP_NUMBER);
+    checkSimplify("var.16 > var.16", ParserLessOop::OP_NUMBER);
+    checkSimplify("var.8 & var.8", ParserLessOop::OP_BYTEVALUE);
+    checkSimplify("fn1(1) - fn1(1)", ParserLessOop::OP_MINUS);
+    checkSimplify("var.8 * 0", ParserLessOop::OP_NUMBER);
+    checkSimplify("fn0() * 0", ParserLessOop::OP_MULTIPLY);
+    checkSimplify("var.8 / 1", ParserLessOop::OP_BYTEVALUE);
+    checkSimplify("var.8 % 1", ParserLessOop::OP_NUMBER);
+    checkSimplify("var.8 / -1", ParserLessOop::OP_DIVIDE);
+    checkSimplify("var.8 / 0", ParserLessOop::OP_DIVIDE);
+    checkSimplify("(var.8 - var.8) / 0", ParserLessOop::OP_DIVIDE);
+    checkSimplify("2 * 3 + var.8 * (4 - 3)", ParserLessOop::OP_PLUS);
+
+    // Differential test of the reduced divisions against OP_DIVIDE and OP_REMAINDER
+    static const ExprValue divisors[] = { 2, 3, 5, 7, 10, 16, 100, 641, 1000, -2, -3, -7, -16, -100, 1000000007,
+        0x40000000, 0x7fffffff, -0x7fffffff };
+    static const ExprValue dividends[] = { 0, 1, -1, 2, -2, 7, -7, 99, -99, 100, -100, 65535, -65536, 123456789,
+        -123456789, 0x7fffffff, -0x7fffffff, (ExprValue)0x80000000 };
+    DividendResolver r;
+    MyEvaluator e;
+    int mismatches = 0;
+    for (size_t i = 0; i < sizeof(divisors) / sizeof(divisors[0]); i++) {
+        for (int remainder = 0; remainder < 2; remainder++) {
+            char input[64];
+            snprintf(input, sizeof(input), "x %s (0 + %d)", remainder ? "%" : "/", divisors[i]);
+            ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+            ParserLessOop::Expr* simplified = ParserLessOop::exprParse(input, r);
+            ParserLessOop::exprSimplify(simplified);
+            for (size_t j = 0; j < sizeof(dividends) / sizeof(dividends[0]); j++) {
+                for (int delta = -1; delta <= 1; delta++) {
+                    dividend = (ExprValue)((uint32_t)dividends[j] + (uint32_t)(delta * divisors[i]));
+                    if (ParserLessOop::exprEvaluate(simplified, e) != ParserLessOop::exprEvaluate(expr, e))
+                        ++mismatches;
+                }
+            }
+            ParserLessOop::exprFree(expr);
+            ParserLessOop::exprFree(simplified);
+        }
+    }
+    expect(mismatches == 0, "simplify: reduced division matches OP_DIVIDE and OP_REMAINDER");
+
+    ParserLessOop::ExprHashCons dag;
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse("x / 10 + x % 10 * 0x100 + x / 10", r);
+    ParserLessOop::exprSimplify(expr);
+    const ParserLessOop::Expr* shared = dag.add(expr);
+    dividend = 12345;
+    expect(shared->op2 == shared->op1->op1 && ParserLessOop::exprEvaluate(shared, e) == 1234 + 5 * 0x100 + 1234,
+        "simplify: reduced divisions are hash-consed");
+
+    // The reciprocal takes up to 33 bits; all of it must survive interning
+    const char* input = "x / 1000000007 + x % 641 * 0x10000";
+    ParserLessOop::Expr* reference = ParserLessOop::exprParse(input, r);
+    expr = ParserLessOop::exprParse(input, r);
+    ParserLessOop::exprSimplify(expr);
+    uint64_t magic = expr->op1->magic;
+    shared = dag.add(expr);
+    mismatches = 0;
+    for (size_t j = 0; j < sizeof(dividends) / sizeof(dividends[0]); j++) {
+        dividend = dividends[j];
+        if (ParserLessOop::exprEvaluate(shared, e) != ParserLessOop::exprEvaluate(reference, e))
+            ++mismatches;
+    }
+    expect(shared->op1->op == ParserLessOop::OP_DIVMAGIC && shared->op1->magic == magic && magic > 0xffffffffu
+        && mismatches == 0, "simplify: hash-consed reduced divisions keep the whole reciprocal");
+    ParserLessOop::exprFree(reference);
+}
+
+static void checkFlatten(const char* input, ParserLessOop::ExprOp expectedOp)
+{
+    MyResolver r;
+    ExprArena arena;
+    char what[256];
+
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* flattened = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* flattenedArena = ParserLessOop::exprParse(input, strlen(input), r, NULL, &arena);
+    ParserLessOop::exprFlatten(flattened);
+    ParserLessOop::exprFlatten(flattenedArena, &arena);
+
+    std::string expected = evaluateToString(expr, NULL);
+    snprintf(what, sizeof(what), "flatten: \"%s\" => %s", input, expected.c_str());
+    expect(evaluateToString(flattened, NULL) == expected && evaluateToString(flattenedArena, NULL) == expected
+        && flattened->op == expectedOp && flattenedArena->op == expectedOp, what);
+
+    ParserLessOop::exprFree(expr);
+    ParserLessOop::exprFree(flattened);
+}
+
+static void checkFlatten()
+{
+    checkFlatten("var.8 + 1 + var.16 + 2 + var.32", ParserLessOop::OP_SUMN);
+    checkFlatten("var.8 + 1 - 3 + var.16 - 5", ParserLessOop::OP_SUMN);
+    checkFlatten("(var.8 + var.16) + (var.32 + w@[$])", ParserLessOop::OP_SUMN);
+    checkFlatten("var.8 * 2 * var.16 * 3", ParserLessOop::OP_PRODUCTN);
+    checkFlatten("var.32 & 0xff & var.16 & 0x0f", ParserLessOop::OP_BITANDN);
+    checkFlatten("var.8 | 1 | var.16 | var.32 | 2", ParserLessOop::OP_BITORN);
+    checkFlatten("var.8 ^ var.16 ^ var.32", ParserLessOop::OP_BITXORN);
+    checkFlatten("fn1(1) + var.8 + 1 / 0", ParserLessOop::OP_SUMN);
+    checkFlatten("var.8 + 1 + 2", ParserLessOop::OP_PLUS);
+    checkFlatten("var.8 + 1 - 1", ParserLessOop::OP_BYTEVALUE);
+    checkFlatten("var.8 * 2 * 0", ParserLessOop::OP_MULTIPLY);
+    checkFlatten("var.8 + var.16 * 2 * var.32", ParserLessOop::OP_PLUS);
+    checkFlatten("(var.8 + var.16) * (var.32 - 1)", ParserLessOop::OP_MULTIPLY);
+    checkFlatten("1 + 2 + 3", ParserLessOop::OP_PLUS);
+    checkFlatten("var.8 - 1 - 2", ParserLessOop::OP_PLUS);
+    checkFlatten("2147483647 + var.32 + 1 + 2147483647", ParserLessOop::OP_PLUS);
+
+    MyResolver r;
+    MyEvaluator e;
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse("var.8 + 1 + var.16 + 2 + var.32", r);
+    ParserLessOop::exprFlatten(expr);
+    expect(expr->argCount == 3 && expr->number == 3 && expr->args[0]->op == ParserLessOop::OP_BYTEVALUE
+        && expr->args[2]->op == ParserLessOop::OP_DWORDVALUE, "flatten: constants are merged into one");
+    ParserLessOop::exprFlatten(expr);
+    expect(expr->op == ParserLessOop::OP_SUMN && expr->argCount == 3, "flatten: flattening twice changes nothing");
+    ParserLessOop::exprFree(expr);
+
+    ParserLessOop::ExprHashCons dag;
+    expr = ParserLessOop::exprParse("(var.8 | var.16 | 1) * (var.8 | var.16 | 1)", r);
+    ParserLessOop::exprFlatten(expr);
+    ExprValue expected = ParserLessOop::exprEvaluate(expr, e);
+    const ParserLessOop::Expr* shared = dag.add(expr);
+    expect(shared->op1 == shared->op2 && shared->op1->op == ParserLessOop::OP_BITORN
+        && ParserLessOop::exprEvaluate(shared, e) == expected, "flatten: n-ary nodes are hash-consed");
+}
+
+static int callCount;
+
+static ExprValue countCalls(const ExprValue*, size_t count, void*)
+{
+    ++callCount;
+    return (ExprValue)count;
+}
+
+class CompiledResolver : public EmulatorResolver
+{
+public:
+    ExprValue base;
+
+    explicit CompiledResolver(Emulator* emulator) : EmulatorResolver(emulator), base(100) {}
+
+    bool resolveFunction(const ExprSymbol& symbol, ExprFunction& result)
+    {
+        std::string name(symbol.name, symbol.length);
+        if (name == "sum") {
+            result.cbN = sumN;
+            result.user = &base;
+            return true;
+        }
+        if (name == "count") {
+            result.cbN = countCalls;
+            return true;
+        }
+        return EmulatorResolver::resolveFunction(symbol, result);
+    }
+};
+
+template <class Code> static std::string compiledToString(const Code& code)
+{
+    MyEvaluator e;
+    char buf[64];
+    try {
+        snprintf(buf, sizeof(buf), "%d", code.evaluate(e));
+        return buf;
+    } catch (const ExprError& error) {
+        return error.message();
+    }
+}
+
+// Compiled code must give the same result as the tree it was compiled from, also after the tree has been optimized
+static void checkCompiled(const char* input)
+{
+    Emulator emulator = { 0x1234, { 1, 2, 3, 4 } };
+    CompiledResolver r(&emulator);
+    char what[256];
+
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse(input, r);
+    ParserLessOop::Expr* optimized = ParserLessOop::exprParse(input, r);
+    ParserLessOop::exprSimplify(optimized);
+    ParserLessOop::exprFlatten(optimized);
+
+    ParserLessOop::ExprBytecode code, optimizedCode;
+    code.compile(expr);
+    optimizedCode.compile(optimized);
+    ParserLessOop::ExprRegisterCode registerCode, optimizedRegisterCode;
+    registerCode.compile(expr);
+    optimizedRegisterCode.compile(optimized);
+
+    std::string expected = evaluateToString(expr, NULL);
+    snprintf(what, sizeof(what), "bytecode: \"%s\" => %s", input, expected.c_str());
+    expect(compiledToString(code) == expected && compiledToString(optimizedCode) == expected
+        && evaluateToString(optimized, NULL) == expected, what);
+    snprintf(what, sizeof(what), "register code: \"%s\" => %s", input, expected.c_str());
+    expect(compiledToString(registerCode) == expected && compiledToString(optimizedRegisterCode) == expected, what);
+
+    ParserLessOop::exprFree(expr);
+    ParserLessOop::exprFree(optimized);
+}
+
+static void checkCompiled()
+{
+    checkCompiled("4");
+    checkCompiled("4 + (var_32 / 4 - (32 + var_32)) * 19 - var_32");
+    checkCompiled("var.8 + var.8.1 + var.16 + var.16.1 + var.24 + var.32 + varFn + af' + $");
+    checkCompiled("b@[var.8] + w@[var.16 + 1] + d@[$]");
+    checkCompiled("fn0() + fn1(2) + fn2(3, 4) + fn3(5, 6, 7)");
+    checkCompiled("pc + ticks() + reg(2) + pair(1, 3) + clamp(pc, 0, 0x100)");
+    checkCompiled("sum() + sum(1, 2, 3) + sum(var.8, sum(4, 5), fn1(6))");
+    checkCompiled("!var.8 + ~var.16 + -var.32 + !0");
+    checkCompiled("(var.8 | 3) + (var.8 & 3) + (var.8 ^ 3) + (var.8 << 3) + (var.32 >> 3)");
+    checkCompiled("(0 - var.8) * 8 + -var.16 * 0x10000 + (-var.8 << 3)");
+    checkCompiled("(var.8 == 3) + (var.8 != 3) + (var.8 < 3) + (var.8 <= 3) + (var.8 > 3) + (var.8 >= 3)");
+    checkCompiled("var.32 / 7 + var.32 % 7 + var.32 / -16 + var.32 % 16 + var.32 / var.8 + var.32 % var.16");
+    checkCompiled("var.8 / (var.8 - var.8)");
+    checkCompiled("var.8 % 0");
+    checkCompiled("var.8 && var.16");
+    checkCompiled("var.8 && 0");
+    checkCompiled("0 && var.8 / 0");
+    checkCompiled("var.8 || 0");
+    checkCompiled("0 || 0");
+    checkCompiled("7 || var.8 / 0");
+    checkCompiled("var.8 ? var.16 : var.32");
+    checkCompiled("(var.8 - var.8) ? var.8 / 0 : fn1(1)");
+    checkCompiled("var.8 ? (var.16 ? 1 : 2) : (var.32 ? 3 : 4)");
+    checkCompiled("var.8 * 3 * var.16 * 5 + (var.8 | 1 | var.16) - (var.8 & 0xf0 & var.16) + (var.8 ^ 1 ^ var.32)");
+    checkCompiled("(var.8 > 1 && var.16 < 0x10000) || !(var.32 == 0 ? 1 : b@[var.32 & 0xff] != 0x10)");
+
+    // Deeper than the stack kept in local storage
+    std::string input = "var.8";
+    for (int i = 0; i < 100; i++)
+        input = "(var.8 - " + input + ")";
+    checkCompiled(input.c_str());
+
+    Emulator emulator = { 0, { 0, 0, 0, 0 } };
+    CompiledResolver r(&emulator);
+    ParserLessOop::Expr* expr = ParserLessOop::exprParse("count(1, 2) / (var.8 - var.8) + count()", r);
+    ParserLessOop::ExprBytecode code;
+    code.compile(expr);
+    callCount = 0;
+    std::string result = compiledToString(code);
+    expect(result == "division by zero." && callCount == 0, "bytecode: dividend is not evaluated when the divisor is 0");
+    expect(code.stackSize() == 3, "bytecode: stack size");
+    ParserLessOop::ExprRegisterCode registerCode;
+    registerCode.compile(expr);
+    callCount = 0;
+    result = compiledToString(registerCode);
+    expect(result == "division by zero." && callCount == 0,
+        "register code: dividend is not evaluated when the divisor is 0");
+    ParserLessOop::exprFree(expr);
+
+    // Constant operands are immediates, also on the left of commutative operators and comparisons
+    expr = ParserLessOop::exprParse("4 + (var_32 / 4 - (32 + var_32)) * 19 - var_32", r);
+    registerCode.compile(expr);
+    expect(registerCode.instructionCount() == 10 && registerCode.slotCount() == 2, "register code: immediates");
+    ParserLessOop::exprFree(expr);
+    expr = ParserLessOop::exprParse("1 < var.8", r);
+    registerCode.compile(expr);
+    expect(registerCode.instructionCount() == 3 && compiledToString(registerCode) == "1",
+        "register code: comparison with a constant on the left");
+    ParserLessOop::exprFree(expr);
+
+    // Slots are reused once their value has been read for the last time
+    input = "var.8";
+    for (int i = 0; i < 100; i++)
+        input += " - var.8";
+    expr = ParserLessOop::exprParse(input.c_str(), r);
+    registerCode.compile(expr);
+    expect(registerCode.slotCount() == 2 && compiledToString(registerCode) == "-21582",
+        "register code: slots are reused");
+    ParserLessOop::exprFree(expr);
+}
+
+// The legacy constructor takes any printf format, possibly from a temporary buffer, and formats it right away
+static void checkLegacyError()
+{
+    char format[64];
+    strcpy(format, "%ld %5d|%-3s|%x %d %d %d");
+    ExprError error(format, 123456789L, 42, "ab", 255, 5, 6, 7);
+    strcpy(format, "overwritten");
+    ExprError copy(error);
+    ExprError assigned;
+    assigned = error;
+    const char* expected = "123456789    42|ab |ff 5 6 7";
+    expect(!strcmp(error.message(), expected) && !strcmp(copy.message(), expected)
+        && !strcmp(assigned.message(), expected) && error.status() == EXPR_ERROR, "legacy error message");
+}
+
+// Messages of errors shared between threads are formatted once, all threads see the same buffer
+static void checkSharedError()
+{
+    const ExprError error(EXPR_UNKNOWN_IDENTIFIER, 4, "unknown identifier \"%.*s\" at %d", 3, "abcdef", 4);
+    const char* messages[4];
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; t++)
+        threads.push_back(std::thread([&, t]() { messages[t] = error.message(); }));
+    for (size_t t = 0; t < threads.size(); t++)
+        threads[t].join();
+    expect(!strcmp(messages[0], "unknown identifier \"abc\" at 4") && messages[1] == messages[0]
+        && messages[2] == messages[0] && messages[3] == messages[0], "error: concurrent message()");
+}
+
 int main()
 {
     check("0", 0);
@@ -165,10 +1393,28 @@ int main()
     check("0o777", 0777);
     check("0o345", 0345);
     check("0o0", 0);
+    check("0x12345678", 0x12345678);
+    check("0xDEADbeef", (ExprValue)0xdeadbeef);
+    check("0x123456789abcdef0", (ExprValue)0x9abcdef0);
+    check("0x0000000000000001", 1);
+    check("0b10101010101010101010101010101010", (ExprValue)0xaaaaaaaa);
+    check("0b0000000011111111", 0xff);
+    check("0b1000000000000000000000000000000000000001", 1);
+    check("0o12345670", 012345670);
+    check("0o1234567012", 0xa72ee0a);
+    check("0o777777777777", (ExprValue)0xffffffff);
+    check("12345678", 12345678);
+    check("1234567890", 1234567890);
+    check("4294967295", -1);
+    check("99999999999", 1215752191);
     check("$1234", 0x1234);
+    check("$FEDCBA98", (ExprValue)0xfedcba98);
+    check("#0123456789", 0x23456789);
     check("#1234", 0x1234);
     check("$", PC_VALUE);
     check("\t4+   48", 4+48);
+    check("4                +                                48                                ", 4+48);
+    check("\r\n\t 4 \t\r\n\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t+ 48", 4+48);
     check("8 + 16-3", 8+16-3);
     check("9*4", 9*4);
     check("9*4+3", 9*4+3);
@@ -273,6 +1519,15 @@ int main()
     checkError("0b0_", "syntax error in binary number.");
     checkError("0b3", "syntax error in binary number.");
     checkError("0bc", "syntax error in binary number.");
+    checkError("0x12345678g", "syntax error in hexadecimal number.");
+    checkError("0x1234567_", "syntax error in hexadecimal number.");
+    checkError("$1234567z", "syntax error in hexadecimal number.");
+    checkError("0b000000012", "syntax error in binary number.");
+    checkError("0b11111111.", "syntax error in binary number.");
+    checkError("0o123456789", "syntax error in octal number.");
+    checkError("0o12345670_", "syntax error in octal number.");
+    checkError("123456789a", "syntax error in number.");
+    checkError("12345678.", "syntax error in number.");
     checkError("0o8", "syntax error in octal number.");
     checkError("0o358", "syntax error in octal number.");
     checkError("0o3.", "syntax error in octal number.");
@@ -298,6 +1553,18 @@ int main()
     checkError("var .32", "unknown identifier 'var'.");
     checkError("abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwx", "unknown identifier 'abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwx'.");
     checkError("abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxy", "identifier too long.");
+    checkError("abcdefghijklmno", "unknown identifier 'abcdefghijklmno'.");
+    checkError("abcdefghijklmno+1", "unknown identifier 'abcdefghijklmno'.");
+    checkError("abcdefghijklmnop", "unknown identifier 'abcdefghijklmnop'.");
+    checkError("abcdefghijklmnop+1", "unknown identifier 'abcdefghijklmnop'.");
+    checkError("abcdefghijklmnopq", "unknown identifier 'abcdefghijklmnopq'.");
+    checkError("abcdefghijklmnopq+1", "unknown identifier 'abcdefghijklmnopq'.");
+    checkError("very.long.module.label_name0123", "unknown identifier 'very.long.module.label_name0123'.");
+    checkError("very.long.module.label_name0123+1", "unknown identifier 'very.long.module.label_name0123'.");
+    checkError("very.long.module.label_name01234", "unknown identifier 'very.long.module.label_name01234'.");
+    checkError("very.long.module.label_name01234+1", "unknown identifier 'very.long.module.label_name01234'.");
+    checkError("very.long.module.label_name012345", "unknown identifier 'very.long.module.label_name012345'.");
+    checkError("very.long.module.label_name012345+1", "unknown identifier 'very.long.module.label_name012345'.");
     checkError("fn0", "unknown identifier 'fn0'.");
     checkError("fn0(1)", "invalid number of arguments for function 'fn0' (expected 0, got 1).");
     checkError("fn1(1,2)", "invalid number of arguments for function 'fn1' (expected 1, got 2).");
@@ -320,6 +1587,57 @@ int main()
     checkError("2/0", "division by zero.");
     checkError("3 % (1 - 1)", "division by zero.");
 
+    checkN("4+5garbage", 3, 4+5);
+    checkN("var.8.1", 5, 0xda);
+    checkN("fn1(0x1111)+1", 11, 0x8888 + 0x1111);
+    checkN("0x12", 3, 1);
+    checkErrorN("<<", 0, "syntax error in expression.");
+    checkErrorN("1+2", 2, "syntax error in expression.");
+    checkN("0xfg", 3, 15);
+    checkErrorN("0xg1", 3, "syntax error in hexadecimal number.");
+    checkErrorN("var.8.1", 6, "unknown identifier 'var.8.'.");
+    checkErrorN("fn1(1)", 3, "unknown identifier 'fn1'.");
+    checkErrorN("1+\0", 3, "unexpected character '\\0'.");
+
+    const char* batch = "1 + 2\n\n  var.16 * fn1(3)\r\n0x\n(4\n0b1111000011110000 - $\n";
+    checkBatch(batch, '\n', 0, 1+2);
+    checkBatchError(batch, '\n', 1, "syntax error in expression.");
+    checkBatch(batch, '\n', 2, 0xcada * (0x8888 + 3));
+    checkBatchError(batch, '\n', 3, "syntax error in hexadecimal number.");
+    checkBatchError(batch, '\n', 4, "missing ')'.");
+    checkBatch(batch, '\n', 5, 0xf0f0 - PC_VALUE);
+    checkBatch("fn2(4, 5); var.8; 9", ';', 0, 0x9999 + 4 * 5);
+    checkBatch("fn2(4, 5); var.8; 9", ';', 1, 0xda);
+    checkBatch("fn2(4, 5); var.8; 9", ';', 2, 9);
+
+    checkSymbols();
+    checkArena();
+    checkCache();
+    checkHashCons();
+    checkCompileBatch();
+    checkIncremental();
+    checkResolveFunction();
+    checkCompileResolved();
+    checkVariadic();
+    checkUserCallbacks();
+    checkConstantSymbols();
+    checkFold();
+    checkSimplify();
+    checkFlatten();
+    checkCompiled();
+
+    checkTryParse("1 + var.8", EXPR_OK, EXPR_NO_POSITION, "");
+    checkTryParse("1 + (2 * 3", EXPR_SYNTAX_ERROR, 10, "missing ')'.");
+    checkTryParse("fn1(1, 2 +", EXPR_SYNTAX_ERROR, 10, "syntax error in expression.");
+    checkTryParse("1 ? 2 + 3 4", EXPR_SYNTAX_ERROR, 10, "missing ':'.");
+    checkTryParse("(1 + 2) * 0x1g", EXPR_INVALID_NUMBER, 10, "syntax error in hexadecimal number.");
+    checkTryParse("var.8 + `", EXPR_INVALID_CHARACTER, 8, "unexpected character '`'.");
+    checkTryParse("2 * unknownVariable", EXPR_UNKNOWN_IDENTIFIER, 4, "unknown identifier 'unknownVariable'.");
+    checkTryParse("1 + q@[0x1515]", EXPR_UNKNOWN_DATA_TYPE, 14, "unknown data type 'q'.");
+    checkTryParse("fn2(1, 2, 3)", EXPR_INVALID_ARGUMENT_COUNT, 12, "invalid number of arguments for function 'fn2' (expected 2, got 3).");
+    checkLegacyError();
+    checkSharedError();
+
     printf("----------\n");
     if (failed)
         printf("ERROR! %d total, %d passed, %d failed\n", total, passed, failed);